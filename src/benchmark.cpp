@@ -18,12 +18,28 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <istream>
+#include <memory>
+#include <sstream>
+#include <thread>
 #include <vector>
 
+#include "engine.h"
+#include "evaluate.h"
+#include "misc.h"
+#include "movegen.h"
 #include "position.h"
+#include "thread.h"
+#include "tt.h"
+#include "uci.h"
 
 using namespace std;
 
@@ -92,8 +108,360 @@ const vector<string> Defaults = {
   "setoption name UCI_Chess960 value false"
 };
 
+// BenchPosition is a default position set up for microbench(), together with
+// its setup states and its legal moves
+struct BenchPosition {
+  StateListPtr states;
+  Position pos;
+  std::vector<Move> moves;
+};
+
+// Kernel is the result of one timed microbench() kernel
+struct Kernel {
+  string name;
+  uint64_t ops;
+  double ns;
+};
+
+// ScalingPoint is the result of the searches of microbench() for a thread count
+struct ScalingPoint {
+  size_t threads;
+  uint64_t nodes;
+  TimePoint ms;
+};
+
+volatile uint64_t Sink; // Keeps the results of the kernels alive
+
+// setup_position() sets pos as the given line of Defaults, like the UCI
+// "position fen" command would do, including the moves after the FEN
+void setup_position(Position& pos, StateListPtr& states, const string& line, bool chess960,
+                    Thread* th = Threads.main()) {
+
+  size_t m = line.find(" moves ");
+
+  states = StateListPtr(new std::deque<StateInfo>(1));
+  pos.set(line.substr(0, m), chess960, &states->back(), th);
+
+  if (m == string::npos)
+      return;
+
+  istringstream ss(line.substr(m + 7));
+  string token;
+  Move move;
+
+  while (ss >> token && (move = UCI::to_move(pos, token)) != MOVE_NONE)
+  {
+      states->emplace_back();
+      pos.do_move(move, states->back());
+  }
+}
+
+// read_fens() appends the non-empty lines of a FEN or EPD file to fens
+bool read_fens(const string& fenFile, vector<string>& fens) {
+
+  string fen;
+  ifstream file(fenFile);
+
+  if (!file.is_open())
+      return false;
+
+  while (getline(file, fen))
+      if (!fen.empty())
+          fens.push_back(fen);
+
+  return true;
+}
+
+// time_kernel() calls f(), which returns the number of operations it did,
+// until the time budget is spent, and returns the totals
+template<typename F>
+Kernel time_kernel(const string& name, F f) {
+
+  constexpr int64_t BudgetNs = 200 * 1000 * 1000;
+  auto start = std::chrono::steady_clock::now();
+  uint64_t ops = 0;
+  int64_t ns;
+
+  do ops += f();
+  while ((ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - start).count()) < BudgetNs);
+
+  return { name, ops, double(ns) };
+}
+
 } // namespace
 
+
+/// microbench() times the kernels of each subsystem over the default bench
+/// positions, then the search speed for 1, 2, 4... up to the given number of
+/// threads, so that a speed regression can be tracked to its component. The
+/// arguments are the search time per position in ms, the maximum number of
+/// threads and the output format: text, csv or json. It is also a profile
+/// workload for pgo-builds, see the Makefile.
+///
+/// microbench -> kernels, then 100 ms searches with 1 thread
+/// microbench 500 8 csv -> ... 500 ms searches with 1, 2, 4, 8 threads, as CSV
+/// microbench json -> kernels, then 100 ms searches with 1 thread, as JSON
+///
+/// The format may come anywhere, the numbers are taken in order. A missing one
+/// takes its default, and any other token, including a non-positive number, is
+/// reported and ignored: a movetime of 0 would mean no limit and the searches
+/// would never end.
+
+void microbench(istream& is) {
+
+  int numbers[] = { 100, 1 }; // Movetime, max threads
+  size_t count = 0;
+  string format = "text", token;
+
+  while (is >> token)
+  {
+      int v = 0;
+      istringstream ss(token);
+
+      if (token == "text" || token == "csv" || token == "json")
+          format = token;
+
+      else if (count < 2 && (ss >> v) && ss.eof() && v > 0)
+          numbers[count++] = v;
+
+      else
+          sync_cout << "info string microbench: ignoring '" << token << "'" << sync_endl;
+  }
+
+  int movetime      = numbers[0];
+  size_t maxThreads = size_t(numbers[1]);
+
+  const size_t userThreads = size_t(Options["Threads"]);
+  Search::clear(MainEngine);
+
+  // Set up the positions once, they are kept alive for all the kernels
+  std::vector<std::unique_ptr<BenchPosition>> list;
+  bool chess960 = false;
+
+  for (const string& line : Defaults)
+      if (line.find("setoption") != string::npos)
+          chess960 = line.find("true") != string::npos;
+      else
+      {
+          list.emplace_back(new BenchPosition);
+          setup_position(list.back()->pos, list.back()->states, line, chess960);
+
+          for (Move m : MoveList<LEGAL>(list.back()->pos))
+              list.back()->moves.push_back(m);
+      }
+
+  // The eval kernels measure the evaluation, not the eval cache
+  Threads.main()->evalCache.resize(0);
+
+  struct alignas(64) Accumulator { int16_t v[HIDDEN_BIAS]; };
+  std::vector<Accumulator> accs(list.size());
+  std::vector<Kernel> kernels;
+  PRNG rng(1070372); // Random keys, so that the TT kernels miss the caches
+  constexpr int TTOps = 4096;
+
+  kernels.push_back(time_kernel("movegen_legal", [&]() {
+      uint64_t n = 0;
+      for (auto& bp : list)
+          n += MoveList<LEGAL>(bp->pos).size();
+      Sink = Sink + n;
+      return list.size();
+  }));
+
+  kernels.push_back(time_kernel("do_undo_move", [&]() {
+      StateInfo st;
+      uint64_t n = 0;
+      for (auto& bp : list)
+          for (Move m : bp->moves)
+          {
+              bp->pos.do_move(m, st);
+              bp->pos.undo_move(m);
+              ++n;
+          }
+      return n;
+  }));
+
+  kernels.push_back(time_kernel("nnue_refresh", [&]() {
+      for (size_t i = 0; i < list.size(); ++i)
+      {
+          const Position& pos = list[i]->pos;
+          nnue.init_accumulator(accs[i].v, HIDDEN_BIAS);
+
+          for (Bitboard b = pos.pieces(); b; )
+          {
+              Square s = pop_lsb(&b);
+              nnue.activate(accs[i].v, HIDDEN_BIAS, input_sq(pos.piece_on(s), s));
+          }
+      }
+      return list.size();
+  }));
+
+  kernels.push_back(time_kernel("nnue_update", [&]() {
+      Accumulator dst;
+      DirtyFeatures dirty;
+      uint64_t n = 0;
+      for (size_t i = 0; i < list.size(); ++i)
+          for (Move m : list[i]->moves)
+          {
+              list[i]->pos.dirty_features(m, dirty);
+              nnue.update(dst.v, accs[i].v, HIDDEN_BIAS,
+                          dirty.added, dirty.addCount, dirty.removed, dirty.removeCount);
+              ++n;
+          }
+      Sink = Sink + dst.v[0];
+      return n;
+  }));
+
+  kernels.push_back(time_kernel("nnue_output", [&]() {
+      int32_t sum = 0;
+      for (Accumulator& acc : accs)
+          sum += nnue.output(acc.v, HIDDEN_BIAS);
+      Sink = Sink + sum;
+      return accs.size();
+  }));
+
+  kernels.push_back(time_kernel("nnue_eval_after_move", [&]() {
+      StateInfo st;
+      int sum = 0, n = 0;
+      for (auto& bp : list)
+          for (Move m : bp->moves)
+          {
+              bp->pos.do_move(m, st);
+              sum += Eval::evaluate<Eval::NNUE>(bp->pos);
+              bp->pos.undo_move(m);
+              ++n;
+          }
+      Sink = Sink + sum;
+      return n;
+  }));
+
+#ifndef NNUE_ONLY
+  kernels.push_back(time_kernel("eval_classical", [&]() {
+      int sum = 0, n = 0;
+      for (auto& bp : list)
+          if (!bp->pos.checkers())
+          {
+              sum += Eval::evaluate<Eval::CLASSICAL>(bp->pos);
+              ++n;
+          }
+      Sink = Sink + sum;
+      return n;
+  }));
+#endif
+
+  kernels.push_back(time_kernel("tt_probe", [&]() {
+      bool found;
+      TTData ttData;
+      uint64_t n = 0;
+      for (int i = 0; i < TTOps; ++i)
+          n += bool(TT.probe(rng.rand<Key>(), found, ttData)) + found;
+      Sink = Sink + n;
+      return TTOps;
+  }));
+
+  kernels.push_back(time_kernel("tt_probe_save", [&]() {
+      bool found;
+      TTData ttData;
+      for (int i = 0; i < TTOps; ++i)
+      {
+          Key k = rng.rand<Key>();
+          TT.probe(k, found, ttData)->save(k, VALUE_ZERO, false, BOUND_EXACT, Depth(k & 15), MOVE_NONE, VALUE_ZERO, TT.generation());
+      }
+      return TTOps;
+  }));
+
+  Threads.main()->run_custom_job([]() { // On the node of the main thread
+      Threads.main()->evalCache.resize(size_t(Options["EvalCache"]));
+  });
+  Threads.main()->wait_for_job_finished();
+
+  // Search each position for movetime ms with an increasing number of threads
+  std::vector<ScalingPoint> scaling;
+
+  for (size_t threads = 1; threads <= maxThreads; threads = threads < maxThreads ? std::min(2 * threads, maxThreads) : threads + 1)
+  {
+      Options["Threads"] = std::to_string(threads);
+      Search::clear(MainEngine);
+
+      ScalingPoint point = { threads, 0, 0 };
+      chess960 = false;
+
+      for (const string& line : Defaults)
+          if (line.find("setoption") != string::npos)
+              chess960 = line.find("true") != string::npos;
+          else
+          {
+              StateListPtr states;
+              Position pos;
+              Search::LimitsType limits;
+
+              setup_position(pos, states, line, chess960);
+              limits.movetime = movetime;
+              limits.startTime = now();
+              TimePoint start = now();
+
+              Threads.start_thinking(pos, states, limits);
+              Threads.main()->wait_for_search_finished();
+
+              point.ms += now() - start;
+              point.nodes += Threads.nodes_searched();
+          }
+
+      scaling.push_back(point);
+  }
+
+  if (Threads.size() != userThreads)
+      Options["Threads"] = std::to_string(userThreads);
+
+  auto nps     = [](const ScalingPoint& p) { return 1000 * p.nodes / std::max(p.ms, TimePoint(1)); };
+  auto speedup = [&](const ScalingPoint& p) { return double(nps(p)) / std::max(nps(scaling[0]), uint64_t(1)); };
+
+  std::ostringstream ss;
+  ss << std::fixed << std::setprecision(2);
+
+  if (format == "csv")
+  {
+      ss << "kernel,ops,ns_per_op,mops_per_second";
+      for (const Kernel& k : kernels)
+          ss << "\n" << k.name << "," << k.ops << "," << k.ns / k.ops << "," << 1000 * k.ops / k.ns;
+
+      ss << "\n\nthreads,nodes,ms,nps,speedup";
+      for (const ScalingPoint& p : scaling)
+          ss << "\n" << p.threads << "," << p.nodes << "," << p.ms << "," << nps(p) << "," << speedup(p);
+  }
+  else if (format == "json")
+  {
+      ss << "{\n  \"kernels\": [";
+      for (size_t i = 0; i < kernels.size(); ++i)
+          ss << (i ? "," : "") << "\n    { \"name\": \"" << kernels[i].name
+             << "\", \"ops\": " << kernels[i].ops
+             << ", \"ns_per_op\": " << kernels[i].ns / kernels[i].ops << " }";
+
+      ss << "\n  ],\n  \"search\": [";
+      for (size_t i = 0; i < scaling.size(); ++i)
+          ss << (i ? "," : "") << "\n    { \"threads\": " << scaling[i].threads
+             << ", \"nodes\": " << scaling[i].nodes << ", \"ms\": " << scaling[i].ms
+             << ", \"nps\": " << nps(scaling[i]) << ", \"speedup\": " << speedup(scaling[i]) << " }";
+      ss << "\n  ]\n}";
+  }
+  else
+  {
+      ss << "\n===========================";
+      for (const Kernel& k : kernels)
+          ss << "\n" << std::left << std::setw(22) << k.name << std::right
+             << std::setw(10) << k.ns / k.ops << " ns/op" << std::setw(10) << 1000 * k.ops / k.ns << " Mops/s";
+
+      for (const ScalingPoint& p : scaling)
+          ss << "\nThreads " << std::setw(4) << p.threads << std::setw(14) << nps(p) << " nps"
+             << std::setw(8) << speedup(p) << "x";
+  }
+
+  sync_cout << ss.str() << sync_endl;
+
+  Search::clear(MainEngine); // The kernels filled the TT with junk
+}
+
+
 /// setup_bench() builds a list of UCI commands to be run by bench. There
 /// are five parameters: TT size in MB, number of search threads that
 /// should be used, the limit value spent for each position, a file name
@@ -126,22 +494,10 @@ vector<string> setup_bench(const Position& current, istream& is) {
   else if (fenFile == "current")
       fens.push_back(current.fen());
 
-  else
+  else if (!read_fens(fenFile, fens))
   {
-      string fen;
-      ifstream file(fenFile);
-
-      if (!file.is_open())
-      {
-          cerr << "Unable to open file " << fenFile << endl;
-          exit(EXIT_FAILURE);
-      }
-
-      while (getline(file, fen))
-          if (!fen.empty())
-              fens.push_back(fen);
-
-      file.close();
+      cerr << "Unable to open file " << fenFile << endl;
+      exit(EXIT_FAILURE);
   }
 
   list.emplace_back("setoption name Threads value " + threads);
@@ -159,3 +515,268 @@ vector<string> setup_bench(const Position& current, istream& is) {
 
   return list;
 }
+
+
+/// analyze() searches each position of a FEN or EPD file on its own, with one
+/// position per worker. A worker is an Engine with a single thread and a small
+/// private hash, so that the throughput scales like independent processes
+/// instead of splitting each search over a Lazy SMP pool. Each result is
+/// printed as soon as it is ready, out of order, after the line number of its
+/// position:
+///
+/// <n> bestmove <move> depth <d> seldepth <sd> multipv 1 score <s> nodes ... pv ...
+///
+/// The limit is depth (default 13), nodes or movetime, as for 'go'. There are
+/// as many workers as Threads and the Hash is split among them, unless given.
+///
+/// analyze lines.epd depth 12 -> search each position to depth 12
+/// analyze lines.epd nodes 100000 workers 32 hash 8 -> 32 workers of 8 MB
+
+void analyze(istream& is) {
+
+  string fenFile, token;
+  vector<string> fens;
+  Search::LimitsType limits;
+  size_t workers = size_t(Options["Threads"]);
+  size_t hashMB = 0;
+
+  is >> fenFile;
+
+  while (is >> token)
+      if (token == "depth")         is >> limits.depth;
+      else if (token == "nodes")    is >> limits.nodes;
+      else if (token == "movetime") is >> limits.movetime;
+      else if (token == "workers")  is >> workers;
+      else if (token == "hash")     is >> hashMB;
+
+  if (!read_fens(fenFile, fens))
+  {
+      sync_cout << "info string Unable to open file " << fenFile << sync_endl;
+      return;
+  }
+
+  if (!limits.depth && !limits.nodes && !limits.movetime)
+      limits.depth = 13;
+
+  workers = std::max(std::min(workers, fens.size()), size_t(1));
+  hashMB = hashMB ? hashMB : std::max(size_t(Options["Hash"]) / workers, size_t(1));
+
+  const bool chess960 = Options["UCI_Chess960"];
+  vector<std::unique_ptr<Engine>> engines;
+
+  for (size_t i = 0; i < workers; ++i)
+  {
+      engines.emplace_back(new Engine);
+      Engine& e = *engines.back();
+
+      e.config = Config;
+      e.config.multiPV = 1;
+      e.silent = true;
+      e.threads.bindingBase = i; // Bind as if they were the threads of one pool
+      e.threads.set(1);
+      e.tt.resize(hashMB);
+      Search::clear(e);
+  }
+
+  std::atomic<size_t> next(0);
+  std::atomic<uint64_t> nodes(0);
+  TimePoint elapsed = now();
+
+  // Each worker is driven by a thread of its own, which takes the next position
+  // and blocks until the search of its engine is done
+  auto drive = [&](Engine& e) {
+
+      StateListPtr states;
+      Position pos;
+      size_t i;
+
+      while ((i = next++) < fens.size())
+      {
+          Search::LimitsType l = limits;
+          l.startTime = now();
+
+          setup_position(pos, states, fens[i], chess960, e.threads.main());
+          e.threads.start_thinking(pos, states, l);
+          e.threads.main()->wait_for_search_finished();
+
+          const MainThread* th = e.threads.main();
+          const Search::RootMove& rm = th->rootMoves[0];
+          nodes += e.threads.nodes_searched();
+
+          if (rm.pv[0] == MOVE_NONE)
+              sync_cout << i + 1 << " bestmove (none) score "
+                        << UCI::value(th->rootPos.checkers() ? -VALUE_MATE : VALUE_DRAW) << sync_endl;
+          else
+              sync_cout << i + 1 << " bestmove " << UCI::move(rm.pv[0], chess960)
+                        << UCI::pv(th->rootPos, th->completedDepth, -VALUE_INFINITE, VALUE_INFINITE).substr(4)
+                        << sync_endl;
+      }
+  };
+
+  vector<std::thread> drivers;
+
+  for (auto& e : engines)
+      drivers.emplace_back(drive, std::ref(*e));
+
+  for (std::thread& t : drivers)
+      t.join();
+
+  elapsed = now() - elapsed + 1; // Ensure positivity to avoid a 'divide by zero'
+
+  cerr << "\n==========================="
+       << "\nPositions       : " << fens.size()
+       << "\nWorkers         : " << workers << " x " << hashMB << " MB"
+       << "\nTotal time (ms) : " << elapsed
+       << "\nNodes searched  : " << nodes
+       << "\nNodes/second    : " << 1000 * nodes / elapsed
+       << "\nPositions/second: " << 1000.0 * fens.size() / elapsed << endl;
+}
+
+
+/// evalstream() scores all the positions of a file with the network, spread
+/// over all the threads, for filtering large data sets. The input is either
+/// one FEN per line or an array of PackedPosition, the output an array of
+/// int16_t in input order with the raw Position::nnue_output(), from White's
+/// point of view, without tempo or eval cache, clamped to [-32767, 32767].
+/// Packed records that Position::set() rejects score -32768. The file is processed in
+/// chunks, the next one being read while the threads evaluate the current.
+///
+/// evalstream fen data.fen scores.bin
+/// evalstream packed data.bin scores.bin
+
+void evalstream(istream& is) {
+
+  constexpr size_t ChunkSize = 1 << 16;
+  constexpr size_t BlockSize = 256; // Positions taken at once by a thread
+
+  string format, inFile, outFile;
+  is >> format >> inFile >> outFile;
+
+  const bool packed = format == "packed";
+  const bool chess960 = Options["UCI_Chess960"];
+  ifstream in(inFile, packed ? ios::binary : ios::in);
+  ofstream out(outFile, ios::binary);
+
+  if (!in || !out)
+  {
+      sync_cout << "info string Unable to open " << (!in ? inFile : outFile) << sync_endl;
+      return;
+  }
+
+  nnue.verify();
+
+  // Double buffered chunks: while thread jobs evaluate one, the next is read
+  struct Chunk {
+    vector<PackedPosition> packed;
+    vector<string> fens;
+    vector<int16_t> values;
+    size_t size;
+  } chunks[2];
+
+  auto read_chunk = [&](Chunk& c) {
+      if (packed)
+      {
+          c.packed.resize(ChunkSize);
+          in.read(reinterpret_cast<char*>(c.packed.data()), ChunkSize * sizeof(PackedPosition));
+          c.size = size_t(in.gcount()) / sizeof(PackedPosition);
+      }
+      else
+      {
+          c.fens.resize(ChunkSize);
+          c.size = 0;
+          while (c.size < ChunkSize && getline(in, c.fens[c.size]))
+              c.size += !c.fens[c.size].empty();
+      }
+      c.values.resize(c.size);
+  };
+
+  std::atomic<size_t> next(0);
+  std::atomic<uint64_t> rejected(0);
+  uint64_t total = 0;
+  TimePoint elapsed = now();
+  Threads.main()->wait_for_search_finished();
+  Threads.wait_for_jobs_finished();
+
+  read_chunk(chunks[0]);
+
+  for (int k = 0; chunks[k].size; k ^= 1)
+  {
+      Chunk& c = chunks[k];
+      next = 0;
+
+      for (Thread* th : Threads)
+          th->run_custom_job([&c, &next, &rejected, th, packed, chess960]() {
+
+              StateInfo st;
+              Position pos;
+              size_t i;
+
+              while ((i = next.fetch_add(BlockSize)) < c.size)
+                  for (size_t j = i; j < std::min(i + BlockSize, c.size); ++j)
+                  {
+                      if (packed && !pos.set(c.packed[j], chess960, &st, th))
+                      {
+                          c.values[j] = INT16_MIN;
+                          ++rejected;
+                          continue;
+                      }
+
+                      if (!packed)
+                          pos.set(c.fens[j], chess960, &st, th);
+
+                      c.values[j] = int16_t(std::clamp(int(pos.nnue_output()), -32767, 32767));
+                  }
+          });
+
+      read_chunk(chunks[k ^ 1]);
+      Threads.wait_for_jobs_finished();
+
+      out.write(reinterpret_cast<const char*>(c.values.data()), std::streamsize(c.size * sizeof(int16_t)));
+      total += c.size;
+  }
+
+  elapsed = now() - elapsed + 1; // Ensure positivity to avoid a 'divide by zero'
+
+  cerr << "\n==========================="
+       << "\nPositions       : " << total
+       << "\nRejected        : " << rejected
+       << "\nTotal time (ms) : " << elapsed
+       << "\nEvals/second    : " << 1000 * total / elapsed << endl;
+}
+
+
+/// packfens() converts a file of FENs, one per line, to the PackedPosition
+/// array read by 'evalstream packed'.
+///
+/// packfens data.fen data.bin
+
+void packfens(istream& is) {
+
+  string inFile, outFile, fen;
+  is >> inFile >> outFile;
+
+  ifstream in(inFile);
+  ofstream out(outFile, ios::binary);
+
+  if (!in || !out)
+  {
+      sync_cout << "info string Unable to open " << (!in ? inFile : outFile) << sync_endl;
+      return;
+  }
+
+  StateInfo st;
+  Position pos;
+  PackedPosition pp;
+  uint64_t total = 0;
+
+  while (getline(in, fen))
+      if (!fen.empty())
+      {
+          pos.set(fen, Options["UCI_Chess960"], &st, Threads.main());
+          pos.pack(pp);
+          out.write(reinterpret_cast<const char*>(&pp), sizeof(pp));
+          ++total;
+      }
+
+  sync_cout << "info string Packed " << total << " positions to " << outFile << sync_endl;
+}
@@ -19,6 +19,7 @@
 */
 
 #include <cassert>
+#include <mutex>
 #include <vector>
 #include <bitset>
 
@@ -32,6 +33,7 @@ namespace {
   constexpr unsigned MAX_INDEX = 2*24*64*64; // stm * psq * wksq * bksq = 196608
 
   std::bitset<MAX_INDEX> KPKBitbase;
+  std::once_flag KPKInitialized;
 
   // A KPK bitbase index is an integer in [0, IndexMax] range
   //
@@ -66,40 +68,59 @@ namespace {
     Result result;
   };
 
+  void solve();
+
 } // namespace
 
 
+/// Bitbases::init() solves the KPK bitbase, the first time it is called. Only
+/// the classical evaluation probes it, so it is not solved at startup but by a
+/// pool thread as soon as that evaluation is selected, see UCI::on_use_nnue(),
+/// which 'isready' and 'go' wait for.
+
+void Bitbases::init() {
+
+  std::call_once(KPKInitialized, solve);
+}
+
+
+/// Bitbases::probe() looks up a KPK position. It solves the bitbase first if
+/// init() has not already been run, e.g. by the 'eval' command.
+
 bool Bitbases::probe(Square wksq, Square wpsq, Square bksq, Color stm) {
 
   assert(file_of(wpsq) <= FILE_D);
 
+  init();
+
   return KPKBitbase[index(stm, bksq, wksq, wpsq)];
 }
 
 
-void Bitbases::init() {
+namespace {
 
-  std::vector<KPKPosition> db(MAX_INDEX);
-  unsigned idx, repeat = 1;
+  // solve() computes the KPK bitbase by retrograde analysis
 
-  // Initialize db with known win / draw positions
-  for (idx = 0; idx < MAX_INDEX; ++idx)
-      db[idx] = KPKPosition(idx);
+  void solve() {
 
-  // Iterate through the positions until none of the unknown positions can be
-  // changed to either wins or draws (15 cycles needed).
-  while (repeat)
-      for (repeat = idx = 0; idx < MAX_INDEX; ++idx)
-          repeat |= (db[idx] == UNKNOWN && db[idx].classify(db) != UNKNOWN);
+    std::vector<KPKPosition> db(MAX_INDEX);
+    unsigned idx, repeat = 1;
 
-  // Fill the bitbase with the decisive results
-  for (idx = 0; idx < MAX_INDEX; ++idx)
-      if (db[idx] == WIN)
-          KPKBitbase.set(idx);
-}
+    // Initialize db with known win / draw positions
+    for (idx = 0; idx < MAX_INDEX; ++idx)
+        db[idx] = KPKPosition(idx);
 
+    // Iterate through the positions until none of the unknown positions can be
+    // changed to either wins or draws (15 cycles needed).
+    while (repeat)
+        for (repeat = idx = 0; idx < MAX_INDEX; ++idx)
+            repeat |= (db[idx] == UNKNOWN && db[idx].classify(db) != UNKNOWN);
 
-namespace {
+    // Fill the bitbase with the decisive results
+    for (idx = 0; idx < MAX_INDEX; ++idx)
+        if (db[idx] == WIN)
+            KPKBitbase.set(idx);
+  }
 
   KPKPosition::KPKPosition(unsigned idx) {
 
@@ -32,15 +32,28 @@ Bitboard LineBB[SQUARE_NB][SQUARE_NB];
 Bitboard PseudoAttacks[PIECE_TYPE_NB][SQUARE_NB];
 Bitboard PawnAttacks[COLOR_NB][SQUARE_NB];
 
+#ifndef USE_HQ
 Magic RookMagics[SQUARE_NB];
 Magic BishopMagics[SQUARE_NB];
+#else
+Bitboard FileMask[SQUARE_NB];
+Bitboard DiagonalMask[SQUARE_NB];
+Bitboard AntiDiagonalMask[SQUARE_NB];
+uint8_t  RankAttacks[64][FILE_NB];
+#endif
 
 namespace {
 
+  void init_rays();
+
+#ifndef USE_HQ
   Bitboard RookTable[0x19000];  // To store rook attacks
   Bitboard BishopTable[0x1480]; // To store bishop attacks
 
   void init_magics(PieceType pt, Bitboard table[], Magic magics[]);
+#else
+  void init_lines();
+#endif
 }
 
 
@@ -79,8 +92,14 @@ void Bitboards::init() {
       for (Square s2 = SQ_A1; s2 <= SQ_H8; ++s2)
           SquareDistance[s1][s2] = std::max(distance<File>(s1, s2), distance<Rank>(s1, s2));
 
+  init_rays();
+
+#ifndef USE_HQ
   init_magics(ROOK, RookTable, RookMagics);
   init_magics(BISHOP, BishopTable, BishopMagics);
+#else
+  init_lines();
+#endif
 
   for (Square s1 = SQ_A1; s1 <= SQ_H8; ++s1)
   {
@@ -106,23 +125,90 @@ void Bitboards::init() {
 
 namespace {
 
+  Direction   RookDirections[4] = {NORTH, SOUTH, EAST, WEST};
+  Direction BishopDirections[4] = {NORTH_EAST, SOUTH_EAST, SOUTH_WEST, NORTH_WEST};
+
+  Bitboard Rays[SQUARE_NB][8]; // [square][index in RookDirections, then BishopDirections]
+
+  // init_rays() computes the squares from each square to the board edge in
+  // each direction, for sliding_attack().
+
+  void init_rays() {
+
+    for (Square sq = SQ_A1; sq <= SQ_H8; ++sq)
+        for (int i = 0; i < 8; ++i)
+        {
+            Direction d = i < 4 ? RookDirections[i] : BishopDirections[i - 4];
+            Square s = sq;
+            while (safe_destination(s, d))
+                Rays[sq][i] |= (s += d);
+        }
+  }
+
+  // sliding_attack() is the reference for the slider tables. Along each ray the
+  // attack stops at the nearest blocker, which is the lsb of the blockers for
+  // the directions going up the board and the msb for those going down.
+
   Bitboard sliding_attack(PieceType pt, Square sq, Bitboard occupied) {
 
     Bitboard attacks = 0;
-    Direction   RookDirections[4] = {NORTH, SOUTH, EAST, WEST};
-    Direction BishopDirections[4] = {NORTH_EAST, SOUTH_EAST, SOUTH_WEST, NORTH_WEST};
 
-    for(Direction d : (pt == ROOK ? RookDirections : BishopDirections))
+    for (int i = (pt == ROOK ? 0 : 4); i < (pt == ROOK ? 4 : 8); ++i)
     {
-        Square s = sq;
-        while(safe_destination(s, d) && !(occupied & s))
-            attacks |= (s += d);
+        Direction d = i < 4 ? RookDirections[i] : BishopDirections[i - 4];
+        Bitboard blockers = Rays[sq][i] & occupied;
+
+        attacks |= Rays[sq][i];
+        if (blockers)
+            attacks ^= Rays[d > 0 ? lsb(blockers) : msb(blockers)][i];
     }
 
     return attacks;
   }
 
 
+#ifndef USE_HQ
+
+  // The magics found by the search in init_magics() on 64 bit builds, with the
+  // seeds below. They are used as is, which saves the search at startup.
+  constexpr Bitboard RookMagicInit[SQUARE_NB] = {
+    0x0A80004000801220ULL, 0x8040004010002008ULL, 0x2080200010008008ULL, 0x1100100008210004ULL,
+    0xC200209084020008ULL, 0x2100010004000208ULL, 0x0400081000822421ULL, 0x0200010422048844ULL,
+    0x0800800080400024ULL, 0x0001402000401000ULL, 0x3000801000802001ULL, 0x4400800800100083ULL,
+    0x0904802402480080ULL, 0x4040800400020080ULL, 0x0018808042000100ULL, 0x4040800080004100ULL,
+    0x0040048001458024ULL, 0x00A0004000205000ULL, 0x3100808010002000ULL, 0x4825010010000820ULL,
+    0x5004808008000401ULL, 0x2024818004000A00ULL, 0x0005808002000100ULL, 0x2100060004806104ULL,
+    0x0080400880008421ULL, 0x4062220600410280ULL, 0x010A004A00108022ULL, 0x0000100080080080ULL,
+    0x0021000500080010ULL, 0x0044000202001008ULL, 0x0000100400080102ULL, 0xC020128200040545ULL,
+    0x0080002000400040ULL, 0x0000804000802004ULL, 0x0000120022004080ULL, 0x010A386103001001ULL,
+    0x9010080080800400ULL, 0x8440020080800400ULL, 0x0004228824001001ULL, 0x000000490A000084ULL,
+    0x0080002000504000ULL, 0x200020005000C000ULL, 0x0012088020420010ULL, 0x0010010080080800ULL,
+    0x0085001008010004ULL, 0x0002000204008080ULL, 0x0040413002040008ULL, 0x0000304081020004ULL,
+    0x0080204000800080ULL, 0x3008804000290100ULL, 0x1010100080200080ULL, 0x2008100208028080ULL,
+    0x5000850800910100ULL, 0x8402019004680200ULL, 0x0120911028020400ULL, 0x0000008044010200ULL,
+    0x0020850200244012ULL, 0x0020850200244012ULL, 0x0000102001040841ULL, 0x140900040A100021ULL,
+    0x000200282410A102ULL, 0x000200282410A102ULL, 0x000200282410A102ULL, 0x4048240043802106ULL
+  };
+
+  constexpr Bitboard BishopMagicInit[SQUARE_NB] = {
+    0x40106000A1160020ULL, 0x0020010250810120ULL, 0x2010010220280081ULL, 0x002806004050C040ULL,
+    0x0002021018000000ULL, 0x2001112010000400ULL, 0x0881010120218080ULL, 0x1030820110010500ULL,
+    0x0000120222042400ULL, 0x2000020404040044ULL, 0x8000480094208000ULL, 0x0003422A02000001ULL,
+    0x000A220210100040ULL, 0x8004820202226000ULL, 0x0018234854100800ULL, 0x0100004042101040ULL,
+    0x0004001004082820ULL, 0x0010000810010048ULL, 0x1014004208081300ULL, 0x2080818802044202ULL,
+    0x0040880C00A00100ULL, 0x0080400200522010ULL, 0x0001000188180B04ULL, 0x0080249202020204ULL,
+    0x1004400004100410ULL, 0x00013100A0022206ULL, 0x2148500001040080ULL, 0x4241080011004300ULL,
+    0x4020848004002000ULL, 0x10101380D1004100ULL, 0x0008004422020284ULL, 0x01010A1041008080ULL,
+    0x0808080400082121ULL, 0x0808080400082121ULL, 0x0091128200100C00ULL, 0x0202200802010104ULL,
+    0x8C0A020200440085ULL, 0x01A0008080B10040ULL, 0x0889520080122800ULL, 0x100902022202010AULL,
+    0x04081A0816002000ULL, 0x0000681208005000ULL, 0x8170840041008802ULL, 0x0A00004200810805ULL,
+    0x0830404408210100ULL, 0x2602208106006102ULL, 0x1048300680802628ULL, 0x2602208106006102ULL,
+    0x0602010120110040ULL, 0x0941010801043000ULL, 0x000040440A210428ULL, 0x0008240020880021ULL,
+    0x0400002012048200ULL, 0x00AC102001210220ULL, 0x0220021002009900ULL, 0x84440C080A013080ULL,
+    0x0001008044200440ULL, 0x0004C04410841000ULL, 0x2000500104011130ULL, 0x1A0C010011C20229ULL,
+    0x0044800112202200ULL, 0x0434804908100424ULL, 0x0300404822C08200ULL, 0x48081010008A2A80ULL
+  };
+
   // init_magics() computes all rook and bishop attacks at startup. Magic
   // bitboards are used to look up attacks of sliding pieces. As a reference see
   // www.chessprogramming.org/Magic_Bitboards. In particular, here we use the so
@@ -172,6 +258,16 @@ namespace {
         if (HasPext)
             continue;
 
+        if (Is64Bit)
+        {
+            m.magic = pt == ROOK ? RookMagicInit[s] : BishopMagicInit[s];
+
+            for (int i = 0; i < size; ++i)
+                m.attacks[m.index(occupancy[i])] = reference[i];
+
+            continue;
+        }
+
         PRNG rng(seeds[Is64Bit][rank_of(s)]);
 
         // Find a magic for square 's' picking up an (almost) random number
@@ -202,4 +298,38 @@ namespace {
         }
     }
   }
+
+#else
+
+  // init_lines() computes the line masks and the rank table used by the
+  // hyperbola quintessence, with sliding_attack() as the reference.
+
+  void init_lines() {
+
+    for (Square s = SQ_A1; s <= SQ_H8; ++s)
+    {
+        Bitboard diagonals = sliding_attack(BISHOP, s, 0);
+
+        FileMask[s] = file_bb(s) ^ s;
+
+        while (diagonals)
+        {
+            Square t = pop_lsb(&diagonals);
+            (file_of(t) - file_of(s) == rank_of(t) - rank_of(s) ? DiagonalMask[s]
+                                                                : AntiDiagonalMask[s]) |= t;
+        }
+    }
+
+    // The inner occupancy includes the slider itself, which sliding_attack()
+    // wants to be empty
+    for (unsigned occ = 0; occ < 64; ++occ)
+        for (File f = FILE_A; f <= FILE_H; ++f)
+        {
+            Square s = make_square(f, RANK_1);
+            RankAttacks[occ][f] = uint8_t(sliding_attack(ROOK, s, (Bitboard(occ) << 1) & ~square_bb(s)) & Rank1BB);
+        }
+  }
+
+#endif
+
 }
@@ -80,6 +80,8 @@ extern Bitboard PseudoAttacks[PIECE_TYPE_NB][SQUARE_NB];
 extern Bitboard PawnAttacks[COLOR_NB][SQUARE_NB];
 
 
+#ifndef USE_HQ
+
 /// Magic holds all magic bitboards relevant data for a single square
 struct Magic {
   Bitboard  mask;
@@ -105,6 +107,22 @@ struct Magic {
 extern Magic RookMagics[SQUARE_NB];
 extern Magic BishopMagics[SQUARE_NB];
 
+#else
+
+/// With hyperbola quintessence (sliders=hq, USE_HQ) the slider attacks are
+/// computed from the line masks of the square, with a byte swap to get the
+/// attacks in the negative direction, and from a 512 bytes table for the
+/// ranks. This trades the ~800 KB of the magic tables, which may not fit in
+/// L2 next to the search data, for a few arithmetic operations. The masks
+/// exclude the square itself.
+
+extern Bitboard FileMask[SQUARE_NB];
+extern Bitboard DiagonalMask[SQUARE_NB];
+extern Bitboard AntiDiagonalMask[SQUARE_NB];
+extern uint8_t  RankAttacks[64][FILE_NB]; // [inner occupancy][file]
+
+#endif
+
 inline Bitboard square_bb(Square s) {
   assert(is_ok(s));
   return SquareBB[s];
@@ -303,6 +321,38 @@ inline Bitboard attacks_bb(Square s) {
 }
 
 
+#ifdef USE_HQ
+
+/// byte_swap() mirrors a bitboard vertically
+
+inline Bitboard byte_swap(Bitboard b) {
+
+#if defined(_MSC_VER) && !defined(__clang__)
+  return _byteswap_uint64(b);
+#else
+  return __builtin_bswap64(b);
+#endif
+}
+
+
+/// line_attacks() returns the attacks along the line of the given mask, which
+/// must be a file or a diagonal so that the byte swap reverses it, by means of
+/// the hyperbola quintessence: o - 2r leaves the bits up to the first blocker.
+
+inline Bitboard line_attacks(Square s, Bitboard occupied, Bitboard mask) {
+
+  Bitboard forward = occupied & mask;
+  Bitboard reverse = byte_swap(forward);
+
+  forward -= square_bb(s);
+  reverse -= byte_swap(square_bb(s));
+
+  return (forward ^ byte_swap(reverse)) & mask;
+}
+
+#endif
+
+
 /// attacks_bb(Square, Bitboard) returns the attacks by the given piece
 /// assuming the board is occupied according to the passed Bitboard.
 /// Sliding piece attacks do not continue passed an occupied square.
@@ -314,8 +364,15 @@ inline Bitboard attacks_bb(Square s, Bitboard occupied) {
 
   switch (Pt)
   {
+#ifndef USE_HQ
   case BISHOP: return BishopMagics[s].attacks[BishopMagics[s].index(occupied)];
   case ROOK  : return   RookMagics[s].attacks[  RookMagics[s].index(occupied)];
+#else
+  case BISHOP: return  line_attacks(s, occupied, DiagonalMask[s])
+                     | line_attacks(s, occupied, AntiDiagonalMask[s]);
+  case ROOK  : return  line_attacks(s, occupied, FileMask[s])
+                     | Bitboard(RankAttacks[(occupied >> (8 * rank_of(s) + 1)) & 63][file_of(s)]) << (8 * rank_of(s));
+#endif
   case QUEEN : return attacks_bb<BISHOP>(s, occupied) | attacks_bb<ROOK>(s, occupied);
   default    : return PseudoAttacks[Pt][s];
   }
@@ -339,6 +396,14 @@ inline Bitboard attacks_bb(PieceType pt, Square s, Bitboard occupied) {
 
 inline int popcount(Bitboard b) {
 
+#ifdef USE_DISPATCH
+  if (HasPopCnt)
+  {
+      __asm__ ("popcntq %1, %0" : "=r" (b) : "r" (b));
+      return int(b);
+  }
+#endif
+
 #ifndef USE_POPCNT
 
   union { Bitboard bb; uint16_t u[4]; } v = { b };
@@ -0,0 +1,763 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2020 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef USE_CLUSTER
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <streambuf>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cluster.h"
+#include "position.h"
+#include "tt.h"
+#include "uci.h"
+
+using std::string;
+
+namespace {
+
+  // Record is a TT entry as it is sent, 32 hex digits on a 'ttbatch' line
+  struct Record {
+    Key      key;
+    int16_t  value, eval;
+    uint16_t move;
+    int8_t   depth;
+    uint8_t  pvBound; // bound | pv << 2
+  };
+
+  static_assert(sizeof(Record) == 16, "Record must be 16 bytes");
+
+  constexpr size_t MaxPending = 1 << 16; // Records beyond are dropped
+
+  // A longer line than a full 'ttbatch' means a broken or hostile peer, whose
+  // connection is then closed instead of buffering the line without limit
+  constexpr size_t MaxLineSize = 2 * sizeof(Record) * MaxPending + 64;
+
+  // The options naming local files or hosts, which each node sets on its own:
+  // the master does not mirror them and a worker refuses them.
+  const string LocalOptions[] = { "Debug Log File", "NNUEFile", "SyzygyPath", "Cluster Nodes" };
+
+  // Report is the last complete 'info' line of a worker for the running search
+  struct Report {
+    Depth depth = 0;
+    Value score = VALUE_NONE;
+    std::vector<string> pv;
+  };
+
+  // Node is the connection of the master to one worker
+  struct Node {
+    int fd;
+    std::mutex writeMutex;
+    std::mutex reportMutex; // Guards the three below
+    Report report;
+    int searches = 0;       // Number of 'go' sent
+    int finished = 0;       // Number of 'bestmove' received
+    std::thread reader;
+  };
+
+  std::mutex nodesMutex; // Guards nodes, which init() refills from the UCI thread
+  std::vector<std::unique_ptr<Node>> nodes;
+  std::atomic_bool active { false }; // A master with workers, or a worker
+  bool isWorker = false;
+
+  std::mutex outMutex;
+  std::vector<std::pair<int, Record>> outbox; // With the node it came from, -1 if ours
+
+  std::mutex inMutex;
+  std::vector<Record> inbox;
+  std::atomic_bool inboxReady { false };
+
+  std::thread sender;
+  std::atomic_bool exiting { false };
+
+
+  // write_all() writes the whole buffer to the socket, false if it is closed
+
+  bool write_all(int fd, const char* data, size_t size) {
+
+    while (size)
+    {
+        ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        data += n, size -= n;
+    }
+    return true;
+  }
+
+
+  // SocketBuffer is the streambuf of std::cin and std::cout of a worker
+
+  class SocketBuffer : public std::streambuf {
+
+    int fd;
+    size_t lineSize = 0; // Bytes received since the last newline
+    char in[1 << 16], out[1 << 16];
+
+  public:
+    explicit SocketBuffer(int s) : fd(s) { setp(out, out + sizeof(out)); }
+
+    int underflow() override {
+      ssize_t n = ::recv(fd, in, sizeof(in), 0);
+      if (n <= 0)
+          return traits_type::eof();
+
+      for (ssize_t i = 0; i < n; ++i)
+          lineSize = in[i] == '\n' ? 0 : lineSize + 1;
+
+      if (lineSize > MaxLineSize)
+      {
+          std::cerr << "Cluster: line too long, closing the connection" << std::endl;
+          ::shutdown(fd, SHUT_RDWR);
+          return traits_type::eof(); // Read by the worker as a 'quit'
+      }
+
+      setg(in, in, in + n);
+      return traits_type::to_int_type(*gptr());
+    }
+
+    int overflow(int c) override {
+      if (sync() < 0)
+          return traits_type::eof();
+      if (c != traits_type::eof())
+          *pptr() = char(c), pbump(1);
+      return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+      bool ok = write_all(fd, pbase(), size_t(pptr() - pbase()));
+      setp(out, out + sizeof(out));
+      return ok ? 0 : -1;
+    }
+  };
+
+
+  void append_hex(string& s, const Record& r) {
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&r);
+    for (size_t i = 0; i < sizeof(Record); ++i)
+        s += "0123456789abcdef"[p[i] >> 4], s += "0123456789abcdef"[p[i] & 15];
+  }
+
+  // is_valid() checks that a received record could have been sent by share(),
+  // so that whatever comes from the network cannot put in the hash a depth,
+  // bound, move or value that the search never stores.
+
+  bool is_valid(const Record& r) {
+
+    return   r.pvBound < 8
+          && Bound(r.pvBound & 3) != BOUND_NONE
+          && r.depth >= Cluster::ShareDepth
+          && (Move(r.move) == MOVE_NONE || is_ok(Move(r.move)))
+          && abs(r.value) < VALUE_INFINITE
+          && (abs(r.eval) < VALUE_INFINITE || r.eval == VALUE_NONE);
+  }
+
+  // decode_hex() appends the valid records of a 'ttbatch' line to records
+
+  void decode_hex(const string& hex, std::vector<Record>& records) {
+
+    auto nibble = [](char c) { return c <= '9' ? c - '0' : c - 'a' + 10; };
+
+    for (size_t i = 0; i + 2 * sizeof(Record) <= hex.size(); i += 2 * sizeof(Record))
+    {
+        Record r;
+        uint8_t* p = reinterpret_cast<uint8_t*>(&r);
+        for (size_t j = 0; j < sizeof(Record); ++j)
+            p[j] = uint8_t(nibble(hex[i + 2 * j]) << 4 | nibble(hex[i + 2 * j + 1]));
+
+        if (is_valid(r))
+            records.push_back(r);
+    }
+  }
+
+
+  // option_name() returns the name of the option of a 'setoption' command
+
+  string option_name(const string& cmd) {
+
+    std::istringstream is(cmd);
+    string token, name;
+
+    is >> token >> token; // "setoption name"
+    while (is >> token && token != "value")
+        name += (name.empty() ? "" : " ") + token;
+
+    return name;
+  }
+
+  bool is_local_option(const string& name) {
+
+    UCI::CaseInsensitiveLess less;
+    return std::any_of(std::begin(LocalOptions), std::end(LocalOptions),
+                       [&](const string& o) { return !less(name, o) && !less(o, name); });
+  }
+
+
+  // queue_received() hands the records over to apply(), in the search, and on
+  // the master passes them on to the other workers.
+
+  void queue_received(const std::vector<Record>& records, int origin) {
+
+    if (records.empty())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(inMutex);
+        if (inbox.size() < MaxPending)
+            inbox.insert(inbox.end(), records.begin(), records.end());
+        inboxReady = true;
+    }
+
+    bool relay;
+    {
+        std::lock_guard<std::mutex> lk(nodesMutex);
+        relay = !isWorker && nodes.size() > 1;
+    }
+
+    if (relay)
+    {
+        std::lock_guard<std::mutex> lk(outMutex);
+        for (const Record& r : records)
+            if (outbox.size() < MaxPending)
+                outbox.emplace_back(origin, r);
+    }
+  }
+
+
+  // parse_score() converts the score of an 'info' line back to a Value
+
+  Value parse_score(std::istream& is) {
+
+    string type;
+    int n = 0;
+    is >> type >> n;
+
+    return type == "mate" ? (n > 0 ? mate_in(2 * n - 1) : mated_in(-2 * n))
+                          : Value(n * PawnValueEg / 100);
+  }
+
+
+  // read_info() keeps the last 'info' line of a worker holding a complete
+  // main line, of the search the master is running.
+
+  void read_info(Node& node, std::istringstream& is) {
+
+    Report r;
+    string token;
+    bool bounded = false;
+    int multiPV = 1;
+
+    while (is >> token)
+        if (token == "depth")
+            is >> r.depth;
+        else if (token == "multipv")
+            is >> multiPV;
+        else if (token == "score")
+            r.score = parse_score(is);
+        else if (token == "lowerbound" || token == "upperbound")
+            bounded = true;
+        else if (token == "pv")
+            while (is >> token)
+                r.pv.push_back(token);
+
+    if (r.pv.empty() || r.score == VALUE_NONE || bounded || multiPV != 1)
+        return;
+
+    std::lock_guard<std::mutex> lk(node.reportMutex);
+    if (node.finished + 1 == node.searches)
+        node.report = r;
+  }
+
+
+  // read_loop() reads the lines a worker sends, in the reader thread of its node
+
+  void read_loop(Node& node, int idx) {
+
+    string pending;
+    char buf[1 << 16];
+    ssize_t n;
+
+    while ((n = ::recv(node.fd, buf, sizeof(buf), 0)) > 0)
+    {
+        pending.append(buf, size_t(n));
+
+        size_t start = 0, end;
+        while ((end = pending.find('\n', start)) != string::npos)
+        {
+            std::istringstream is(pending.substr(start, end - start));
+            string token;
+            is >> token;
+            start = end + 1;
+
+            if (token == "ttbatch")
+            {
+                std::vector<Record> records;
+                is >> token;
+                decode_hex(token, records);
+                queue_received(records, idx);
+            }
+            else if (token == "info")
+                read_info(node, is);
+
+            else if (token == "bestmove")
+            {
+                std::lock_guard<std::mutex> lk(node.reportMutex);
+                node.finished++;
+            }
+        }
+        pending.erase(0, start);
+
+        if (pending.size() > MaxLineSize)
+        {
+            sync_cout << "info string Cluster: line too long from worker " << idx + 1
+                      << ", disconnected" << sync_endl;
+            ::shutdown(node.fd, SHUT_RDWR);
+            break;
+        }
+    }
+  }
+
+
+  // send_loop() sends the pending records every SendIntervalMs, in the sender thread
+
+  void send_loop() {
+
+    std::vector<std::pair<int, Record>> batch;
+
+    while (!exiting)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(Cluster::SendIntervalMs));
+
+        {
+            std::lock_guard<std::mutex> lk(outMutex);
+            batch.swap(outbox);
+        }
+
+        if (batch.empty())
+            continue;
+
+        if (isWorker)
+        {
+            string line;
+            for (const auto& e : batch)
+                append_hex(line, e.second);
+
+            sync_cout << "ttbatch " << line << sync_endl;
+        }
+        else
+        {
+            std::lock_guard<std::mutex> nodesLk(nodesMutex);
+
+            for (size_t i = 0; i < nodes.size(); ++i)
+            {
+                string line = "ttbatch ";
+                for (const auto& e : batch)
+                    if (e.first != int(i))
+                        append_hex(line, e.second);
+
+                line += "\n";
+                std::lock_guard<std::mutex> lk(nodes[i]->writeMutex);
+                write_all(nodes[i]->fd, line.data(), line.size());
+            }
+        }
+
+        batch.clear();
+    }
+  }
+
+
+  void start_sender() {
+
+    if (!sender.joinable())
+        sender = std::thread(send_loop);
+  }
+
+
+  // disconnect() takes the nodes out of the list before joining their readers,
+  // which may be waiting for nodesMutex in queue_received().
+
+  void disconnect() {
+
+    active = false;
+
+    std::vector<std::unique_ptr<Node>> closing;
+    {
+        std::lock_guard<std::mutex> lk(nodesMutex);
+        closing.swap(nodes);
+    }
+
+    for (auto& node : closing)
+    {
+        ::shutdown(node->fd, SHUT_RDWR);
+        node->reader.join();
+        ::close(node->fd);
+    }
+  }
+
+
+  // The threads are joined before the globals above are destroyed at exit
+  struct Shutdown {
+   ~Shutdown() {
+      exiting = true;
+      disconnect();
+      if (sender.joinable())
+          sender.join();
+    }
+  } shutdownAtExit;
+
+
+  int connect_to(const string& host, const string& port) {
+
+    addrinfo hints = {}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res))
+        return -1;
+
+    int fd = -1;
+    for (addrinfo* a = res; a && fd < 0; a = a->ai_next)
+        if ((fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol)) >= 0
+            && ::connect(fd, a->ai_addr, a->ai_addrlen) < 0)
+            ::close(fd), fd = -1;
+
+    freeaddrinfo(res);
+
+    if (fd >= 0)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+  }
+
+} // namespace
+
+
+namespace Cluster {
+
+/// Cluster::init() connects the master to the workers given as host:port pairs,
+/// separated by commas or spaces, after closing the previous connections. The
+/// workers get the Threads and Hash options of the master, the later values of
+/// the options are mirrored by send().
+
+void init(const string& list) {
+
+  disconnect();
+
+  std::istringstream ss(list);
+  string item;
+  std::vector<int> fds;
+
+  while (std::getline(ss, item, ',') && item != "<empty>")
+  {
+      std::istringstream is(item);
+      string addr;
+
+      while (is >> addr)
+      {
+          size_t colon = addr.rfind(':');
+          int fd = colon == string::npos ? -1
+                  : connect_to(addr.substr(0, colon), addr.substr(colon + 1));
+
+          if (fd < 0)
+          {
+              sync_cout << "info string Cluster: cannot connect to " << addr << sync_endl;
+              continue;
+          }
+
+          fds.push_back(fd);
+      }
+  }
+
+  if (fds.empty())
+      return;
+
+  {
+      std::lock_guard<std::mutex> lk(nodesMutex);
+
+      for (int fd : fds)
+      {
+          nodes.emplace_back(new Node());
+          nodes.back()->fd = fd;
+      }
+
+      for (size_t i = 0; i < nodes.size(); ++i)
+          nodes[i]->reader = std::thread(read_loop, std::ref(*nodes[i]), int(i));
+  }
+
+  active = true;
+  start_sender();
+
+  send("setoption name Threads value " + std::to_string(int(Options["Threads"])));
+  send("setoption name Hash value " + std::to_string(int(Options["Hash"])));
+
+  sync_cout << "info string Cluster: " << fds.size() << " workers" << sync_endl;
+}
+
+
+/// Cluster::serve() makes this process a worker: it waits for the master on the
+/// port and the local address read from 'is', by default the loopback one, then
+/// reads its commands and writes its output on the connection, in place of the
+/// standard input and output.
+
+bool serve(std::istream& is) {
+
+  string port, host = "127.0.0.1";
+  int one = 1;
+  is >> port >> host;
+
+  addrinfo hints = {}, *res = nullptr;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+  int listener = -1;
+  if (!port.empty() && !getaddrinfo(host.c_str(), port.c_str(), &hints, &res))
+  {
+      listener = ::socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+      setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+      if (   listener >= 0
+          && (::bind(listener, res->ai_addr, res->ai_addrlen) < 0 || ::listen(listener, 1) < 0))
+          ::close(listener), listener = -1;
+
+      freeaddrinfo(res);
+  }
+
+  if (listener < 0)
+  {
+      std::cerr << "Cluster: cannot listen on " << host << " port " << port << std::endl;
+      return false;
+  }
+
+  std::cerr << "Cluster: waiting for the master on " << host << " port " << port << std::endl;
+
+  int fd = ::accept(listener, nullptr, nullptr);
+  ::close(listener);
+
+  if (fd < 0)
+      return false;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  // Never freed, the output may be flushed up to the exit of the process. The
+  // input is not tied, so that reading does not flush the output unlocked.
+  SocketBuffer* buffer = new SocketBuffer(fd);
+  std::cin.tie(nullptr);
+  std::cin.rdbuf(buffer);
+  std::cout.rdbuf(buffer);
+
+  isWorker = true;
+  active = true;
+  start_sender();
+
+  std::cerr << "Cluster: master connected" << std::endl;
+  return true;
+}
+
+
+/// Cluster::mirrored() tells whether the master sends a command of its UCI loop
+/// to the workers: those that set up a search, but not the options of local
+/// files or hosts, see LocalOptions. The 'go' is sent by UCI::go().
+
+bool mirrored(const string& cmd) {
+
+  std::istringstream is(cmd);
+  string token;
+  is >> token;
+
+  return   token == "position" || token == "ucinewgame" || token == "stop"
+        || (token == "setoption" && !is_local_option(option_name(cmd)));
+}
+
+
+/// Cluster::accepted() tells whether a command read by the UCI loop may run. A
+/// worker runs only those its master sends, and 'quit' when the connection is
+/// closed, any other process all of them.
+
+bool accepted(const string& cmd) {
+
+  if (!isWorker)
+      return true;
+
+  std::istringstream is(cmd);
+  string token;
+  is >> token;
+
+  if (   token == "go" || token == "isready" || token == "ttbatch" || token == "quit"
+      || mirrored(cmd))
+      return true;
+
+  std::cerr << "Cluster: refused '" << token.substr(0, 32) << "' from the master" << std::endl;
+  return false;
+}
+
+
+/// Cluster::send() mirrors a command of the master to all the workers. A 'go'
+/// starts a new search, whose reports replace those of the previous one.
+
+void send(const string& cmd) {
+
+  const string line = cmd + "\n";
+  const bool go = cmd.compare(0, 3, "go ") == 0;
+
+  std::lock_guard<std::mutex> nodesLk(nodesMutex);
+
+  for (auto& node : nodes)
+  {
+      if (go)
+      {
+          std::lock_guard<std::mutex> lk(node->reportMutex);
+          node->searches++;
+          node->report = Report();
+      }
+
+      std::lock_guard<std::mutex> lk(node->writeMutex);
+      write_all(node->fd, line.data(), line.size());
+  }
+}
+
+
+/// Cluster::share() queues an entry stored by the search, to be sent with the
+/// next batch.
+
+void share(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev) {
+
+  if (!active.load(std::memory_order_relaxed))
+      return;
+
+  Record r = { k, int16_t(v), int16_t(ev), uint16_t(m), int8_t(d), uint8_t(b | pv << 2) };
+
+  std::lock_guard<std::mutex> lk(outMutex);
+  if (outbox.size() < MaxPending)
+      outbox.emplace_back(-1, r);
+}
+
+
+/// Cluster::receive() reads a 'ttbatch' line of the master, on a worker
+
+void receive(std::istream& is) {
+
+  string hex;
+  std::vector<Record> records;
+
+  is >> hex;
+  decode_hex(hex, records);
+  queue_received(records, -1);
+}
+
+
+/// Cluster::apply() stores the received entries in the hash. It is called by the
+/// main thread during the search, so that the table cannot be resized meanwhile.
+
+void apply(TranspositionTable& tt) {
+
+  if (!inboxReady.load(std::memory_order_relaxed))
+      return;
+
+  std::vector<Record> records;
+  {
+      std::lock_guard<std::mutex> lk(inMutex);
+      records.swap(inbox);
+      inboxReady = false;
+  }
+
+  for (const Record& r : records)
+  {
+      bool found;
+      TTData ttData;
+      TTEntry* tte = tt.probe(r.key, found, ttData);
+      tte->save(r.key, Value(r.value), r.pvBound & 4, Bound(r.pvBound & 3),
+                Depth(r.depth), Move(r.move), Value(r.eval), tt.generation());
+  }
+}
+
+
+/// Cluster::vote() picks the move to play between the best move of the master
+/// and the last ones reported by the workers, weighting the score above the
+/// lowest one by the depth, as ThreadPool::get_best_thread() does. When a
+/// worker wins, 'best' gets its move and score.
+
+void vote(const Position& pos, Search::RootMove& best, Depth depth) {
+
+  struct Candidate { Move move; Value score; Depth depth; size_t node; };
+
+  std::vector<Candidate> candidates = { { best.pv[0], best.score, depth, 0 } };
+
+  std::unique_lock<std::mutex> nodesLk(nodesMutex);
+
+  for (size_t i = 0; i < nodes.size(); ++i)
+  {
+      std::lock_guard<std::mutex> lk(nodes[i]->reportMutex);
+      Report& r = nodes[i]->report;
+
+      Move m = r.pv.empty() ? MOVE_NONE : UCI::to_move(pos, r.pv[0]);
+      if (m != MOVE_NONE && r.depth > 0 && abs(r.score) < VALUE_INFINITE)
+          candidates.push_back({ m, r.score, r.depth, i + 1 });
+  }
+
+  nodesLk.unlock();
+
+  if (candidates.size() == 1 || best.pv[0] == MOVE_NONE)
+      return;
+
+  Value minScore = VALUE_INFINITE;
+  for (const Candidate& c : candidates)
+      minScore = std::min(minScore, c.score);
+
+  std::map<Move, int64_t> votes;
+  for (const Candidate& c : candidates)
+      votes[c.move] += (c.score - minScore + 14) * int(c.depth);
+
+  const Candidate* chosen = &candidates[0];
+  for (const Candidate& c : candidates)
+      if (votes[c.move] > votes[chosen->move])
+          chosen = &c;
+
+  if (chosen->move != best.pv[0])
+  {
+      best.pv.assign(1, chosen->move);
+      best.score = chosen->score;
+
+      sync_cout << "info string Cluster: move of worker " << chosen->node
+                << " at depth " << chosen->depth << sync_endl;
+  }
+}
+
+} // namespace Cluster
+
+#endif // #ifdef USE_CLUSTER
@@ -0,0 +1,75 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2020 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CLUSTER_H_INCLUDED
+#define CLUSTER_H_INCLUDED
+
+#ifdef USE_CLUSTER
+
+#include <istream>
+#include <string>
+
+#include "search.h"
+#include "types.h"
+
+class TranspositionTable;
+
+/// The cluster mode (cluster=yes, USE_CLUSTER, POSIX only) spreads the search
+/// of MainEngine over several machines with plain TCP. The master runs the UCI
+/// front end and mirrors the commands that drive a search to the workers listed
+/// in the "Cluster Nodes" option, as host:port pairs. A worker is started with
+/// 'stockfish worker <port> [address]' and listens on the loopback address
+/// unless given another one. It runs the UCI loop on that socket, but only the
+/// commands the master sends: position, ucinewgame, stop, isready, go, the
+/// hash batches and the options that don't name files or hosts.
+///
+/// The protocol has no authentication or encryption. Whoever can connect to a
+/// worker, or sits between it and the master, can run its searches, read its
+/// output and fill its hash, so the nodes are meant for a trusted network, or
+/// to be listening on loopback behind SSH tunnels. Received hash entries are
+/// range checked and over long lines close the connection, so that a broken
+/// peer can neither corrupt the hash nor exhaust the memory.
+///
+/// Every node runs its own Lazy SMP search of the root. The entries stored at
+/// depth >= ShareDepth are sent in batches every SendIntervalMs, and the master
+/// relays those of each worker to the others. When the search of the master
+/// ends, it stops the workers and votes, like ThreadPool::get_best_thread(),
+/// between its best move and the last ones the workers reported.
+
+namespace Cluster {
+
+constexpr Depth ShareDepth = 8;
+constexpr int SendIntervalMs = 50;
+
+void init(const std::string& nodes);
+bool serve(std::istream& is);
+bool mirrored(const std::string& cmd);
+bool accepted(const std::string& cmd);
+void send(const std::string& cmd);
+void share(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev);
+void receive(std::istream& is);
+void apply(TranspositionTable& tt);
+void vote(const Position& pos, Search::RootMove& best, Depth depth);
+
+} // namespace Cluster
+
+#endif // #ifdef USE_CLUSTER
+
+#endif // #ifndef CLUSTER_H_INCLUDED
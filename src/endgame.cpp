@@ -18,10 +18,12 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cassert>
 
 #include "bitboard.h"
 #include "endgame.h"
+#include "misc.h"
 #include "movegen.h"
 
 namespace {
@@ -69,6 +71,31 @@ namespace Endgames {
 
   std::pair<Map<Value>, Map<ScaleFactor>> maps;
 
+  /// Map::build() tries random multipliers until the endgames fall in distinct
+  /// slots. This takes a few tries, once at startup.
+
+  template<typename T>
+  void Map<T>::build() {
+
+    assert(endgames.size() <= (1 << Bits));
+
+    PRNG rng(1070372);
+    bool collision;
+
+    do {
+        magic = rng.rand<Key>() | 1;
+        std::fill(slots, slots + (1 << Bits), Slot());
+        collision = false;
+
+        for (const auto& e : endgames)
+        {
+            Slot& slot = slots[(e.first * magic) >> (64 - Bits)];
+            collision |= slot.ptr != nullptr;
+            slot = { e.first, e.second.get() };
+        }
+    } while (collision);
+  }
+
   void init() {
 
     add<KPK>("KPK");
@@ -87,6 +114,9 @@ namespace Endgames {
     add<KBPKN>("KBPKN");
     add<KBPPKB>("KBPPKB");
     add<KRPPKRP>("KRPPKRP");
+
+    map<Value>().build();
+    map<ScaleFactor>().build();
   }
 }
 
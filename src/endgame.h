@@ -24,8 +24,8 @@
 #include <memory>
 #include <string>
 #include <type_traits>
-#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "position.h"
 #include "types.h"
@@ -90,13 +90,39 @@ struct Endgame : public EndgameBase<T> {
 
 
 /// The Endgames namespace handles the pointers to endgame evaluation and scaling
-/// base objects in two std::map. We use polymorphism to invoke the actual
+/// base objects in two flat tables. We use polymorphism to invoke the actual
 /// endgame function by calling its virtual operator().
 
 namespace Endgames {
 
   template<typename T> using Ptr = std::unique_ptr<EndgameBase<T>>;
-  template<typename T> using Map = std::unordered_map<Key, Ptr<T>>;
+
+  /// Map is a table indexed by a perfect hash of the material keys of the
+  /// endgames, so that a probe reads a single slot. The set of endgames is
+  /// fixed, so once they are added, build() picks a multiplier for which the
+  /// top bits of key * magic differ for all of them.
+
+  template<typename T>
+  struct Map {
+
+    static constexpr int Bits = 6;
+
+    struct Slot {
+      Key key;
+      const EndgameBase<T>* ptr;
+    };
+
+    void build();
+
+    const EndgameBase<T>* find(Key key) const {
+      const Slot& slot = slots[(key * magic) >> (64 - Bits)];
+      return slot.key == key ? slot.ptr : nullptr;
+    }
+
+    std::vector<std::pair<Key, Ptr<T>>> endgames;
+    Slot slots[1 << Bits] = {};
+    Key magic = 0;
+  };
 
   extern std::pair<Map<Value>, Map<ScaleFactor>> maps;
 
@@ -111,14 +137,13 @@ namespace Endgames {
   void add(const std::string& code) {
 
     StateInfo st;
-    map<T>()[Position().set(code, WHITE, &st).material_key()] = Ptr<T>(new Endgame<E>(WHITE));
-    map<T>()[Position().set(code, BLACK, &st).material_key()] = Ptr<T>(new Endgame<E>(BLACK));
+    map<T>().endgames.emplace_back(Position().set(code, WHITE, &st).material_key(), Ptr<T>(new Endgame<E>(WHITE)));
+    map<T>().endgames.emplace_back(Position().set(code, BLACK, &st).material_key(), Ptr<T>(new Endgame<E>(BLACK)));
   }
 
   template<typename T>
   const EndgameBase<T>* probe(Key key) {
-    auto it = map<T>().find(key);
-    return it != map<T>().end() ? it->second.get() : nullptr;
+    return map<T>().find(key);
   }
 }
 
@@ -0,0 +1,63 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2008 Tord Romstad (Glaurung author)
+  Copyright (C) 2008-2015 Marco Costalba, Joona Kiiski, Tord Romstad
+  Copyright (C) 2015-2020 Marco Costalba, Joona Kiiski, Gary Linscott, Tord Romstad
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ENGINE_H_INCLUDED
+#define ENGINE_H_INCLUDED
+
+#include "search.h"
+#include "thread.h"
+#include "timeman.h"
+#include "tt.h"
+#include "uci.h"
+#include "syzygy/tbprobe.h"
+
+/// Engine keeps together the state of one search session: the thread pool,
+/// the transposition table, the time manager, the limits of the current search
+/// and a typed copy of the settings. The threads reach it through Thread::engine,
+/// so several engines can search concurrently in the same process, each with
+/// its own threads and hash. The network, the tablebases and the UCI options
+/// are shared by all of them; the options drive only MainEngine.
+///
+/// A session is set up with threads.set(n), tt.resize(mb) and Search::clear(),
+/// and after the config is filled in, each 'go' is a threads.start_thinking().
+/// A silent engine prints nothing: the result is in threads.main()->rootMoves
+/// once threads.main()->wait_for_search_finished() returns.
+
+struct Engine {
+
+  Engine() : threads(*this), tt(threads), time(threads), silent(false) {}
+ ~Engine() { threads.set(0); }
+  Engine(const Engine&) = delete;
+  Engine& operator=(const Engine&) = delete;
+
+  ThreadPool threads;
+  TranspositionTable tt;
+  TimeManagement time;
+  Search::LimitsType limits;
+  UCI::Settings config;
+  Tablebases::Probing tb;             // Set at the root by rank_root_moves()
+  Search::PerftTable perft;           // Allocated by each 'go perft'
+  int reductions[MAX_MOVES];          // [depth or moveNumber], see Search::init()
+  bool silent;                        // No info and bestmove output, the caller reads rootMoves
+};
+
+extern Engine MainEngine; // The engine driven by UCI::loop()
+
+#endif // #ifndef ENGINE_H_INCLUDED
@@ -28,6 +28,7 @@
 #include <thread>
 
 #include "bitboard.h"
+#include "engine.h"
 #include "evaluate.h"
 #include "material.h"
 #include "neuralnet.h"
@@ -76,6 +77,8 @@ namespace Trace {
 
 using namespace Trace;
 
+#ifndef NNUE_ONLY
+
 namespace {
 
   // Threshold for lazy and space evaluation
@@ -831,31 +834,6 @@ namespace {
 
     assert(!pos.checkers());
 
-    if (Options["UseNNUE"])
-    {
-        Value v = pos.nnue_output();
-        v = std::min(v, Value(30000));
-
-        // SmFnps Begin
-        
-        if((Options["Randomize Eval"]) || Options["Wait ms"])
-        {
-            // waitms millisecs
-            std::this_thread::sleep_for(std::chrono::milliseconds(Options["Wait ms"]));
-
-            // RandomEval
-            static thread_local std::mt19937_64 rng = [](){return std::mt19937_64(std::time(0));}();
-            std::normal_distribution<float> d(0.0, PawnValueEg);
-            float r = d(rng);
-            r = std::clamp<float>(r, VALUE_TB_LOSS_IN_MAX_PLY + 1, VALUE_TB_WIN_IN_MAX_PLY - 1);
-            v = (int(Options["Randomize Eval"]) * Value(r) + (100 - int(Options["Randomize Eval"])) * v) / 100;
-        }
-        
-        // SmFnps End 
-
-        return (pos.side_to_move() == WHITE ? v : -v) + Tempo;
-    }
-
     // Probe the material hash table
     me = Material::probe(pos);
 
@@ -931,16 +909,133 @@ make_v:
 
 } // namespace
 
+#endif // #ifndef NNUE_ONLY
+
+namespace {
+
+  // nnue_value() computes the network evaluation of the position from the
+  // point of view of the side to move.
+
+  Value nnue_value(const Position& pos) {
+
+    Eval::Cache& cache = pos.this_thread()->evalCache;
+    Value v;
+
+    if (!cache.probe(pos.key(), v))
+    {
+        v = pos.nnue_output();
+        cache.save(pos.key(), v);
+    }
+
+    v = std::min(v, Value(30000));
+
+    // SmFnps Begin
+    const UCI::Settings& config = pos.this_thread()->engine.config;
+
+    if (config.randomizeEval || config.waitMs)
+    {
+        // waitms millisecs
+        std::this_thread::sleep_for(std::chrono::milliseconds(config.waitMs));
+
+        // RandomEval
+        static thread_local std::mt19937_64 rng = [](){return std::mt19937_64(std::time(0));}();
+        std::normal_distribution<float> d(0.0, PawnValueEg);
+        float r = d(rng);
+        r = std::clamp<float>(r, VALUE_TB_LOSS_IN_MAX_PLY + 1, VALUE_TB_WIN_IN_MAX_PLY - 1);
+        v = (config.randomizeEval * Value(r) + (100 - config.randomizeEval) * v) / 100;
+    }
+    
+    // SmFnps End 
+
+    return (pos.side_to_move() == WHITE ? v : -v) + Tempo;
+  }
+
+} // namespace
+
+
+/// Cache::resize() sets the size of the eval cache to the largest power of 2
+/// number of entries that fits in mbSize megabytes, and clears it.
+
+void Eval::Cache::resize(size_t mbSize) {
+
+  size_t count = mbSize * 1024 * 1024 / sizeof(Entry);
+
+  while (count & (count - 1))
+      count &= count - 1;
 
-/// evaluate() is the evaluator for the outer world. It returns a static
-/// evaluation of the position from the point of view of the side to move.
+  table.assign(count, Entry());
+  mask = count ? count - 1 : 0;
+  probes = hits = 0;
+}
+
+
+/// Cache::clear() empties the cache, e.g. when a new network is loaded. The
+/// statistics are kept, so that they cover a whole bench run.
+
+void Eval::Cache::clear() {
+
+  std::fill(table.begin(), table.end(), Entry());
+}
+
+
+/// Cache::probe() looks up the network output of the position with the given
+/// key. The low bits of the key select the entry, the high ones verify it.
+
+bool Eval::Cache::probe(Key key, Value& v) {
+
+  if (table.empty())
+      return false;
+
+  probes.store(probes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+  const Entry& e = table[key & mask];
+
+  if (e.key32 != uint32_t(key >> 32))
+      return false;
+
+  hits.store(hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  v = Value(e.value);
+  return true;
+}
 
-Value Eval::evaluate(const Position& pos) {
+
+/// Cache::save() stores the network output of the position, always replacing
+
+void Eval::Cache::save(Key key, Value v) {
+
+  if (table.empty())
+      return;
+
+  Entry& e = table[key & mask];
+  e.key32 = uint32_t(key >> 32);
+  e.value = v;
+}
+
+
+/// evaluate<M>() returns a static evaluation of the position from the point
+/// of view of the side to move, using the evaluator M. The search picks the
+/// specialization once per "go", so no node has to test the UseNNUE option.
+
+template<>
+Value Eval::evaluate<Eval::NNUE>(const Position& pos) {
+#ifdef SEARCH_STATS
+  ++pos.this_thread()->searchStats.counters[Search::Stats::EVAL_CALL];
+#endif
+  return nnue_value(pos);
+}
+
+#ifndef NNUE_ONLY
+template<>
+Value Eval::evaluate<Eval::CLASSICAL>(const Position& pos) {
+#ifdef SEARCH_STATS
+  ++pos.this_thread()->searchStats.counters[Search::Stats::EVAL_CALL];
+#endif
   return Evaluation<NO_TRACE>(pos).value();
 }
+#endif
 
 
-/// trace() is like evaluate(), but instead of returning a value, it returns
+/// trace() is like evaluate<>(), but instead of returning a value, it returns
 /// a string (suitable for outputting to stdout) that contains the detailed
 /// descriptions and values of each evaluation term. Useful for debugging.
 
@@ -949,17 +1044,19 @@ std::string Eval::trace(const Position& pos) {
   if (pos.checkers())
       return "Total evaluation: none (in check)";
 
+  std::stringstream ss;
+  ss << std::showpoint << std::noshowpos << std::fixed << std::setprecision(2);
+
+#ifndef NNUE_ONLY
   std::memset(scores, 0, sizeof(scores));
 
   pos.this_thread()->contempt = SCORE_ZERO; // Reset any dynamic contempt
 
-  Value v = Evaluation<TRACE>(pos).value();
+  Value classical = Evaluation<TRACE>(pos).value();
 
-  v = pos.side_to_move() == WHITE ? v : -v; // Trace scores are from white's point of view
+  classical = pos.side_to_move() == WHITE ? classical : -classical; // Trace scores are from white's point of view
 
-  std::stringstream ss;
-  ss << std::showpoint << std::noshowpos << std::fixed << std::setprecision(2)
-     << "     Term    |    White    |    Black    |    Total   \n"
+  ss << "     Term    |    White    |    Black    |    Total   \n"
      << "             |   MG    EG  |   MG    EG  |   MG    EG \n"
      << " ------------+-------------+-------------+------------\n"
      << "    Material | " << Term(MATERIAL)
@@ -978,6 +1075,16 @@ std::string Eval::trace(const Position& pos) {
      << " ------------+-------------+-------------+------------\n"
      << "       Total | " << Term(TOTAL);
 
+  ss << "\nClassical evaluation: " << to_cp(classical) << " (white side)";
+#endif
+
+#ifdef NNUE_ONLY
+  Value v = evaluate<NNUE>(pos);
+#else
+  Value v = pos.this_thread()->engine.config.useNNUE ? evaluate<NNUE>(pos) : evaluate<CLASSICAL>(pos);
+#endif
+  v = pos.side_to_move() == WHITE ? v : -v;
+
   ss << "\nFinal evaluation: " << to_cp(v) << " (white side)\n";
 
   return ss.str();
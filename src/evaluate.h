@@ -21,7 +21,9 @@
 #ifndef EVALUATE_H_INCLUDED
 #define EVALUATE_H_INCLUDED
 
+#include <atomic>
 #include <string>
+#include <vector>
 
 #include "types.h"
 
@@ -29,9 +31,44 @@ class Position;
 
 namespace Eval {
 
+/// EvalMode selects the evaluator at compile time. The classical one is left
+/// out of builds made with classical=no (NNUE_ONLY).
+enum EvalMode { CLASSICAL, NNUE };
+
 std::string trace(const Position& pos);
 
-Value evaluate(const Position& pos);
+template<EvalMode M> Value evaluate(const Position& pos);
+template<> Value evaluate<NNUE>(const Position& pos);
+#ifndef NNUE_ONLY
+template<> Value evaluate<CLASSICAL>(const Position& pos);
+#endif
+
+/// Cache is a small per-thread direct-mapped table of network outputs indexed
+/// by the position key. Positions evaluated again, which is frequent with lazy
+/// SMP and in qsearch, skip both the accumulator update and the output pass.
+/// Its size per thread is set by the EvalCache option, 0 disables it.
+
+class Cache {
+
+  struct Entry {
+    uint32_t key32;
+    int32_t value;
+  };
+
+public:
+  void resize(size_t mbSize);
+  void clear();
+  bool probe(Key key, Value& v);
+  void save(Key key, Value v);
+
+  // Written only by the owning thread, read by Search::stats() and bench
+  std::atomic<uint64_t> probes, hits;
+
+private:
+  std::vector<Entry> table;
+  size_t mask = 0;
+};
+
 }
 
 #endif // #ifndef EVALUATE_H_INCLUDED
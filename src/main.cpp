@@ -22,6 +22,7 @@
 
 #include "bitboard.h"
 #include "endgame.h"
+#include "engine.h"
 #include "position.h"
 #include "search.h"
 #include "thread.h"
@@ -43,13 +44,13 @@ int main(int argc, char* argv[]) {
   UCI::init(Options);
   Tune::init();
   PSQT::init();
-  nnue.init(Options["NNUEFile"]);
+  nnue.init(Options["NNUEFile"], Options["NNUEShared"]);
   Bitboards::init();
   Position::init();
-  Bitbases::init();
   Endgames::init();
   Threads.set(size_t(Options["Threads"]));
-  Search::clear(); // After threads are up
+  TT.resize(size_t(Options["Hash"]));
+  Tablebases::init(Options["SyzygyPath"]); // The threads and the hash are clear
 
   UCI::loop(argc, argv);
 
@@ -28,6 +28,7 @@
 #define NOMINMAX
 #endif
 
+#include <malloc.h> // For _aligned_malloc()
 #include <windows.h>
 // The needed Windows API for processor groups could be missed from old Windows
 // versions, so instead of calling them directly (forcing the linker to resolve
@@ -41,15 +42,23 @@ typedef bool(*fun3_t)(HANDLE, CONST GROUP_AFFINITY*, PGROUP_AFFINITY);
 }
 #endif
 
+#include <algorithm>
+#include <cstdlib>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <vector>
 
 #if defined(__linux__) && !defined(__ANDROID__)
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #endif
 
 #include "misc.h"
@@ -128,6 +137,38 @@ public:
 
 } // namespace
 
+
+#ifdef USE_DISPATCH
+
+bool HasPopCnt, HasPext;
+SimdLevel CpuSimd;
+
+namespace {
+
+/// cpu_init() selects the variants of the kernels for the CPU. pext is left out
+/// on the AMD families before Zen 3, where it is microcoded and much slower
+/// than the magics. It runs before main(), as engine_info() already shows the
+/// result, so __builtin_cpu_init() has to be called first.
+
+bool cpu_init() {
+
+  __builtin_cpu_init();
+
+  HasPopCnt = __builtin_cpu_supports("popcnt");
+  HasPext   =   __builtin_cpu_supports("bmi2")
+             && !__builtin_cpu_is("amdfam15h")
+             && !__builtin_cpu_is("amdfam17h");
+  CpuSimd   =  __builtin_cpu_supports("avx512bw") ? SIMD_AVX512
+             : __builtin_cpu_supports("avx2")     ? SIMD_AVX2 : SIMD_SSE2;
+  return true;
+}
+
+const bool CpuReady = cpu_init();
+
+} // namespace
+
+#endif
+
 /// engine_info() returns the full name of the current Stockfish version. This
 /// will be either "Stockfish <Tag> DD-MM-YY" (where DD-MM-YY is the date when
 /// the program was compiled) or "Stockfish <Version>", depending on whether
@@ -223,26 +264,16 @@ const std::string compiler_info() {
   #endif
   compiler += "\n";
 
-  return compiler;
-}
-
-
-/// Debug functions used mainly to collect run-time statistics
-static std::atomic<int64_t> hits[2], means[2];
-
-void dbg_hit_on(bool b) { ++hits[0]; if (b) ++hits[1]; }
-void dbg_hit_on(bool c, bool b) { if (c) dbg_hit_on(b); }
-void dbg_mean_of(int v) { ++means[0]; means[1] += v; }
-
-void dbg_print() {
-
-  if (hits[0])
-      cerr << "Total " << hits[0] << " Hits " << hits[1]
-           << " hit rate (%) " << 100 * hits[1] / hits[0] << endl;
+#ifdef USE_DISPATCH
+  const char* simd[] = { "SSE2", "AVX2", "AVX-512" };
+  compiler += " Kernels selected for this CPU: NNUE ";
+  compiler += simd[CpuSimd];
+  compiler += HasPext   ? ", pext attacks" : ", magic attacks";
+  compiler += HasPopCnt ? ", popcnt" : ", table popcount";
+  compiler += "\n";
+#endif
 
-  if (means[0])
-      cerr << "Total " << means[0] << " Mean "
-           << (double)means[1] / means[0] << endl;
+  return compiler;
 }
 
 
@@ -297,16 +328,150 @@ void prefetch(void* addr) {
 /// aligned_ttmem_alloc() will return suitably aligned memory, and if possible use large pages.
 /// The returned pointer is the aligned one, while the mem argument is the one that needs
 /// to be passed to free. With c++17 some of this functionality could be simplified.
+/// The kind of pages obtained is reported in info strings only if report is set.
 
 #if defined(__linux__) && !defined(__ANDROID__)
 
-void* aligned_ttmem_alloc(size_t allocSize, void*& mem) {
+/// sysfs_list() reads a sysfs list like "0-3,6" of CPUs or NUMA nodes into
+/// the vector of its members. It returns an empty vector on failure.
+
+static std::vector<int> sysfs_list(const std::string& path) {
+
+  std::ifstream f(path);
+  std::string list, range;
+  std::vector<int> members;
+
+  if (!std::getline(f, list))
+      return members;
+
+  std::stringstream ss(list);
+
+  while (std::getline(ss, range, ','))
+  {
+      int first = 0, last = -1;
+      char dash;
+      std::stringstream rs(range);
+
+      if (!(rs >> first))
+          continue;
+
+      if (!(rs >> dash >> last))
+          last = first;
+
+      for (int n = std::max(first, 0); n <= last; ++n)
+          members.push_back(n);
+  }
+
+  return members;
+}
+
+/// numa_online_nodes() returns the mask of the online NUMA nodes. Only the
+/// first 64 nodes are considered.
+
+static uint64_t numa_online_nodes() {
+
+  uint64_t mask = 0;
+
+  for (int n : sysfs_list("/sys/devices/system/node/online"))
+      if (n < 64)
+          mask |= 1ULL << n;
+
+  return mask ? mask : 1;
+}
+
+/// hugetlb_alloc() maps explicit hugetlbfs pages, the 1GB ones for tables that
+/// waste at most an eighth of their size when rounded up to whole 1GB pages,
+/// and the 2MB ones otherwise or when no 1GB page is reserved.
+/// It returns nullptr and leaves pageSize untouched if the pools are empty.
+/// The mapped regions are recorded so that aligned_ttmem_free() can unmap them.
+/// Several engines may allocate and free their tables at the same time, so the
+/// record is guarded by hugetlbMutex.
+
+static std::map<void*, size_t> hugetlbMaps;
+static std::mutex hugetlbMutex;
+
+static void* hugetlb_alloc(size_t allocSize, size_t& pageSize) {
+
+#ifdef MAP_HUGETLB
+  constexpr int HugeShift = 26; // MAP_HUGE_SHIFT in <linux/mman.h>
+
+  for (int log2Size : { 30, 21 })
+  {
+      const size_t page = size_t(1) << log2Size;
+      size_t size = ((allocSize + page - 1) / page) * page;
+
+      // The reserved pool is pinned memory no other process can use, so a
+      // table of 1100MB takes 2MB pages and not two 1GB ones.
+      if (log2Size != 21 && (allocSize < page || size - allocSize > allocSize / 8))
+          continue;
+      void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (log2Size << HugeShift), -1, 0);
+
+      if (mem != MAP_FAILED)
+      {
+          std::lock_guard<std::mutex> lk(hugetlbMutex);
+          hugetlbMaps[mem] = size;
+          pageSize = page;
+          return mem;
+      }
+  }
+#else
+  (void)allocSize; (void)pageSize;
+#endif
+
+  return nullptr;
+}
+
+void* aligned_ttmem_alloc(size_t allocSize, void*& mem, bool report) {
 
   constexpr size_t alignment = 2 * 1024 * 1024; // assumed 2MB page sizes
   size_t size = ((allocSize + alignment - 1) / alignment) * alignment; // multiple of alignment
-  if (posix_memalign(&mem, alignment, size))
-     mem = nullptr;
-  madvise(mem, allocSize, MADV_HUGEPAGE);
+  size_t pageSize = 0;
+
+  // Explicit huge pages avoid most of the TLB misses of the TT probes, but they
+  // need a pool reserved by the administrator. Fall back on transparent huge
+  // pages, which the kernel may or may not give us.
+  mem = hugetlb_alloc(allocSize, pageSize);
+
+  if (mem)
+  {
+      std::lock_guard<std::mutex> lk(hugetlbMutex);
+      size = hugetlbMaps[mem];
+  }
+  else
+  {
+      if (posix_memalign(&mem, alignment, size))
+         mem = nullptr;
+      madvise(mem, allocSize, MADV_HUGEPAGE);
+  }
+
+  if (report && mem)
+      sync_cout << "info string Hash table allocation: "
+                << (pageSize ? std::to_string(pageSize >> 20) + "MB hugetlbfs pages used."
+                             : std::string("transparent huge pages requested."))
+                << sync_endl;
+
+  // On NUMA hosts interleave the pages over all the nodes before they are
+  // first touched by TranspositionTable::clear(), so that the probe latency
+  // is the same for the search threads on every node. We call mbind() via
+  // syscall() so as not to depend on libnuma.
+  unsigned long nodes = (unsigned long)numa_online_nodes();
+  int nodeCount = 0;
+
+  for (uint64_t m = nodes; m; m &= m - 1)
+      ++nodeCount;
+
+  if (mem && nodeCount > 1)
+  {
+      constexpr int MpolInterleave = 3; // MPOL_INTERLEAVE in <linux/mempolicy.h>
+      bool interleaved = !syscall(SYS_mbind, mem, size, MpolInterleave, &nodes, 8 * sizeof(nodes) + 1, 0);
+
+      if (report)
+          sync_cout << "info string Hash table allocation: "
+                    << (interleaved ? "interleaved over " : "could not interleave over ")
+                    << nodeCount << " NUMA nodes." << sync_endl;
+  }
+
   return mem;
 }
 
@@ -357,23 +522,18 @@ static void* aligned_ttmem_alloc_large_pages(size_t allocSize) {
   return mem;
 }
 
-void* aligned_ttmem_alloc(size_t allocSize, void*& mem) {
-
-  static bool firstCall = true;
+void* aligned_ttmem_alloc(size_t allocSize, void*& mem, bool report) {
 
   // Try to allocate large pages
   mem = aligned_ttmem_alloc_large_pages(allocSize);
 
-  // Suppress info strings on the first call. The first call occurs before 'uci'
-  // is received and in that case this output confuses some GUIs.
-  if (!firstCall)
+  if (report)
   {
       if (mem)
           sync_cout << "info string Hash table allocation: Windows large pages used." << sync_endl;
       else
           sync_cout << "info string Hash table allocation: Windows large pages not used." << sync_endl;
   }
-  firstCall = false;
 
   // Fall back to regular, page aligned, allocation if necessary
   if (!mem)
@@ -384,7 +544,7 @@ void* aligned_ttmem_alloc(size_t allocSize, void*& mem) {
 
 #else
 
-void* aligned_ttmem_alloc(size_t allocSize, void*& mem) {
+void* aligned_ttmem_alloc(size_t allocSize, void*& mem, bool) {
 
   constexpr size_t alignment = 64; // assumed cache line size
   size_t size = allocSize + alignment - 1; // allocate some extra space
@@ -411,6 +571,28 @@ void aligned_ttmem_free(void* mem) {
   }
 }
 
+#elif defined(__linux__) && !defined(__ANDROID__)
+
+void aligned_ttmem_free(void *mem) {
+
+  size_t size = 0;
+  {
+      std::lock_guard<std::mutex> lk(hugetlbMutex);
+      auto it = hugetlbMaps.find(mem);
+
+      if (it != hugetlbMaps.end())
+      {
+          size = it->second;
+          hugetlbMaps.erase(it);
+      }
+  }
+
+  if (size)
+      munmap(mem, size);
+  else
+      free(mem);
+}
+
 #else
 
 void aligned_ttmem_free(void *mem) {
@@ -420,19 +602,105 @@ void aligned_ttmem_free(void *mem) {
 #endif
 
 
+/// aligned_large_pages_alloc() allocates big, long lived blocks like the thread
+/// objects with their history tables. On Linux they are 2MB aligned and advised
+/// for transparent huge pages. The explicit hugetlbfs pool is left to the TT,
+/// which is allocated after the threads and gains most from it. Elsewhere the
+/// blocks are cache line aligned.
+
+#if defined(__linux__) && !defined(__ANDROID__)
+
+void* aligned_large_pages_alloc(size_t allocSize) {
+
+  constexpr size_t alignment = 2 * 1024 * 1024;
+  size_t size = ((allocSize + alignment - 1) / alignment) * alignment;
+  void* mem;
+
+  if (posix_memalign(&mem, alignment, size))
+      return nullptr;
+
+  madvise(mem, size, MADV_HUGEPAGE);
+  return mem;
+}
+
+#elif defined(_WIN32)
+
+void* aligned_large_pages_alloc(size_t allocSize) {
+  return _aligned_malloc(allocSize, 64);
+}
+
+#else
+
+void* aligned_large_pages_alloc(size_t allocSize) {
+
+  void* mem;
+  return posix_memalign(&mem, 64, allocSize) ? nullptr : mem;
+}
+
+#endif
+
+/// numa_bind_to_this_node() sets the memory policy of the given block, which
+/// must be page aligned, to the NUMA node of the CPU the calling thread runs on.
+/// The pages already touched elsewhere are moved there too. It is used by the
+/// pool threads for their own data, once they are bound, and is a no-op on
+/// single node hosts.
+
+#if defined(__linux__) && !defined(__ANDROID__)
+
+void numa_bind_to_this_node(void* mem, size_t size) {
+
+  unsigned long nodes = (unsigned long)numa_online_nodes();
+  unsigned cpu, node;
+
+  if (   !(nodes & (nodes - 1))
+      || syscall(SYS_getcpu, &cpu, &node, nullptr)
+      || node >= 64)
+      return;
+
+  constexpr int MpolPreferred = 1; // MPOL_PREFERRED in <linux/mempolicy.h>
+  constexpr int MpolMfMove    = 2; // MPOL_MF_MOVE
+  unsigned long mask = 1UL << node;
+
+  syscall(SYS_mbind, mem, size, MpolPreferred, &mask, 8 * sizeof(mask) + 1, MpolMfMove);
+}
+
+#else
+
+void numa_bind_to_this_node(void*, size_t) {}
+
+#endif
+
+/// aligned_large_pages_free() frees the memory of aligned_large_pages_alloc()
+
+#if defined(_WIN32)
+
+void aligned_large_pages_free(void* mem) {
+  _aligned_free(mem);
+}
+
+#else
+
+void aligned_large_pages_free(void* mem) {
+  free(mem);
+}
+
+#endif
+
+
 namespace WinProcGroup {
 
 #ifndef _WIN32
 
-void bindThisThread(size_t) {}
+void bindThisThread(size_t, bool) {}
 
 #else
 
 /// best_group() retrieves logical processor information using Windows specific
 /// API and returns the best group id for the thread with index idx. Original
-/// code from Texel by Peter Österlund.
+/// code from Texel by Peter Österlund. With spread the threads are dealt to
+/// the nodes in turn instead of filling one node after the other.
 
-int best_group(size_t idx) {
+int best_group(size_t idx, bool spread) {
 
   int threads = 0;
   int nodes = 0;
@@ -481,6 +749,14 @@ int best_group(size_t idx) {
 
   std::vector<int> groups;
 
+  if (spread)
+  {
+      for (int t = 0; t < threads; t++)
+          groups.push_back(t % nodes);
+
+      return idx < groups.size() ? groups[idx] : -1;
+  }
+
   // Run as many threads as possible on the same node until core limit is
   // reached, then move on filling the next node.
   for (int n = 0; n < nodes; n++)
@@ -501,10 +777,10 @@ int best_group(size_t idx) {
 
 /// bindThisThread() set the group affinity of the current thread
 
-void bindThisThread(size_t idx) {
+void bindThisThread(size_t idx, bool spread) {
 
   // Use only local variables to be thread-safe
-  int group = best_group(idx);
+  int group = best_group(idx, spread);
 
   if (group == -1)
       return;
@@ -525,3 +801,140 @@ void bindThisThread(size_t idx) {
 #endif
 
 } // namespace WinProcGroup
+
+
+namespace ThreadBinding {
+
+#if defined(__linux__) && !defined(__ANDROID__)
+
+/// node_cpus() returns, for each NUMA node, the CPUs of the node the process
+/// may run on. A kernel without NUMA support gives a single node.
+
+static std::vector<std::vector<int>> node_cpus() {
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed))
+      return {};
+
+  std::vector<int> nodes = sysfs_list("/sys/devices/system/node/online");
+  std::vector<std::vector<int>> cpus;
+
+  if (nodes.empty()) // Kernel without NUMA support
+      nodes.push_back(-1);
+
+  for (int n : nodes)
+  {
+      cpus.emplace_back();
+
+      for (int cpu : sysfs_list(n < 0 ? std::string("/sys/devices/system/cpu/online")
+                                      : "/sys/devices/system/node/node" + std::to_string(n) + "/cpulist"))
+          if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+              cpus.back().push_back(cpu);
+  }
+
+  return cpus;
+}
+
+
+/// cpu_order() returns the CPUs the process may run on, in the order they are
+/// handed out to the threads. The compact order fills the physical cores of
+/// one node after the other and then spreads the SMT siblings over the nodes,
+/// like WinProcGroup does on Windows. The spread order deals the cores of the
+/// nodes in turn, then the siblings.
+
+static std::vector<int> cpu_order(const std::vector<std::vector<int>>& nodeCpus, bool spread) {
+
+  std::vector<std::vector<int>> cores, siblings;
+
+  for (const auto& node : nodeCpus)
+  {
+      cores.emplace_back();
+      siblings.emplace_back();
+
+      for (int cpu : node)
+      {
+          // The first CPU of a core is the lowest one in its siblings list
+          std::vector<int> smt = sysfs_list("/sys/devices/system/cpu/cpu" + std::to_string(cpu)
+                                            + "/topology/thread_siblings_list");
+
+          (smt.empty() || smt[0] == cpu ? cores : siblings).back().push_back(cpu);
+      }
+  }
+
+  std::vector<int> order;
+
+  // Deal the CPUs of the nodes in turn
+  auto deal = [&](const std::vector<std::vector<int>>& lists) {
+      for (size_t i = 0, added = 1; added; ++i)
+      {
+          added = 0;
+          for (const auto& node : lists)
+              if (i < node.size())
+                  order.push_back(node[i]), ++added;
+      }
+  };
+
+  if (spread)
+      deal(cores);
+  else
+      for (const auto& node : cores)
+          order.insert(order.end(), node.begin(), node.end());
+
+  deal(siblings);
+
+  return order;
+}
+
+
+/// bind_this_thread() pins the calling thread, the one with index idx in the
+/// pool, to the CPU chosen by the policy. With NODE the thread may run on any
+/// CPU of the node holding the CPU that compact would pick, so that several
+/// engines on one host don't pile up on the same CPUs. Threads exceeding the
+/// number of allowed CPUs are left to the scheduler.
+
+void bind_this_thread(size_t idx, Policy policy) {
+
+  if (policy == NONE)
+      return;
+
+  // Magic statics: the first threads to get here build the orders
+  static const std::vector<std::vector<int>> nodeCpus = node_cpus();
+  static const std::vector<int> compactOrder = cpu_order(nodeCpus, false);
+  static const std::vector<int> spreadOrder  = cpu_order(nodeCpus, true);
+
+  const std::vector<int>& order = policy == SPREAD ? spreadOrder : compactOrder;
+
+  if (idx >= order.size())
+      return;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+
+  if (policy == NODE)
+  {
+      for (const auto& node : nodeCpus)
+          if (std::find(node.begin(), node.end(), order[idx]) != node.end())
+              for (int cpu : node)
+                  CPU_SET(cpu, &cpus);
+  }
+  else
+      CPU_SET(order[idx], &cpus);
+
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+#else
+
+/// bind_this_thread() binds the calling thread, the one with index idx in the
+/// pool, to a processor group on Windows, which is already node wide for NODE.
+/// Elsewhere it is a no-op.
+
+void bind_this_thread(size_t idx, Policy policy) {
+
+  if (policy != NONE)
+      WinProcGroup::bindThisThread(idx, policy == SPREAD);
+}
+
+#endif
+
+} // namespace ThreadBinding
@@ -33,13 +33,11 @@ const std::string engine_info(bool to_uci = false);
 const std::string compiler_info();
 void prefetch(void* addr);
 void start_logger(const std::string& fname);
-void* aligned_ttmem_alloc(size_t size, void*& mem);
+void* aligned_ttmem_alloc(size_t size, void*& mem, bool report);
 void aligned_ttmem_free(void* mem); // nop if mem == nullptr
-
-void dbg_hit_on(bool b);
-void dbg_hit_on(bool c, bool b);
-void dbg_mean_of(int v);
-void dbg_print();
+void* aligned_large_pages_alloc(size_t size);
+void aligned_large_pages_free(void* mem);
+void numa_bind_to_this_node(void* mem, size_t size);
 
 typedef std::chrono::milliseconds::rep TimePoint; // A value in milliseconds
 
@@ -50,12 +48,25 @@ inline TimePoint now() {
         (std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
+/// HashTable is a per-thread cache of the classical evaluation. It is allocated
+/// by the first lookup, in the thread that owns it, so that the threads which
+/// evaluate with NNUE only never pay for it. peek() does not allocate, it is
+/// meant for prefetching and returns nullptr while the table is empty.
+
 template<class Entry, int Size>
 struct HashTable {
-  Entry* operator[](Key key) { return &table[(uint32_t)key & (Size - 1)]; }
+  Entry* operator[](Key key) {
+    if (table.empty())
+        table.resize(Size);
+    return &table[(uint32_t)key & (Size - 1)];
+  }
+
+  Entry* peek(Key key) {
+    return table.empty() ? nullptr : &table[(uint32_t)key & (Size - 1)];
+  }
 
 private:
-  std::vector<Entry> table = std::vector<Entry>(Size); // Allocate on the heap
+  std::vector<Entry> table; // Allocate on the heap
 };
 
 
@@ -131,7 +142,17 @@ inline uint64_t mul_hi64(uint64_t a, uint64_t b) {
 /// Peter Österlund.
 
 namespace WinProcGroup {
-  void bindThisThread(size_t idx);
+  void bindThisThread(size_t idx, bool spread = false);
+}
+
+/// ThreadBinding pins the pool threads following the 'Thread Binding' option:
+/// compact fills a NUMA node before moving to the next one, spread deals the
+/// threads to the nodes in turn, each thread on its own CPU. Node, the policy
+/// of "auto", only keeps each thread on the NUMA node compact would pick.
+
+namespace ThreadBinding {
+  enum Policy { NONE, NODE, COMPACT, SPREAD };
+  void bind_this_thread(size_t idx, Policy policy);
 }
 
 #endif // #ifndef MISC_H_INCLUDED
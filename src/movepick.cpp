@@ -20,7 +20,9 @@
 
 #include <cassert>
 
+#include "engine.h"
 #include "movepick.h"
+#include "thread.h"
 
 namespace {
 
@@ -99,6 +101,36 @@ void MovePicker::score() {
 
   static_assert(Type == CAPTURES || Type == QUIETS || Type == EVASIONS, "Wrong type");
 
+#ifdef NNUE_CAPTURE_ORDER
+  // With the network, replace the MVV term of the captures by the eval gain of
+  // the capture, the children being evaluated in batches without making the
+  // moves. The raw network output is from White's point of view.
+  if (   Type == CAPTURES
+#ifndef NNUE_ONLY
+      && pos.this_thread()->engine.config.useNNUE
+#endif
+     )
+  {
+      Move captures[MAX_MOVES];
+      Value values[MAX_MOVES];
+      int n = 0;
+
+      for (auto& m : *this)
+          captures[n++] = m;
+
+      pos.nnue_output_children(captures, n, values);
+
+      const Value parent = pos.nnue_output();
+      const int sign = pos.side_to_move() == WHITE ? 1 : -1;
+      n = 0;
+
+      for (auto& m : *this)
+          m.value =  sign * (values[n++] - parent) * 6
+                   + (*captureHistory)[pos.moved_piece(m)][to_sq(m)][type_of(pos.piece_on(to_sq(m)))];
+      return;
+  }
+#endif
+
   for (auto& m : *this)
       if (Type == CAPTURES)
           m.value =  int(PieceValue[MG][pos.piece_on(to_sq(m))]) * 6
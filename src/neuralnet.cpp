@@ -17,52 +17,591 @@
 */
 
 #include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <thread>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#  define NOMINMAX // Disable macros min() and max()
+#endif
+#include <windows.h>
+#endif
+
+#include "misc.h"
 #include "neuralnet.h"
 
+#ifdef USE_DISPATCH
+#  define NNUE_KERNELS KernelsSSE2
+#endif
+#include "neuralnet_kernels.h"
+
+#ifdef USE_NNUE_SIMD
+static_assert(HIDDEN_BIAS % SimdWidth == 0, "HIDDEN_BIAS must be a multiple of the SIMD width");
+#endif
+
+// With dispatch=yes the kernels are called through the table of the variant
+// that cpu_init() picked for the CPU, see neuralnet_kernels.h
+#ifdef USE_DISPATCH
+extern const NNUEKernels KernelsAVX2, KernelsAVX512;
+static const NNUEKernels* const Kernels[] = { &KernelsSSE2, &KernelsAVX2, &KernelsAVX512 };
+#  define NNUE_KERNEL(f) Kernels[CpuSimd]->f
+#else
+#  define NNUE_KERNEL(f) Simd::f
+#endif
+
+// The kernels widen an int8 weight to int16 and multiply it by the scale of its
+// neuron, in int16, so 127 times the scale must stay within INT16_MAX.
+constexpr int MaxInputScale = INT16_MAX / 127;
+
+// MSVC has no inline assembler on x64, so it can't embed the net
+#if defined(_MSC_VER) && !defined(__clang__) && !defined(NNUE_EMBEDDING_OFF)
+#  define NNUE_EMBEDDING_OFF
+#endif
+
+#ifndef NNUE_EMBEDDING_OFF
+
+// Embed the default net in the read-only data of the binary, the same way as
+// the INCBIN library does. Its pages are shared by all the running processes.
+#if defined(__APPLE__) || (defined(_WIN32) && defined(__i386__))
+#  define NNUE_SYMBOL(name) "_" #name
+#else
+#  define NNUE_SYMBOL(name) #name
+#endif
+
+#if defined(__APPLE__)
+#  define NNUE_SECTION ".const_data"
+#elif defined(_WIN32)
+#  define NNUE_SECTION ".section .rdata, \"dr\""
+#else
+#  define NNUE_SECTION ".section .rodata"
+#endif
+
+asm(NNUE_SECTION "\n"
+    ".balign 64\n"
+    ".globl " NNUE_SYMBOL(gEmbeddedNNUEData) "\n"
+    NNUE_SYMBOL(gEmbeddedNNUEData) ":\n"
+    ".incbin \"" EvalFileDefaultName "\"\n"
+    ".globl " NNUE_SYMBOL(gEmbeddedNNUEEnd) "\n"
+    NNUE_SYMBOL(gEmbeddedNNUEEnd) ":\n"
+    ".byte 0\n"
+    ".text\n");
+
+extern "C" const char gEmbeddedNNUEData[];
+extern "C" const char gEmbeddedNNUEEnd[];
+
+#endif
+
+namespace {
+
+  // All zero weights, used until a network is loaded so that the accumulator
+  // updates done by Position stay valid. They live in the bss, so they cost no
+  // memory unless the engine runs without a net.
+  alignas(64) char ZeroNet[net_size(NET_INT16)];
+
+  // FNV-1a hash of the weights, stored in the header of the network files
+  uint32_t checksum(const char* data, size_t size) {
+
+    uint32_t hash = 2166136261U;
+
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ uint8_t(data[i])) * 16777619U;
+
+    return hash;
+  }
+
+} // namespace
+
+
+NeuralNet::NeuralNet() {
+  set_weights(ZeroNet, NET_INT16);
+}
+
+
+/// NeuralNet::init() loads the network from the given file. The default net
+/// falls back to the embedded copy when the file is not found. On failure the
+/// previous weights are kept, and verify() stops the engine before a search if
+/// no valid network was ever loaded. With 'shared' the weights are then moved
+/// to a shared memory segment, see share().
+
+void NeuralNet::init(std::string str_filename, bool shared) {
+
+  bool ok = map(str_filename);
+
+#ifndef NNUE_EMBEDDING_OFF
+  if (!ok && str_filename == EvalFileDefaultName)
+  {
+      std::ifstream f(str_filename);
+
+      if (!f.is_open() && load(gEmbeddedNNUEData, size_t(gEmbeddedNNUEEnd - gEmbeddedNNUEData), "<embedded>"))
+      {
+          unmap();
+          ok = true;
+      }
+  }
+#endif
+
+  if (!ok)
+  {
+      sync_cout << "info string ERROR: network file " << str_filename
+                << " could not be loaded" << sync_endl;
+      return;
+  }
+
+  if (shared && !share())
+      sync_cout << "info string network " << str_filename
+                << " could not be shared, using a private copy" << sync_endl;
+}
+
+
+/// NeuralNet::verify() exits when the search is about to use the network but
+/// none has been loaded, instead of searching with meaningless evaluations.
+
+void NeuralNet::verify() const {
+
+  if (loaded)
+      return;
+
+  sync_cout << "info string ERROR: no valid network is loaded, set NNUEFile or UseNNUE false" << sync_endl;
+  std::exit(EXIT_FAILURE);
+}
+
+
+/// NeuralNet::save() writes the current network with a NetHeader in the given
+/// layout. It converts a raw network file to the checked format, and quantizes
+/// the input weights of an int16 net to int8 with the smallest scale per neuron
+/// that keeps them in [-127, 127], at most MaxInputScale. The weights of a column
+/// beyond 127 * MaxInputScale are saturated.
 
-void NeuralNet::init(std::string str_filename) {
+bool NeuralNet::save(const std::string& filename, NetVersion version) const {
 
-  const char* filename = str_filename.c_str();
+  if (!loaded)
+      return false;
 
-  FILE* f = fopen(filename, "rb");
-  if (f != NULL)
-  {    
-      fread(InputWeights  , sizeof(int16_t), INPUT_WEIGHTS * HIDDEN_WEIGHTS, f);
-      fread(HiddenBias    , sizeof(int16_t), HIDDEN_BIAS, f);
-      fread(HiddenWeights , sizeof(int16_t), HIDDEN_WEIGHTS, f);
-      fread(OutputBias    , sizeof(int32_t), OUTPUT_BIAS, f);
+  constexpr size_t TailSize =  HIDDEN_BIAS * sizeof(int16_t)
+                             + HIDDEN_WEIGHTS * sizeof(int16_t)
+                             + OUTPUT_BIAS * sizeof(int32_t);
 
-      fclose(f);
+  std::vector<char> data(net_size(version));
+
+  if (version == netVersion)
+      std::memcpy(data.data(), netData, data.size());
+
+  else if (version == NET_INT8)
+  {
+      int8_t* weights = reinterpret_cast<int8_t*>(data.data());
+      int16_t scale[HIDDEN_BIAS];
+
+      for (int j = 0; j < HIDDEN_BIAS; ++j)
+      {
+          int maxWeight = 0;
+          for (int f = 0; f < INPUT_WEIGHTS; ++f)
+              maxWeight = std::max(maxWeight, std::abs(int(InputWeights[f * HIDDEN_BIAS + j])));
+
+          scale[j] = int16_t(std::clamp((maxWeight + 126) / 127, 1, MaxInputScale));
+
+          for (int f = 0; f < INPUT_WEIGHTS; ++f)
+          {
+              int w = InputWeights[f * HIDDEN_BIAS + j];
+              int q = (std::abs(w) + scale[j] / 2) / scale[j];
+              weights[f * HIDDEN_BIAS + j] = int8_t(std::min(q, 127) * (w < 0 ? -1 : 1));
+          }
+      }
+
+      std::memcpy(weights + INPUT_WEIGHTS * HIDDEN_BIAS, scale, sizeof(scale));
   }
   else
   {
-      std::cout << "Network file could not be loaded!" << std::endl;
-      //std::exit(EXIT_FAILURE);
+      int16_t* weights = reinterpret_cast<int16_t*>(data.data());
+
+      for (int f = 0; f < INPUT_WEIGHTS; ++f)
+          for (int j = 0; j < HIDDEN_BIAS; ++j)
+              weights[f * HIDDEN_BIAS + j] = int16_t(InputWeights8[f * HIDDEN_BIAS + j] * InputScale[j]);
   }
+
+  // The output layers are stored the same way in both layouts
+  std::memcpy(data.data() + data.size() - TailSize, HiddenBias, TailSize);
+
+  NetHeader header = {};
+  header.magic    = NetMagic;
+  header.version  = version;
+  header.checksum = checksum(data.data(), data.size());
+  header.size     = uint32_t(data.size());
+
+  std::ofstream f(filename, std::ios::binary);
+  f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  f.write(data.data(), data.size());
+
+  return bool(f);
 }
 
-void NeuralNet::init_accumulator(int16_t *accumulator, int size) {
 
-  //#pragma clang loop vectorize(enable)
-  for (int i = 0; i < size; i++)
-      accumulator[i] = HiddenBias[i];
+/// NeuralNet::share() moves the loaded weights to a named shared memory segment
+/// and points them there. The segment is named after the checksum of the net,
+/// so the first engine to load a network creates it and the others attach to
+/// it read-only, whichever file or embedded copy they loaded the net from. On
+/// POSIX systems the segment outlives the engines, so that short lived ones
+/// don't recreate it, on Windows it lasts while an engine keeps it open.
+
+#if defined(__ANDROID__)
+
+bool NeuralNet::share() { return false; } // Bionic has no shm_open()
+
+#else
+
+bool NeuralNet::share() {
+
+  const size_t NetSize = net_size(netVersion);
+  const size_t Size = sizeof(NetHeader) + NetSize;
+  const char* weights = netData;
+
+  NetHeader header = {};
+  header.magic    = NetMagic;
+  header.version  = netVersion;
+  header.checksum = checksum(weights, NetSize);
+  header.size     = uint32_t(NetSize);
+
+  char name[64];
+
+#ifndef _WIN32
+  std::snprintf(name, sizeof(name), "/smallfish-nnue-%08x", header.checksum);
+
+  void* base = MAP_FAILED;
+  uint64_t mapped = Size;
+
+  // The header is written last, so a segment without a valid one is either
+  // still being filled by another engine or was left so by an engine that died
+  // meanwhile. We wait a bit for the former, then take it for the latter and
+  // create the segment again, once, instead of never sharing this net.
+  for (int attempt = 0; base == MAP_FAILED; ++attempt)
+  {
+      int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+      if (fd != -1) // We are the first engine with this net, fill the segment
+      {
+          void* mem = ftruncate(fd, Size) == 0 ? mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                                               : MAP_FAILED;
+          ::close(fd);
+
+          if (mem == MAP_FAILED)
+          {
+              shm_unlink(name);
+              return false;
+          }
+
+          std::memcpy(static_cast<char*>(mem) + sizeof(header), weights, NetSize);
+          std::memcpy(mem, &header, sizeof(header));
+          munmap(mem, Size);
+      }
+
+      fd = shm_open(name, O_RDONLY, 0);
+
+      if (fd == -1)
+          return false;
+
+      struct stat statbuf;
+      fstat(fd, &statbuf);
+
+      base = size_t(statbuf.st_size) == Size ? mmap(nullptr, Size, PROT_READ, MAP_SHARED, fd, 0)
+                                             : MAP_FAILED;
+      ::close(fd);
+
+      if (base != MAP_FAILED && std::memcmp(base, &header, sizeof(header)))
+      {
+          munmap(base, Size);
+          base = MAP_FAILED;
+      }
+
+      if (base != MAP_FAILED)
+          break;
+
+      if (attempt == 0)
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+      else if (attempt == 1)
+      {
+          sync_cout << "info string Removing the stale shared network " << name << sync_endl;
+          shm_unlink(name);
+      }
+      else
+          return false;
+  }
+
+  if (!load(static_cast<const char*>(base), Size, name))
+  {
+      munmap(base, Size);
+      return false;
+  }
+#else
+  std::snprintf(name, sizeof(name), "Local\\smallfish-nnue-%08x", header.checksum);
+
+  HANDLE mmap = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, DWORD(Size), name);
+
+  if (!mmap)
+      return false;
+
+  if (GetLastError() != ERROR_ALREADY_EXISTS) // We are the first, fill the segment
+  {
+      void* view = MapViewOfFile(mmap, FILE_MAP_WRITE, 0, 0, Size);
+
+      if (!view)
+      {
+          CloseHandle(mmap);
+          return false;
+      }
+
+      std::memcpy(static_cast<char*>(view) + sizeof(header), weights, NetSize);
+      std::memcpy(view, &header, sizeof(header));
+      UnmapViewOfFile(view);
+  }
+
+  void* base = MapViewOfFile(mmap, FILE_MAP_READ, 0, 0, Size);
+  uint64_t mapped = (uint64_t)mmap;
+
+  if (!base || !load(static_cast<const char*>(base), Size, name))
+  {
+      if (base)
+          UnmapViewOfFile(base);
+      CloseHandle(mmap);
+      return false;
+  }
+#endif
+
+  unmap();
+  baseAddress = base;
+  mapping = mapped;
+  return true;
 }
 
-void NeuralNet::activate(int16_t *accumulator, int size, int inputSq) {
+#endif
+
+
+/// NeuralNet::map() memory maps the file read-only and points the weights into
+/// the mapping. Any previous mapping is released once the new net is in place.
+
+bool NeuralNet::map(const std::string& filename) {
+
+#ifndef _WIN32
+  struct stat statbuf;
+  int fd = ::open(filename.c_str(), O_RDONLY);
+
+  if (fd == -1)
+      return false;
+
+  fstat(fd, &statbuf);
+  size_t size = size_t(statbuf.st_size);
+
+  if (size == 0)
+  {
+      ::close(fd);
+      sync_cout << "info string ERROR: network file " << filename << " is empty" << sync_endl;
+      return false;
+  }
+
+  void* base = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  uint64_t mapped = size;
+  ::close(fd);
+
+  if (base == MAP_FAILED)
+  {
+      sync_cout << "info string ERROR: could not mmap() " << filename << sync_endl;
+      return false;
+  }
+#else
+  HANDLE fd = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
 
-  //#pragma clang loop vectorize(enable)
-  for (int i = 0; i < size; i++)
-      accumulator[i] += InputWeights[inputSq * HIDDEN_BIAS + i];
+  if (fd == INVALID_HANDLE_VALUE)
+      return false;
+
+  DWORD size_high;
+  DWORD size_low = GetFileSize(fd, &size_high);
+  size_t size = size_t((uint64_t(size_high) << 32) | size_low);
+  HANDLE mmap = size_low || size_high ? CreateFileMapping(fd, nullptr, PAGE_READONLY, size_high, size_low, nullptr)
+                                      : nullptr;
+  CloseHandle(fd);
+
+  if (!mmap)
+  {
+      sync_cout << "info string ERROR: could not map " << filename << sync_endl;
+      return false;
+  }
+
+  void* base = MapViewOfFile(mmap, FILE_MAP_READ, 0, 0, 0);
+  uint64_t mapped = (uint64_t)mmap;
+
+  if (!base)
+  {
+      CloseHandle(mmap);
+      sync_cout << "info string ERROR: MapViewOfFile() failed, name = " << filename
+                << ", error = " << GetLastError() << sync_endl;
+      return false;
+  }
+#endif
+
+  if (!load(static_cast<const char*>(base), size, filename))
+  {
+#ifndef _WIN32
+      munmap(base, mapped);
+#else
+      UnmapViewOfFile(base);
+      CloseHandle((HANDLE)mapped);
+#endif
+      return false;
+  }
+
+  unmap();
+  baseAddress = base;
+  mapping = mapped;
+  return true;
+}
+
+
+/// NeuralNet::load() checks the network in data and points the weights into
+/// it. A file with a NetHeader must match its version, size and checksum, a
+/// raw one must have exactly the size of the weights.
+
+bool NeuralNet::load(const char* data, size_t size, const std::string& source) {
+
+  NetHeader header;
+  NetVersion version = NET_INT16;
+
+  if (size >= sizeof(header))
+  {
+      std::memcpy(&header, data, sizeof(header));
+
+      if (header.magic == NetMagic)
+      {
+          version = NetVersion(header.version);
+
+          if (   (version != NET_INT16 && version != NET_INT8)
+              || header.size != net_size(version)
+              || size - sizeof(header) != header.size)
+          {
+              sync_cout << "info string ERROR: network file " << source
+                        << " has an unsupported version or a wrong size" << sync_endl;
+              return false;
+          }
+
+          data += sizeof(header);
+          size -= sizeof(header);
+
+          if (checksum(data, size) != header.checksum)
+          {
+              sync_cout << "info string ERROR: network file " << source
+                        << " is corrupted (checksum mismatch)" << sync_endl;
+              return false;
+          }
+      }
+  }
+
+  if (size != net_size(version))
+  {
+      sync_cout << "info string ERROR: network file " << source << " has size " << size
+                << ", expected " << net_size(version) << sync_endl;
+      return false;
+  }
+
+  if (version == NET_INT8)
+  {
+      const int16_t* scale = reinterpret_cast<const int16_t*>(data + INPUT_WEIGHTS * HIDDEN_WEIGHTS);
+
+      for (int j = 0; j < HIDDEN_BIAS; ++j)
+          if (scale[j] < 1 || scale[j] > MaxInputScale)
+          {
+              sync_cout << "info string ERROR: network file " << source
+                        << " has an input scale out of [1, " << MaxInputScale << "]" << sync_endl;
+              return false;
+          }
+  }
+
+  set_weights(data, version);
+  loaded = true;
+
+  return true;
+}
+
+
+/// NeuralNet::set_weights() points the weights into a net of the given layout
+
+void NeuralNet::set_weights(const char* data, NetVersion version) {
+
+  netData    = data;
+  netVersion = version;
+
+  if (version == NET_INT8)
+  {
+      InputWeights  = nullptr;
+      InputWeights8 = reinterpret_cast<const int8_t*>(data);
+      InputScale    = reinterpret_cast<const int16_t*>(InputWeights8 + INPUT_WEIGHTS * HIDDEN_WEIGHTS);
+      HiddenBias    = InputScale + HIDDEN_BIAS;
+  }
+  else
+  {
+      InputWeights  = reinterpret_cast<const int16_t*>(data);
+      InputWeights8 = nullptr;
+      InputScale    = nullptr;
+      HiddenBias    = InputWeights + INPUT_WEIGHTS * HIDDEN_WEIGHTS;
+  }
+
+  HiddenWeights = HiddenBias + HIDDEN_BIAS;
+  OutputBias    = reinterpret_cast<const int32_t*>(HiddenWeights + HIDDEN_WEIGHTS);
+}
+
+
+/// NeuralNet::unmap() releases the mapping of the network file, if any
+
+void NeuralNet::unmap() {
+
+  if (!baseAddress)
+      return;
+
+#ifndef _WIN32
+  munmap(baseAddress, mapping);
+#else
+  UnmapViewOfFile(baseAddress);
+  CloseHandle((HANDLE)mapping);
+#endif
+
+  baseAddress = nullptr;
+  mapping = 0;
+}
+
+void NeuralNet::init_accumulator(int16_t *accumulator, int size) {
+  NNUE_KERNEL(init)(accumulator, HiddenBias, size);
+}
+
+void NeuralNet::activate(int16_t *accumulator, int size, int inputSq) {
+  update(accumulator, accumulator, size, &inputSq, 1, nullptr, 0);
 }
 
 void NeuralNet::deactivate(int16_t *accumulator, int size, int inputSq) {
+  update(accumulator, accumulator, size, nullptr, 0, &inputSq, 1);
+}
+
+/// NeuralNet::update() writes into dst the accumulator src with the removed
+/// features subtracted and the added ones accumulated, in a single pass. The
+/// source is read once and the destination written once, instead of a copy
+/// followed by one read-modify-write pass for each changed feature.
+
+void NeuralNet::update(int16_t *dst, const int16_t *src, int size,
+                       const int added[], int addCount, const int removed[], int removeCount) {
 
-  //#pragma clang loop vectorize(enable)
-  for (int i = 0; i < size; i++)
-      accumulator[i] -= InputWeights[inputSq * HIDDEN_BIAS + i];
+  if (InputWeights8)
+      NNUE_KERNEL(update8)(dst, src, size, InputWeights8, InputScale, added, addCount, removed, removeCount);
+  else
+      NNUE_KERNEL(update16)(dst, src, size, InputWeights, InputScale, added, addCount, removed, removeCount);
 }
 
 int NeuralNet::relu(int x) {
@@ -70,12 +609,14 @@ int NeuralNet::relu(int x) {
 }
 
 int32_t NeuralNet::output(int16_t *accumulator, int size) {
+  return NNUE_KERNEL(output)(accumulator, size, HiddenWeights, OutputBias[0]);
+}
 
-  int32_t output = OutputBias[0];
 
-  //#pragma clang loop vectorize(enable)
-  for (int i = 0; i < size; i++)
-      output += relu(accumulator[i]) * HiddenWeights[i];
+/// NeuralNet::output_batch() computes output() for n accumulators at once. The
+/// positions are processed in groups that share each load of the hidden weights,
+/// with one running sum per position, so the weights are streamed once per group.
 
-  return output / (28 * 256);
+void NeuralNet::output_batch(const int16_t* const accs[], int n, int32_t* out) {
+  NNUE_KERNEL(output_batch)(accs, n, HIDDEN_BIAS, HiddenWeights, OutputBias[0], out);
 }
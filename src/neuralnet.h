@@ -29,19 +29,89 @@ constexpr int HIDDEN_BIAS    = 256;
 constexpr int HIDDEN_WEIGHTS = 256;
 constexpr int OUTPUT_BIAS    = 1;
 
+// The default network, embedded in the binary unless NNUE_EMBEDDING_OFF is set
+#define EvalFileDefaultName "default.net"
+
+/// NetHeader is the optional header of a network file. Files without it are a
+/// raw dump of the weights and are only checked against the expected size. It
+/// is 64 bytes long so that the weights that follow keep their alignment.
+
+struct NetHeader {
+  uint32_t magic;       // NetMagic
+  uint32_t version;     // Layout of the weights that follow
+  uint32_t checksum;    // FNV-1a hash of the weights
+  uint32_t size;        // Size in bytes of the weights
+  uint32_t reserved[12];
+};
+
+constexpr uint32_t NetMagic = 0x4E4E4653; // "SFNN"
+
+/// Layouts of the weights, given by NetHeader::version. Raw files are NET_INT16.
+/// NET_INT8 stores the input weights as int8 with an int16 scale per neuron,
+/// halving the rows read by the accumulator updates. Both use int16 accumulators.
+enum NetVersion : uint32_t {
+  NET_INT16 = 1, // InputWeights, HiddenBias, HiddenWeights, OutputBias
+  NET_INT8  = 2  // InputWeights8, InputScale, HiddenBias, HiddenWeights, OutputBias
+};
+
+constexpr size_t net_size(NetVersion v) {
+  return  INPUT_WEIGHTS * HIDDEN_WEIGHTS * (v == NET_INT8 ? sizeof(int8_t) : sizeof(int16_t))
+        + (v == NET_INT8 ? HIDDEN_BIAS * sizeof(int16_t) : 0)
+        + HIDDEN_BIAS * sizeof(int16_t)
+        + HIDDEN_WEIGHTS * sizeof(int16_t)
+        + OUTPUT_BIAS * sizeof(int32_t);
+}
+
+/// DirtyFeatures records the input features removed and added by a move, so
+/// that the accumulator can be brought up to date from the previous one only
+/// when the position is actually evaluated.
+
+struct DirtyFeatures {
+  int added[2], removed[2];
+  int addCount, removeCount;
+};
+
+/// NeuralNet holds the network weights. They are never copied: they point
+/// either into a read-only mapping of the network file, whose pages are shared
+/// by all the engine processes using the same file, into the embedded net, or
+/// into a shared memory segment holding the net for all the engines on a host.
+
 class NeuralNet {
 public:
-  void init(std::string str_filename);
+  NeuralNet();
+  ~NeuralNet() { unmap(); }
+  void init(std::string str_filename, bool shared);
+  void verify() const;
+  bool save(const std::string& filename, NetVersion version) const;
+  // The accumulators given to these must be 64-byte aligned
   void init_accumulator(int16_t *accumulator, int size);
   void activate(int16_t *accumulator, int size, int inputSq);
   void deactivate(int16_t *accumulator, int size, int inputSq);
+  void update(int16_t *dst, const int16_t *src, int size,
+              const int added[], int addCount, const int removed[], int removeCount);
   int relu(int x);
   int32_t output(int16_t *accumulator, int size);
+  void output_batch(const int16_t* const accs[], int n, int32_t* out);
+
+  const int16_t* InputWeights;   // NET_INT16 only
+  const int8_t*  InputWeights8;  // NET_INT8 only, scaled by InputScale
+  const int16_t* InputScale;
+  const int16_t* HiddenBias;
+  const int16_t* HiddenWeights;
+  const int32_t* OutputBias;
+
+private:
+  bool map(const std::string& filename);
+  bool share();
+  bool load(const char* data, size_t size, const std::string& source);
+  void set_weights(const char* data, NetVersion version);
+  void unmap();
 
-  int16_t InputWeights[INPUT_WEIGHTS * HIDDEN_WEIGHTS];
-  int16_t HiddenBias[HIDDEN_BIAS];
-  int16_t HiddenWeights[HIDDEN_WEIGHTS];
-  int32_t OutputBias[OUTPUT_BIAS];
+  bool loaded = false;
+  const char* netData;
+  NetVersion netVersion;
+  void* baseAddress = nullptr;
+  uint64_t mapping = 0;
 };
 
 extern NeuralNet nnue;
@@ -0,0 +1,25 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2022 The Stockfish developers (see AUTHORS file)
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The AVX2 variant of the NNUE kernels for the dispatch=yes build, compiled
+// with the AVX2 flags set for this file in the Makefile. It must include
+// nothing else, see neuralnet_kernels.h.
+
+#define USE_AVX2
+#define NNUE_KERNELS KernelsAVX2
+#include "neuralnet_kernels.h"
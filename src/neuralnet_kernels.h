@@ -0,0 +1,343 @@
+/*
+  Stockfish, a UCI chess playing engine derived from Glaurung 2.1
+  Copyright (C) 2004-2022 The Stockfish developers (see AUTHORS file)
+
+  Stockfish is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Stockfish is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NEURALNET_KERNELS_H_INCLUDED
+#define NEURALNET_KERNELS_H_INCLUDED
+
+/// The kernels of NeuralNet: the accumulator updates and the output layer. They
+/// are compiled for the instruction set of the including translation unit, as
+/// selected by USE_AVX512, USE_AVX2, USE_SSE2 or USE_NEON. neuralnet.cpp calls
+/// the variant of the build directly. With dispatch=yes (USE_DISPATCH) the
+/// neuralnet_avx2.cpp and neuralnet_avx512.cpp units, built with their own
+/// instruction set flags, add the wider variants, and NeuralNet calls the one
+/// picked at startup for the CPU through their NNUEKernels table.
+///
+/// Those units may not use anything from the standard library: an inline
+/// function emitted there with the wider instruction set could be the copy
+/// the linker keeps for the whole program.
+
+#include <cassert>
+#include <cstdint>
+
+#if defined(USE_AVX2) || defined(USE_AVX512)
+#include <immintrin.h>
+#elif defined(USE_SSE2)
+#include <emmintrin.h>
+#elif defined(USE_NEON)
+#include <arm_neon.h>
+#endif
+
+struct NNUEKernels {
+  void (*init)(int16_t* acc, const int16_t* bias, int size);
+  void (*update16)(int16_t* dst, const int16_t* src, int size, const int16_t* weights, const int16_t* scale,
+                   const int added[], int addCount, const int removed[], int removeCount);
+  void (*update8)(int16_t* dst, const int16_t* src, int size, const int8_t* weights, const int16_t* scale,
+                  const int added[], int addCount, const int removed[], int removeCount);
+  int32_t (*output)(const int16_t* acc, int size, const int16_t* weights, int32_t bias);
+  void (*output_batch)(const int16_t* const accs[], int n, int size,
+                       const int16_t* weights, int32_t bias, int32_t* out);
+};
+
+namespace {
+
+  // SIMD helpers used by the accumulator update and output routines. Each
+  // vector holds SimdWidth int16 lanes, the sizes must be a multiple of it.
+  // The weights may be unaligned in a mapped file, but the accumulators are
+  // 64-byte aligned, see AccumulatorStack, and use the aligned vec_load_a()
+  // and vec_store_a().
+#if defined(USE_AVX512)
+  typedef __m512i vec_t;
+  constexpr int SimdWidth = 32;
+  #define vec_load(a)       _mm512_loadu_si512(a)
+  #define vec_store(a,b)    _mm512_storeu_si512(a,b)
+  #define vec_load_a(a)     _mm512_load_si512(a)
+  #define vec_store_a(a,b)  _mm512_store_si512(a,b)
+  #define vec_add_16(a,b)   _mm512_add_epi16(a,b)
+  #define vec_sub_16(a,b)   _mm512_sub_epi16(a,b)
+  #define vec_max_16(a,b)   _mm512_max_epi16(a,b)
+  #define vec_madd_16(a,b)  _mm512_madd_epi16(a,b)
+  #define vec_add_32(a,b)   _mm512_add_epi32(a,b)
+  #define vec_zero()        _mm512_setzero_si512()
+  #define vec_mul_16(a,b)   _mm512_mullo_epi16(a,b)
+  #define vec_load_8(a)     _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)))
+
+  // Reduce through memory: the 512 to 256 bit extracts trip spurious
+  // -Wmaybe-uninitialized warnings in some gcc versions.
+  inline int32_t vec_hadd_32(vec_t sum) {
+    alignas(64) int32_t lanes[16];
+    _mm512_store_si512(lanes, sum);
+
+    int32_t total = 0;
+    for (int i = 0; i < 16; i++)
+        total += lanes[i];
+    return total;
+  }
+
+#elif defined(USE_AVX2)
+  typedef __m256i vec_t;
+  constexpr int SimdWidth = 16;
+  #define vec_load(a)       _mm256_loadu_si256(a)
+  #define vec_store(a,b)    _mm256_storeu_si256(a,b)
+  #define vec_load_a(a)     _mm256_load_si256(a)
+  #define vec_store_a(a,b)  _mm256_store_si256(a,b)
+  #define vec_add_16(a,b)   _mm256_add_epi16(a,b)
+  #define vec_sub_16(a,b)   _mm256_sub_epi16(a,b)
+  #define vec_max_16(a,b)   _mm256_max_epi16(a,b)
+  #define vec_madd_16(a,b)  _mm256_madd_epi16(a,b)
+  #define vec_add_32(a,b)   _mm256_add_epi32(a,b)
+  #define vec_zero()        _mm256_setzero_si256()
+  #define vec_mul_16(a,b)   _mm256_mullo_epi16(a,b)
+  #define vec_load_8(a)     _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a)))
+
+  inline int32_t vec_hadd_32(vec_t sum) {
+    __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum128);
+  }
+
+#elif defined(USE_SSE2)
+  typedef __m128i vec_t;
+  constexpr int SimdWidth = 8;
+  #define vec_load(a)       _mm_loadu_si128(a)
+  #define vec_store(a,b)    _mm_storeu_si128(a,b)
+  #define vec_load_a(a)     _mm_load_si128(a)
+  #define vec_store_a(a,b)  _mm_store_si128(a,b)
+  #define vec_add_16(a,b)   _mm_add_epi16(a,b)
+  #define vec_sub_16(a,b)   _mm_sub_epi16(a,b)
+  #define vec_max_16(a,b)   _mm_max_epi16(a,b)
+  #define vec_madd_16(a,b)  _mm_madd_epi16(a,b)
+  #define vec_add_32(a,b)   _mm_add_epi32(a,b)
+  #define vec_zero()        _mm_setzero_si128()
+  #define vec_mul_16(a,b)   _mm_mullo_epi16(a,b)
+
+  // SSE2 has no sign extension of int8, so unpack each byte to the high half
+  // of its int16 lane and shift it back down arithmetically.
+  inline vec_t vec_load_8(const int8_t* a) {
+    __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(a));
+    return _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+  }
+
+  inline int32_t vec_hadd_32(vec_t sum) {
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+  }
+
+#elif defined(USE_NEON)
+  typedef int16x8_t vec_t;
+  constexpr int SimdWidth = 8;
+  #define vec_load(a)       vld1q_s16(reinterpret_cast<const int16_t*>(a))
+  #define vec_store(a,b)    vst1q_s16(reinterpret_cast<int16_t*>(a), b)
+  #define vec_load_a(a)     vec_load(a)
+  #define vec_store_a(a,b)  vec_store(a,b)
+  #define vec_add_16(a,b)   vaddq_s16(a,b)
+  #define vec_sub_16(a,b)   vsubq_s16(a,b)
+  #define vec_max_16(a,b)   vmaxq_s16(a,b)
+  #define vec_add_32(a,b)   vaddq_s32(a,b)
+  #define vec_zero()        vdupq_n_s16(0)
+  #define vec_mul_16(a,b)   vmulq_s16(a,b)
+  #define vec_load_8(a)     vmovl_s8(vld1_s8(a))
+
+  // NEON has no 16x16->32 pairwise multiply-add, so widen both halves instead
+  inline int32x4_t vec_madd_16(vec_t a, vec_t b) {
+    int32x4_t prod = vmull_s16(vget_low_s16(a), vget_low_s16(b));
+    return vmlal_s16(prod, vget_high_s16(a), vget_high_s16(b));
+  }
+
+  inline int32_t vec_hadd_32(int32x4_t sum) {
+#  if USE_NEON >= 8
+    return vaddvq_s32(sum);
+#  else
+    int32x2_t sum2 = vadd_s32(vget_low_s32(sum), vget_high_s32(sum));
+    return vget_lane_s32(vpadd_s32(sum2, sum2), 0);
+#  endif
+  }
+#endif
+
+#if defined(USE_AVX512) || defined(USE_AVX2) || defined(USE_SSE2) || defined(USE_NEON)
+  #define USE_NNUE_SIMD
+
+  // Chunk i of an input weight row as int16 lanes. The int8 rows are widened
+  // and multiplied by the scale of each neuron.
+  inline vec_t weight_chunk(const int16_t* row, const int16_t*, int i) {
+    return vec_load(&reinterpret_cast<const vec_t*>(row)[i]);
+  }
+
+  inline vec_t weight_chunk(const int8_t* row, const int16_t* scale, int i) {
+    return vec_mul_16(vec_load_8(row + i * SimdWidth), vec_load(&reinterpret_cast<const vec_t*>(scale)[i]));
+  }
+#endif
+
+  inline int16_t weight(const int16_t* row, const int16_t*, int i) { return row[i]; }
+  inline int16_t weight(const int8_t* row, const int16_t* scale, int i) { return int16_t(row[i] * scale[i]); }
+
+  // update_accumulator() writes into dst the accumulator src with the removed
+  // input weight rows, of size weights each, subtracted and the added ones
+  // accumulated, in one pass.
+  template<typename WeightType>
+  void update_accumulator(int16_t* dst, const int16_t* src, int size,
+                          const WeightType* weights, const int16_t* scale,
+                          const int added[], int addCount, const int removed[], int removeCount) {
+#ifdef USE_NNUE_SIMD
+    assert(size % SimdWidth == 0);
+
+    auto out = reinterpret_cast<vec_t*>(dst);
+    auto in  = reinterpret_cast<const vec_t*>(src);
+
+    for (int i = 0; i < size / SimdWidth; i++)
+    {
+        vec_t acc = vec_load_a(&in[i]);
+
+        for (int r = 0; r < removeCount; r++)
+            acc = vec_sub_16(acc, weight_chunk(weights + removed[r] * size, scale, i));
+
+        for (int a = 0; a < addCount; a++)
+            acc = vec_add_16(acc, weight_chunk(weights + added[a] * size, scale, i));
+
+        vec_store_a(&out[i], acc);
+    }
+#else
+    for (int i = 0; i < size; i++)
+    {
+        int16_t acc = src[i];
+
+        for (int r = 0; r < removeCount; r++)
+            acc -= weight(weights + removed[r] * size, scale, i);
+
+        for (int a = 0; a < addCount; a++)
+            acc += weight(weights + added[a] * size, scale, i);
+
+        dst[i] = acc;
+    }
+#endif
+  }
+
+
+namespace Simd {
+
+  void init(int16_t* accumulator, const int16_t* bias, int size) {
+#ifdef USE_NNUE_SIMD
+    assert(size % SimdWidth == 0);
+
+    auto acc = reinterpret_cast<vec_t*>(accumulator);
+    auto b   = reinterpret_cast<const vec_t*>(bias);
+
+    for (int i = 0; i < size / SimdWidth; i++)
+        vec_store_a(&acc[i], vec_load(&b[i]));
+#else
+    for (int i = 0; i < size; i++)
+        accumulator[i] = bias[i];
+#endif
+  }
+
+  void update16(int16_t* dst, const int16_t* src, int size, const int16_t* weights, const int16_t* scale,
+                const int added[], int addCount, const int removed[], int removeCount) {
+    update_accumulator(dst, src, size, weights, scale, added, addCount, removed, removeCount);
+  }
+
+  void update8(int16_t* dst, const int16_t* src, int size, const int8_t* weights, const int16_t* scale,
+               const int added[], int addCount, const int removed[], int removeCount) {
+    update_accumulator(dst, src, size, weights, scale, added, addCount, removed, removeCount);
+  }
+
+  inline int relu(int x) { return x > 0 ? x : 0; }
+
+  int32_t output(const int16_t* accumulator, int size, const int16_t* weights, int32_t bias) {
+
+    int32_t output = bias;
+
+#ifdef USE_NNUE_SIMD
+    assert(size % SimdWidth == 0);
+
+    auto acc    = reinterpret_cast<const vec_t*>(accumulator);
+    auto weight = reinterpret_cast<const vec_t*>(weights);
+    const vec_t zero = vec_zero();
+    auto sum = vec_madd_16(vec_max_16(vec_load_a(&acc[0]), zero), vec_load(&weight[0]));
+
+    // The products of the clipped accumulator and the hidden weights fit in
+    // int16 * int16, and their pairwise sums can't overflow an int32 lane.
+    for (int i = 1; i < size / SimdWidth; i++)
+        sum = vec_add_32(sum, vec_madd_16(vec_max_16(vec_load_a(&acc[i]), zero), vec_load(&weight[i])));
+
+    output += vec_hadd_32(sum);
+#else
+    for (int i = 0; i < size; i++)
+        output += relu(accumulator[i]) * weights[i];
+#endif
+
+    return output / (28 * 256);
+  }
+
+  // output_batch() processes the positions in groups that share each load of
+  // the hidden weights, with one running sum per position.
+  void output_batch(const int16_t* const accs[], int n, int size,
+                    const int16_t* weights, int32_t bias, int32_t* out) {
+
+    constexpr int GroupSize = 4;
+
+    for (int b = 0; b < n; b += GroupSize)
+    {
+        const int count = n - b < GroupSize ? n - b : GroupSize;
+
+#ifdef USE_NNUE_SIMD
+        auto weight = reinterpret_cast<const vec_t*>(weights);
+        const vec_t zero = vec_zero();
+        decltype(vec_madd_16(zero, zero)) sum[GroupSize];
+
+        for (int k = 0; k < count; ++k)
+            sum[k] = vec_madd_16(vec_max_16(vec_load_a(&reinterpret_cast<const vec_t*>(accs[b + k])[0]), zero),
+                                 vec_load(&weight[0]));
+
+        for (int i = 1; i < size / SimdWidth; i++)
+        {
+            const vec_t w = vec_load(&weight[i]);
+
+            for (int k = 0; k < count; ++k)
+                sum[k] = vec_add_32(sum[k], vec_madd_16(vec_max_16(vec_load_a(&reinterpret_cast<const vec_t*>(accs[b + k])[i]), zero), w));
+        }
+
+        for (int k = 0; k < count; ++k)
+            out[b + k] = (bias + vec_hadd_32(sum[k])) / (28 * 256);
+#else
+        int32_t sum[GroupSize];
+
+        for (int k = 0; k < count; ++k)
+            sum[k] = bias;
+
+        for (int i = 0; i < size; i++)
+            for (int k = 0; k < count; ++k)
+                sum[k] += relu(accs[b + k][i]) * weights[i];
+
+        for (int k = 0; k < count; ++k)
+            out[b + k] = sum[k] / (28 * 256);
+#endif
+    }
+  }
+
+} // namespace Simd
+
+} // namespace
+
+// The table of the variant, named by the including unit
+#ifdef NNUE_KERNELS
+extern const NNUEKernels NNUE_KERNELS;
+const NNUEKernels NNUE_KERNELS = { Simd::init, Simd::update16, Simd::update8, Simd::output, Simd::output_batch };
+#endif
+
+#endif // #ifndef NEURALNET_KERNELS_H_INCLUDED
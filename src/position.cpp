@@ -23,9 +23,12 @@
 #include <cstddef> // For offsetof()
 #include <cstring> // For std::memset, std::memcmp
 #include <iomanip>
+#include <iostream>
+#include <new>     // For std::nothrow
 #include <sstream>
 
 #include "bitboard.h"
+#include "engine.h"
 #include "misc.h"
 #include "movegen.h"
 #include "position.h"
@@ -193,19 +196,12 @@ Position& Position::set(const string& fenStr, bool isChess960, StateInfo* si, Th
   unsigned char col, row, token;
   size_t idx;
   Square sq = SQ_A8;
-  std::istringstream ss(fenStr);
+  const char* s = fenStr.c_str(); // Parsed in place, without a stringstream
 
-  std::memset(this, 0, sizeof(Position));
-  std::memset(si, 0, sizeof(StateInfo));
-  std::fill_n(&pieceList[0][0], sizeof(pieceList) / sizeof(Square), SQ_NONE);
-  st = si;
-
-  nnue.init_accumulator(st->accumulator, HIDDEN_BIAS);
-
-  ss >> std::noskipws;
+  reset(si);
 
   // 1. Piece placement
-  while ((ss >> token) && !isspace(token))
+  while ((token = *s) && (++s, !isspace(token)))
   {
       if (isdigit(token))
           sq += (token - '0') * EAST; // Advance the given number of files
@@ -216,50 +212,39 @@ Position& Position::set(const string& fenStr, bool isChess960, StateInfo* si, Th
       else if ((idx = PieceToChar.find(token)) != string::npos)
       {
           put_piece(Piece(idx), sq);
-          nnue.activate(st->accumulator, HIDDEN_BIAS, input_sq(Piece(idx), sq));
           ++sq;
       }
   }
 
   // 2. Active color
-  ss >> token;
+  token = *s ? *s++ : 0;
   sideToMove = (token == 'w' ? WHITE : BLACK);
-  ss >> token;
+  s += bool(*s);
 
   // 3. Castling availability. Compatible with 3 standards: Normal FEN standard,
   // Shredder-FEN that uses the letters of the columns on which the rooks began
   // the game instead of KQkq and also X-FEN standard that, in case of Chess960,
   // if an inner rook is associated with the castling right, the castling tag is
   // replaced by the file letter of the involved rook, as for the Shredder-FEN.
-  while ((ss >> token) && !isspace(token))
+  while ((token = *s) && (++s, !isspace(token)))
   {
-      Square rsq;
       Color c = islower(token) ? BLACK : WHITE;
-      Piece rook = make_piece(c, ROOK);
 
       token = char(toupper(token));
 
-      if (token == 'K')
-          for (rsq = relative_square(c, SQ_H1); piece_on(rsq) != rook; --rsq) {}
-
-      else if (token == 'Q')
-          for (rsq = relative_square(c, SQ_A1); piece_on(rsq) != rook; ++rsq) {}
+      if (token == 'K' || token == 'Q')
+          set_castling_right(c, outer_rook(c, token == 'K' ? KING_SIDE : QUEEN_SIDE));
 
       else if (token >= 'A' && token <= 'H')
-          rsq = make_square(File(token - 'A'), relative_rank(c, RANK_1));
-
-      else
-          continue;
-
-      set_castling_right(c, rsq);
+          set_castling_right(c, make_square(File(token - 'A'), relative_rank(c, RANK_1)));
   }
 
   // 4. En passant square.
   // Ignore if square is invalid or not on side to move relative rank 6.
   bool enpassant = false;
 
-  if (   ((ss >> col) && (col >= 'a' && col <= 'h'))
-      && ((ss >> row) && (row == (sideToMove == WHITE ? '6' : '3'))))
+  if (   ((col = *s) && (++s, col >= 'a' && col <= 'h'))
+      && ((row = *s) && (++s, row == (sideToMove == WHITE ? '6' : '3'))))
   {
       st->epSquare = make_square(File(col - 'a'), Rank(row - '1'));
 
@@ -275,8 +260,19 @@ Position& Position::set(const string& fenStr, bool isChess960, StateInfo* si, Th
   if (!enpassant)
       st->epSquare = SQ_NONE;
 
-  // 5-6. Halfmove clock and fullmove number
-  ss >> std::skipws >> st->rule50 >> gamePly;
+  // 5-6. Halfmove clock and fullmove number, the latter is read only if the
+  // former is there, as a stream would do.
+  auto read_int = [&](int& n) {
+      char* end;
+      long v = std::strtol(s, &end, 10);
+      if (end == s)
+          return false;
+      n = int(v), s = end;
+      return true;
+  };
+
+  if (read_int(st->rule50))
+      read_int(gamePly);
 
   // Convert from fullmove starting from 1 to gamePly starting from 0,
   // handle also common incorrect FEN with fullmove = 0.
@@ -285,6 +281,138 @@ Position& Position::set(const string& fenStr, bool isChess960, StateInfo* si, Th
   chess960 = isChess960;
   thisThread = th;
   set_state(st);
+  refresh_accumulator();
+
+  assert(pos_is_ok());
+
+  return *this;
+}
+
+
+/// Position::set() is an overload to initialize the position object from its
+/// PackedPosition encoding, the fast path of the 'evalstream' command. The
+/// records come from files, so unlike a FEN they are checked first: a record
+/// that the position could not hold or that has no unique king per side, pawns
+/// on the back ranks, castling without its king and rook or a misplaced en
+/// passant square is rejected, leaving the position untouched, and false is
+/// returned.
+
+bool Position::set(const PackedPosition& pp, bool isChess960, StateInfo* si, Thread* th) {
+
+  if (popcount(pp.occupied) > 32)
+      return false;
+
+  Piece pcs[32];
+  Bitboard byColor[COLOR_NB] = {}, kings = 0, rooks = 0;
+  Color us = Color(pp.flags & 1);
+
+  int n = 0;
+  for (Bitboard b = pp.occupied; b; ++n)
+  {
+      Square s = pop_lsb(&b);
+      Piece pc = pcs[n] = Piece((pp.pieces[n / 2] >> (4 * (n & 1))) & 0xF);
+
+      if (type_of(pc) < PAWN || type_of(pc) > KING)
+          return false;
+
+      if (type_of(pc) == PAWN && (square_bb(s) & (Rank1BB | Rank8BB)))
+          return false;
+
+      byColor[color_of(pc)] |= s;
+      kings |= type_of(pc) == KING ? square_bb(s) : 0;
+      rooks |= type_of(pc) == ROOK ? square_bb(s) : 0;
+  }
+
+  for (Color c : { WHITE, BLACK })
+      if (popcount(byColor[c]) > 16 || popcount(kings & byColor[c]) != 1)
+          return false;
+
+  // outer_rook() scans the back rank from the corner, so there must be a rook
+  // of that side between the corner and the king.
+  for (CastlingRights cr : { WHITE_OO, WHITE_OOO, BLACK_OO, BLACK_OOO })
+      if (pp.flags & (cr << 1))
+      {
+          Color c = cr & WHITE_CASTLING ? WHITE : BLACK;
+          Bitboard backRank = rank_bb(relative_rank(c, RANK_1));
+          Square ksq = lsb(kings & byColor[c]);
+          Bitboard side = cr & KING_SIDE ? ~((square_bb(ksq) << 1) - 1)
+                                         : square_bb(ksq) - 1;
+
+          if (!(kings & byColor[c] & backRank) || !(rooks & byColor[c] & backRank & side))
+              return false;
+      }
+
+  if (   pp.epSquare != SQ_NONE
+      && (pp.epSquare > SQ_H8 || relative_rank(us, Square(pp.epSquare)) != RANK_6))
+      return false;
+
+  reset(si);
+
+  n = 0;
+  for (Bitboard b = pp.occupied; b; ++n)
+      put_piece(pcs[n], pop_lsb(&b));
+
+  sideToMove = us;
+
+  for (CastlingRights cr : { WHITE_OO, WHITE_OOO, BLACK_OO, BLACK_OOO })
+      if (pp.flags & (cr << 1))
+      {
+          Color c = cr & WHITE_CASTLING ? WHITE : BLACK;
+          set_castling_right(c, outer_rook(c, cr & KING_SIDE ? KING_SIDE : QUEEN_SIDE));
+      }
+
+  st->epSquare = Square(pp.epSquare);
+  st->rule50 = pp.rule50;
+  gamePly = std::max(2 * (pp.fullmove - 1), 0) + (sideToMove == BLACK);
+
+  chess960 = isChess960;
+  thisThread = th;
+  set_state(st);
+  refresh_accumulator();
+
+  assert(pos_is_ok());
+
+  return true;
+}
+
+
+/// Position::set() is an overload to initialize the position object as a copy
+/// of pos, sharing its current StateInfo, for thread th. It is how the root
+/// position is given to the threads, instead of a round trip through a FEN.
+/// The accumulator of pos must be up to date, see update_accumulator(). The
+/// piece lists are rebuilt in the order set() gives them from a FEN, so that
+/// the move ordering, hence the search, does not depend on the moves that
+/// led to the position.
+
+Position& Position::set(const Position& pos, Thread* th) {
+
+  assert(pos.accumulators->owner[AccumulatorStack::slot(pos.accPly)] == pos.st);
+
+  alloc_accumulators();
+  std::memcpy(this, &pos, offsetof(Position, accumulators));
+  std::memset(pieceCount, 0, sizeof(pieceCount));
+  std::fill_n(&pieceList[0][0], sizeof(pieceList) / sizeof(Square), SQ_NONE);
+
+  for (Rank r = RANK_8; r >= RANK_1; --r)
+      for (File f = FILE_A; f <= FILE_H; ++f)
+      {
+          Square s = make_square(f, r);
+          Piece pc = board[s];
+
+          if (pc != NO_PIECE)
+          {
+              index[s] = pieceCount[pc]++;
+              pieceList[pc][index[s]] = s;
+              pieceCount[make_piece(color_of(pc), ALL_PIECES)]++;
+          }
+      }
+
+  accPly = 0;
+  std::fill_n(accumulators->owner, AccumulatorStack::Size, nullptr);
+  std::memcpy(accumulator(0), pos.accumulator(pos.accPly), HIDDEN_BIAS * sizeof(int16_t));
+  accumulators->owner[0] = st;
+
+  thisThread = th;
 
   assert(pos_is_ok());
 
@@ -292,6 +420,85 @@ Position& Position::set(const string& fenStr, bool isChess960, StateInfo* si, Th
 }
 
 
+/// Position::alloc_accumulators() allocates the accumulator stack of a Position
+/// being set up for the first time. The stack is reused by the next set(), so a
+/// thread allocates the one of its rootPos once, on its node.
+
+void Position::alloc_accumulators() {
+
+  if (accumulators)
+      return;
+
+  accumulators = new (std::nothrow) AccumulatorStack; // Default-initialized, i.e. left untouched
+  if (!accumulators)
+  {
+      std::cerr << "Failed to allocate " << sizeof(AccumulatorStack)
+                << " bytes for the NNUE accumulators." << std::endl;
+      std::exit(EXIT_FAILURE);
+  }
+}
+
+
+Position::~Position() {
+  delete accumulators;
+}
+
+
+/// Position::pack() encodes the position as a PackedPosition. Only the outermost
+/// rooks can castle after a round trip, which is always the case but in some
+/// Chess960 positions.
+
+void Position::pack(PackedPosition& pp) const {
+
+  assert(popcount(pieces()) <= 32);
+
+  std::memset(&pp, 0, sizeof(PackedPosition));
+  pp.occupied = pieces();
+
+  int n = 0;
+  for (Bitboard b = pieces(); b; ++n)
+      pp.pieces[n / 2] |= uint8_t(piece_on(pop_lsb(&b)) << (4 * (n & 1)));
+
+  pp.flags    = uint8_t(sideToMove | st->castlingRights << 1);
+  pp.epSquare = uint8_t(st->epSquare);
+  pp.rule50   = uint8_t(std::min(st->rule50, 255));
+  pp.fullmove = uint16_t(1 + (gamePly - (sideToMove == BLACK)) / 2);
+}
+
+
+/// Position::reset() clears the position before it is set up. The accumulators
+/// are left alone, they are large and written before they are read, only their
+/// owners are cleared so that no slot is taken for the one of a new state.
+
+void Position::reset(StateInfo* si) {
+
+  alloc_accumulators();
+  std::memset(this, 0, offsetof(Position, accumulators));
+  std::fill_n(accumulators->owner, AccumulatorStack::Size, nullptr);
+  std::memset(si, 0, sizeof(StateInfo));
+  std::fill_n(&pieceList[0][0], sizeof(pieceList) / sizeof(Square), SQ_NONE);
+  st = si;
+}
+
+
+/// Position::outer_rook() returns the square of the outermost rook of color c
+/// on the given side of its king, on the first rank. It is the castling rook
+/// of a "K" or "Q" in a FEN.
+
+Square Position::outer_rook(Color c, CastlingRights side) const {
+
+  Piece rook = make_piece(c, ROOK);
+  Square rsq;
+
+  if (side == KING_SIDE)
+      for (rsq = relative_square(c, SQ_H1); piece_on(rsq) != rook; --rsq) {}
+  else
+      for (rsq = relative_square(c, SQ_A1); piece_on(rsq) != rook; ++rsq) {}
+
+  return rsq;
+}
+
+
 /// Position::set_castling_right() is a helper function used to set castling
 /// rights given the corresponding color and the rook starting square.
 
@@ -331,6 +538,25 @@ void Position::set_check_info(StateInfo* si) const {
 }
 
 
+/// Position::refresh_accumulator() computes the NNUE accumulator of the current
+/// state from scratch, activating the features of all the pieces on the board.
+
+void Position::refresh_accumulator() const {
+
+  int16_t* acc = accumulator(accPly);
+
+  nnue.init_accumulator(acc, HIDDEN_BIAS);
+
+  for (Bitboard b = pieces(); b; )
+  {
+      Square s = pop_lsb(&b);
+      nnue.activate(acc, HIDDEN_BIAS, input_sq(piece_on(s), s));
+  }
+
+  accumulators->owner[AccumulatorStack::slot(accPly)] = st;
+}
+
+
 /// Position::set_state() computes the hash keys of the position, and other
 /// data that once computed is updated incrementally as moves are made.
 /// The function is only used when a new position is set up, and to verify
@@ -692,7 +918,7 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
   assert(is_ok(m));
   assert(&newSt != st);
 
-  thisThread->nodes.fetch_add(1, std::memory_order_relaxed);
+  relaxed_increment(thisThread->nodes);
   Key k = st->key ^ Zobrist::side;
 
   // Copy some fields of the old state to our new StateInfo object except the
@@ -700,13 +926,14 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
   // our state pointer to point to the new (ready to be updated) state.
   std::memcpy(&newSt, st, offsetof(StateInfo, key));
   newSt.previous = st;
-
-  // Make a copy of the previous accumulator
-  for (int i = 0; i < HIDDEN_BIAS; i++)
-      newSt.accumulator[i] = st->accumulator[i];
-
   st = &newSt;
 
+  // Record the NNUE features changed by this move. The accumulator itself is
+  // only computed, in a single fused pass, if the position gets evaluated.
+  DirtyFeatures& dirty = st->dirtyFeatures;
+  dirty.addCount = dirty.removeCount = 0;
+  accumulators->owner[AccumulatorStack::slot(++accPly)] = nullptr;
+
   // Increment ply counters. In particular, rule50 will be reset to zero later on
   // in case of a capture or a pawn move.
   ++gamePly;
@@ -732,6 +959,11 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
       Square rfrom, rto;
       do_castling<true>(us, from, to, rfrom, rto);
 
+      dirty.removed[dirty.removeCount++] = input_sq(pc, from);
+      dirty.removed[dirty.removeCount++] = input_sq(captured, rfrom);
+      dirty.added[dirty.addCount++] = input_sq(pc, to);
+      dirty.added[dirty.addCount++] = input_sq(captured, rto);
+
       k ^= Zobrist::psq[captured][rfrom] ^ Zobrist::psq[captured][rto];
       captured = NO_PIECE;
   }
@@ -763,16 +995,17 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
       // Update board and piece lists
       remove_piece(capsq);
 
-      // Update accumulator
-      nnue.deactivate(st->accumulator, HIDDEN_BIAS, input_sq(captured, capsq));
+      dirty.removed[dirty.removeCount++] = input_sq(captured, capsq);
 
       if (type_of(m) == ENPASSANT)
           board[capsq] = NO_PIECE;
 
-      // Update material hash key and prefetch access to materialTable
+      // Update material hash key and prefetch access to materialTable, if
+      // the classical evaluation allocated it
       k ^= Zobrist::psq[captured][capsq];
       st->materialKey ^= Zobrist::psq[captured][pieceCount[captured]];
-      prefetch(thisThread->materialTable[st->materialKey]);
+      if (Material::Entry* me = thisThread->materialTable.peek(st->materialKey))
+          prefetch(me);
 
       // Reset rule 50 counter
       st->rule50 = 0;
@@ -801,9 +1034,8 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
   {
       move_piece(from, to);
 
-      // Update accumulator
-      nnue.deactivate(st->accumulator, HIDDEN_BIAS, input_sq(pc, from));
-      nnue.activate(st->accumulator, HIDDEN_BIAS, input_sq(pc, to));
+      dirty.removed[dirty.removeCount++] = input_sq(pc, from);
+      dirty.added[dirty.addCount++] = input_sq(pc, to);
   }
 
   // If the moving piece is a pawn do some special extra work
@@ -827,9 +1059,8 @@ void Position::do_move(Move m, StateInfo& newSt, bool givesCheck) {
           remove_piece(to);
           put_piece(promotion, to);
 
-          // Update accumulator
-          nnue.deactivate(st->accumulator, HIDDEN_BIAS, input_sq(pc, to));
-          nnue.activate(st->accumulator, HIDDEN_BIAS, input_sq(promotion, to));
+          // The promoted piece, not the pawn, ends up on the destination square
+          dirty.added[dirty.addCount - 1] = input_sq(promotion, to);
 
           // Update hash keys
           k ^= Zobrist::psq[pc][to] ^ Zobrist::psq[promotion][to];
@@ -944,6 +1175,7 @@ void Position::undo_move(Move m) {
   // Finally point our state pointer back to the previous state
   st = st->previous;
   --gamePly;
+  --accPly;
 
   assert(pos_is_ok());
 }
@@ -959,15 +1191,6 @@ void Position::do_castling(Color us, Square from, Square& to, Square& rfrom, Squ
   rto = relative_square(us, kingSide ? SQ_F1 : SQ_D1);
   to = relative_square(us, kingSide ? SQ_G1 : SQ_C1);
 
-  if (Do)
-  {
-      // Update accumulator
-      nnue.deactivate(st->accumulator, HIDDEN_BIAS, input_sq(make_piece(us, KING), from));  // remove king
-      nnue.deactivate(st->accumulator, HIDDEN_BIAS, input_sq(make_piece(us, ROOK), rfrom)); // remove rook
-      nnue.activate(st->accumulator, HIDDEN_BIAS, input_sq(make_piece(us, KING), to));      // add king
-      nnue.activate(st->accumulator, HIDDEN_BIAS, input_sq(make_piece(us, ROOK), rto));     // add rook
-  }
-
   // Remove both pieces first since squares could overlap in Chess960
   remove_piece(Do ? from : to);
   remove_piece(Do ? rfrom : rto);
@@ -987,13 +1210,12 @@ void Position::do_null_move(StateInfo& newSt) {
 
   std::memcpy(&newSt, st, sizeof(StateInfo));
   newSt.previous = st;
-
-  // Make a copy of the previous accumulator
-  for (int i = 0; i < HIDDEN_BIAS; i++)
-      newSt.accumulator[i] = st->accumulator[i];
-
   st = &newSt;
 
+  // No feature changes, the accumulator is copied from the previous one if needed
+  st->dirtyFeatures.addCount = st->dirtyFeatures.removeCount = 0;
+  accumulators->owner[AccumulatorStack::slot(++accPly)] = nullptr;
+
   if (st->epSquare != SQ_NONE)
   {
       st->key ^= Zobrist::enpassant[file_of(st->epSquare)];
@@ -1001,7 +1223,7 @@ void Position::do_null_move(StateInfo& newSt) {
   }
 
   st->key ^= Zobrist::side;
-  prefetch(TT.first_entry(st->key));
+  prefetch(thisThread->engine.tt.first_entry(st->key));
 
   ++st->rule50;
   st->pliesFromNull = 0;
@@ -1020,6 +1242,7 @@ void Position::undo_null_move() {
   assert(!checkers());
 
   st = st->previous;
+  --accPly;
   sideToMove = ~sideToMove;
 }
 
@@ -1147,11 +1370,125 @@ bool Position::see_ge(Move m, Value threshold) const {
 }
 
 
+/// Position::update_accumulator() makes sure the NNUE accumulator of the
+/// current state is computed. It walks back to the nearest state with a
+/// computed accumulator and then applies the recorded feature changes
+/// forward, so that the intermediate states can be reused by siblings. If
+/// that ancestor is too far away, or is the root one, the accumulator is
+/// refreshed from scratch.
+
+void Position::update_accumulator() const {
+
+  constexpr int MaxLazyUpdates = 16;
+
+  const StateInfo* path[MaxLazyUpdates];
+  const StateInfo* si = st;
+  int ply = accPly, n = 0;
+
+  while (accumulators->owner[AccumulatorStack::slot(ply)] != si)
+  {
+      if (n == MaxLazyUpdates || ply == 0)
+      {
+          refresh_accumulator();
+          return;
+      }
+
+      path[n++] = si;
+      si = si->previous;
+      --ply;
+  }
+
+  while (n--)
+  {
+      const DirtyFeatures& dirty = path[n]->dirtyFeatures;
+
+      nnue.update(accumulator(ply + 1), accumulator(ply), HIDDEN_BIAS,
+                  dirty.added, dirty.addCount, dirty.removed, dirty.removeCount);
+
+      accumulators->owner[AccumulatorStack::slot(++ply)] = path[n];
+  }
+}
+
+
+/// Position::dirty_features() fills dirty with the NNUE features that the
+/// move m would remove and add, the same ones do_move() records.
+
+void Position::dirty_features(Move m, DirtyFeatures& dirty) const {
+
+  assert(is_ok(m));
+
+  Color us = sideToMove;
+  Square from = from_sq(m);
+  Square to = to_sq(m);
+  Piece pc = piece_on(from);
+
+  dirty.addCount = dirty.removeCount = 0;
+  dirty.removed[dirty.removeCount++] = input_sq(pc, from);
+
+  if (type_of(m) == CASTLING)
+  {
+      // Castling is encoded as "king captures friendly rook"
+      bool kingSide = to > from;
+      Piece rook = make_piece(us, ROOK);
+
+      dirty.removed[dirty.removeCount++] = input_sq(rook, to);
+      dirty.added[dirty.addCount++] = input_sq(pc, relative_square(us, kingSide ? SQ_G1 : SQ_C1));
+      dirty.added[dirty.addCount++] = input_sq(rook, relative_square(us, kingSide ? SQ_F1 : SQ_D1));
+      return;
+  }
+
+  Square capsq = type_of(m) == ENPASSANT ? to - pawn_push(us) : to;
+
+  if (piece_on(capsq))
+      dirty.removed[dirty.removeCount++] = input_sq(piece_on(capsq), capsq);
+
+  dirty.added[dirty.addCount++] = input_sq(type_of(m) == PROMOTION ? make_piece(us, promotion_type(m)) : pc, to);
+}
+
+
 /// Position::nnue_output() returns the output value of our NNUE
 
 Value Position::nnue_output() const {
 
-  return Value(nnue.output(st->accumulator, HIDDEN_BIAS));
+  update_accumulator();
+
+  return Value(nnue.output(accumulator(accPly), HIDDEN_BIAS));
+}
+
+
+/// Position::nnue_output_children() computes, without making the moves, the
+/// nnue_output() of the positions reached by each of the n given moves. The
+/// children accumulators are derived from ours and evaluated together, so
+/// that the output weights are loaded once per batch instead of per child.
+
+void Position::nnue_output_children(const Move moves[], int n, Value values[]) const {
+
+  constexpr int BatchSize = 8;
+
+  alignas(64) int16_t children[BatchSize][HIDDEN_BIAS];
+  const int16_t* accs[BatchSize];
+  int32_t out[BatchSize];
+  DirtyFeatures dirty;
+
+  update_accumulator();
+
+  for (int b = 0; b < n; b += BatchSize)
+  {
+      int count = std::min(BatchSize, n - b);
+
+      for (int i = 0; i < count; ++i)
+      {
+          dirty_features(moves[b + i], dirty);
+          nnue.update(children[i], accumulator(accPly), HIDDEN_BIAS,
+                      dirty.added, dirty.addCount, dirty.removed, dirty.removeCount);
+          accs[i] = children[i];
+      }
+
+      nnue.output_batch(accs, count, out);
+
+      for (int i = 0; i < count; ++i)
+          values[b + i] = Value(out[i]);
+  }
 }
 
 
@@ -55,8 +55,29 @@ struct StateInfo {
   Bitboard   pinners[COLOR_NB];
   Bitboard   checkSquares[PIECE_TYPE_NB];
   int        repetition;
-  // Used by NNUE
-  int16_t    accumulator[HIDDEN_BIAS];
+  // Used by NNUE, the accumulator is computed lazily from the previous one
+  DirtyFeatures dirtyFeatures;
+};
+
+
+/// AccumulatorStack holds the NNUE accumulators of a Position apart from the
+/// StateInfo objects, so that these stay small and the accumulators are cache
+/// line aligned for the SIMD kernels. The slot of a state is its ply from the
+/// root, modulo Size, and is valid only while owner records that state: the
+/// new states invalidate their slot and the lines deeper than Size plies only
+/// cost a recomputation of the ancestors they overwrote. At 64 KB it is too big
+/// to be part of every Position, the temporary ones included, so each Position
+/// allocates its own when it is first set up, see Position::reset().
+
+struct AccumulatorStack {
+
+  static constexpr int Size = 128;
+  static_assert((Size & (Size - 1)) == 0, "Size must be a power of 2");
+
+  static int slot(int ply) { return ply & (Size - 1); }
+
+  alignas(64) int16_t accumulator[Size][HIDDEN_BIAS];
+  const StateInfo* owner[Size];
 };
 
 
@@ -68,6 +89,26 @@ typedef std::unique_ptr<std::deque<StateInfo>> StateListPtr;
 
 class Thread;
 
+
+/// PackedPosition is a fixed size encoding of a position, 32 bytes in native
+/// byte order, read without parsing by the 'evalstream' command. The pieces
+/// take four bits each, in the square order of the occupied bitboard, and the
+/// castling rooks are the outermost ones, as for "KQkq" in a FEN.
+
+struct PackedPosition {
+  uint64_t occupied;
+  uint8_t  pieces[16]; // Piece codes, the first one in the low nibble
+  uint8_t  flags;      // Bit 0 set if black to move, bits 1-4 CastlingRights
+  uint8_t  epSquare;   // SQ_NONE if none
+  uint8_t  rule50;
+  uint8_t  reserved;
+  uint16_t fullmove;
+  uint16_t padding;
+};
+
+static_assert(sizeof(PackedPosition) == 32, "Unexpected PackedPosition size");
+
+
 /// Position class stores information regarding the board representation as
 /// pieces, side to move, hash keys, castling info, etc. Important methods are
 /// do_move() and undo_move(), used by the search to update node info when
@@ -78,13 +119,17 @@ public:
   static void init();
 
   Position() = default;
+ ~Position();
   Position(const Position&) = delete;
   Position& operator=(const Position&) = delete;
 
   // FEN string input/output
   Position& set(const std::string& fenStr, bool isChess960, StateInfo* si, Thread* th);
   Position& set(const std::string& code, Color c, StateInfo* si);
+  bool set(const PackedPosition& pp, bool isChess960, StateInfo* si, Thread* th);
+  Position& set(const Position& pos, Thread* th);
   const std::string fen() const;
+  void pack(PackedPosition& pp) const;
 
   // Position representation
   Bitboard pieces(PieceType pt) const;
@@ -150,7 +195,10 @@ public:
   Key pawn_key() const;
 
   // NNUE
+  void update_accumulator() const;
+  void dirty_features(Move m, DirtyFeatures& dirty) const;
   Value nnue_output() const;
+  void nnue_output_children(const Move moves[], int n, Value values[]) const;
 
   // Other properties of the position
   Color side_to_move() const;
@@ -171,9 +219,14 @@ public:
 
 private:
   // Initialization helpers (used while setting up a position)
+  void reset(StateInfo* si);
+  void alloc_accumulators();
+  Square outer_rook(Color c, CastlingRights side) const;
   void set_castling_right(Color c, Square rfrom);
   void set_state(StateInfo* si) const;
   void set_check_info(StateInfo* si) const;
+  void refresh_accumulator() const;
+  int16_t* accumulator(int ply) const;
 
   // Other helpers
   void put_piece(Piece pc, Square s);
@@ -198,6 +251,8 @@ private:
   Thread* thisThread;
   StateInfo* st;
   bool chess960;
+  int accPly;
+  AccumulatorStack* accumulators = nullptr; // Last, not cleared by reset()
 };
 
 namespace PSQT {
@@ -378,6 +433,10 @@ inline Piece Position::captured_piece() const {
   return st->capturedPiece;
 }
 
+inline int16_t* Position::accumulator(int ply) const {
+  return accumulators->accumulator[AccumulatorStack::slot(ply)];
+}
+
 inline Thread* Position::this_thread() const {
   return thisThread;
 }
@@ -22,9 +22,13 @@
 #include <cassert>
 #include <cmath>
 #include <cstring>   // For std::memset
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <sstream>
 
+#include "cluster.h"
+#include "engine.h"
 #include "evaluate.h"
 #include "misc.h"
 #include "movegen.h"
@@ -37,23 +41,9 @@
 #include "uci.h"
 #include "syzygy/tbprobe.h"
 
-namespace Search {
-
-  LimitsType Limits;
-}
-
-namespace Tablebases {
-
-  int Cardinality;
-  bool RootInTB;
-  bool UseRule50;
-  Depth ProbeDepth;
-}
-
 namespace TB = Tablebases;
 
 using std::string;
-using Eval::evaluate;
 using namespace Search;
 
 namespace {
@@ -61,6 +51,16 @@ namespace {
   // Different node types, used as a template parameter
   enum NodeType { NonPV, PV };
 
+  // Hot path counters of thisThread, see Search::Stats. They compile to
+  // nothing unless built with searchstats=yes.
+#ifdef SEARCH_STATS
+  #define STAT_INC(c)     (++thisThread->searchStats.counters[Search::Stats::c])
+  #define STAT_HIST(h, v) (++thisThread->searchStats.h[std::min(int(v), Search::Stats::HistSize - 1)])
+#else
+  #define STAT_INC(c)     ((void)0)
+  #define STAT_HIST(h, v) ((void)0)
+#endif
+
   constexpr uint64_t TtHitAverageWindow     = 4096;
   constexpr uint64_t TtHitAverageResolution = 1024;
 
@@ -70,11 +70,9 @@ namespace {
     return Value(227 * (d - improving));
   }
 
-  // Reductions lookup table, initialized at startup
-  int Reductions[MAX_MOVES]; // [depth or moveNumber]
-
-  Depth reduction(bool i, Depth d, int mn) {
-    int r = Reductions[d] * Reductions[mn];
+  // Reductions lookup table of the engine, see Search::init()
+  Depth reduction(const int* reductions, bool i, Depth d, int mn) {
+    int r = reductions[d] * reductions[mn];
     return (r + 570) / 1024 + (!i && r > 1018);
   }
 
@@ -97,7 +95,7 @@ namespace {
     explicit Skill(int l) : level(l) {}
     bool enabled() const { return level < 20; }
     bool time_to_pick(Depth depth) const { return depth == 1 + level; }
-    Move pick_best(size_t multiPV);
+    Move pick_best(const RootMoves& rootMoves, size_t multiPV);
 
     int level;
     Move best = MOVE_NONE;
@@ -146,10 +144,31 @@ namespace {
     bool otherThread, owning;
   };
 
-  template <NodeType NT>
+  // busy_elsewhere() returns true if another thread has left its breadcrumbs at
+  // the node with the given key, that is if it is searching that node right now.
+  bool busy_elsewhere(const Thread* thisThread, Key key, int ply) {
+
+    if (ply >= 8)
+        return false;
+
+    const Breadcrumb& b = breadcrumbs[key & (breadcrumbs.size() - 1)];
+    const Thread* tmp = b.thread.load(std::memory_order_relaxed);
+
+    return    tmp && tmp != thisThread
+           && b.key.load(std::memory_order_relaxed) == key;
+  }
+
+  // With the ABDADA 'SMP Mode' the moves leading to a node already searched by
+  // another thread are deferred to the end of the move loop, at most this many
+  constexpr int MaxDeferredMoves = 32;
+
+  // The evaluator is a template parameter, picked once per iteration in
+  // Thread::search(), so that the nodes neither test UseNNUE nor call it
+  // through a pointer.
+  template <NodeType NT, Eval::EvalMode EM>
   Value search(Position& pos, Stack* ss, Value alpha, Value beta, Depth depth, bool cutNode);
 
-  template <NodeType NT>
+  template <NodeType NT, Eval::EvalMode EM>
   Value qsearch(Position& pos, Stack* ss, Value alpha, Value beta, Depth depth = 0);
 
   Value value_to_tt(Value v, int ply);
@@ -162,52 +181,203 @@ namespace {
 
   // perft() is our utility to verify move generation. All the leaf nodes up
   // to the given depth are generated and counted, and the sum is returned.
-  template<bool Root>
-  uint64_t perft(Position& pos, Depth depth) {
+  // The counts of the subtrees of 3 plies or more are cached in the perft
+  // hash, keyed by position key and depth.
+  uint64_t perft(Position& pos, Depth depth, PerftTable& table) {
+
+    if (depth <= 1)
+        return MoveList<LEGAL>(pos).size();
+
+    PerftTable::Entry* tte = nullptr;
+    const Key key = pos.key() ^ (uint64_t(depth) * 0x9E3779B97F4A7C15ULL);
+
+    if (table.entries && depth >= 3)
+    {
+        tte = &table.entries[key & table.mask];
+        uint64_t cnt = tte->count.load(std::memory_order_relaxed);
+
+        if ((tte->check.load(std::memory_order_relaxed) ^ cnt) == key)
+            return cnt;
+    }
 
     StateInfo st;
-    uint64_t cnt, nodes = 0;
-    const bool leaf = (depth == 2);
+    uint64_t nodes = 0;
 
     for (const auto& m : MoveList<LEGAL>(pos))
     {
-        if (Root && depth <= 1)
-            cnt = 1, nodes++;
-        else
+        pos.do_move(m, st);
+        nodes += perft(pos, depth - 1, table);
+        pos.undo_move(m);
+    }
+
+    if (tte)
+    {
+        tte->count.store(nodes, std::memory_order_relaxed);
+        tte->check.store(key ^ nodes, std::memory_order_relaxed);
+    }
+
+    return nodes;
+  }
+
+  // perft_root() splits the root moves over the threads of the pool, which
+  // take the next unsearched move until none is left, and prints the count of
+  // each move followed by the total. The perft hash of the engine is allocated
+  // here, halving its size until the allocation succeeds, and zeroed by the
+  // pool threads. Without memory perft runs without it.
+  uint64_t perft_root(MainThread* mainThread, Depth depth) {
+
+    Engine& engine = mainThread->engine;
+    const TimePoint startTime = now();
+    const MoveList<LEGAL> legalMoves(mainThread->rootPos);
+    const std::vector<Move> moves(legalMoves.begin(), legalMoves.end());
+    std::vector<uint64_t> counts(moves.size());
+    std::atomic<size_t> nextMove(0);
+
+    PerftTable& table = engine.perft;
+    size_t bytes = std::min(engine.tt.size() / 4, PerftTable::MaxMB * 1024 * 1024);
+    size_t entries = std::max(bytes / sizeof(PerftTable::Entry), size_t(1));
+
+    for (entries = size_t(1) << msb(entries); entries >= 1024; entries /= 2)
+        if ((table.entries = static_cast<PerftTable::Entry*>(
+                 aligned_large_pages_alloc(entries * sizeof(PerftTable::Entry)))))
+            break;
+
+    if (table.entries)
+    {
+        table.mask = entries - 1;
+        const size_t threadCount = engine.threads.size();
+
+        // Each thread zeroes its part of the table, the main thread its own
+        auto zero = [&table, entries, threadCount](size_t idx) {
+            const size_t stride = entries / threadCount,
+                         start  = stride * idx,
+                         len    = idx != threadCount - 1 ? stride : entries - start;
+
+            std::memset(static_cast<void*>(&table.entries[start]), 0, len * sizeof(PerftTable::Entry));
+        };
+
+        for (size_t idx = 1; idx < threadCount; ++idx)
+            engine.threads[idx]->run_custom_job([zero, idx]() { zero(idx); });
+
+        zero(0);
+        engine.threads.wait_for_jobs_finished();
+    }
+
+    auto work = [&](Thread* th) {
+        StateInfo st;
+        size_t i;
+
+        while ((i = nextMove++) < moves.size())
         {
-            pos.do_move(m, st);
-            cnt = leaf ? MoveList<LEGAL>(pos).size() : perft<false>(pos, depth - 1);
-            nodes += cnt;
-            pos.undo_move(m);
+            th->rootPos.do_move(moves[i], st);
+            counts[i] = depth <= 1 ? 1 : perft(th->rootPos, depth - 1, table);
+            th->rootPos.undo_move(moves[i]);
         }
-        if (Root)
-            sync_cout << UCI::move(m, pos.is_chess960()) << ": " << cnt << sync_endl;
+    };
+
+    for (Thread* th : engine.threads)
+        if (th != mainThread)
+            th->run_custom_job([&, th]() { work(th); });
+
+    work(mainThread);
+    engine.threads.wait_for_jobs_finished();
+
+    aligned_large_pages_free(table.entries);
+    table.entries = nullptr;
+
+    uint64_t nodes = 0;
+    for (size_t i = 0; i < moves.size(); ++i)
+    {
+        sync_cout << UCI::move(moves[i], mainThread->rootPos.is_chess960()) << ": " << counts[i] << sync_endl;
+        nodes += counts[i];
     }
+
+    TimePoint elapsed = now() - startTime + 1; // Avoid a zero division
+
+    sync_cout << "\nNodes searched: " << nodes
+              << "\nPerft splits  : " << moves.size() << " root moves over " << engine.threads.size() << " threads"
+              << "\nNodes/second  : " << 1000 * nodes / elapsed << "\n" << sync_endl;
+
     return nodes;
   }
 
 } // namespace
 
 
-/// Search::init() is called at startup to initialize various lookup tables
+/// Search::init() is called when the threads of an engine are created, to
+/// initialize the lookup tables that depend on their number.
 
-void Search::init() {
+void Search::init(Engine& engine) {
 
   for (int i = 1; i < MAX_MOVES; ++i)
-      Reductions[i] = int((24.8 + std::log(Threads.size())) * std::log(i));
+      engine.reductions[i] = int((24.8 + std::log(engine.threads.size())) * std::log(i));
 }
 
 
-/// Search::clear() resets search state to its initial value
+/// Search::clear() resets the search state of an engine to its initial value
 
-void Search::clear() {
+void Search::clear(Engine& engine) {
 
-  Threads.main()->wait_for_search_finished();
+  engine.threads.main()->wait_for_search_finished();
 
-  Time.availableNodes = 0;
-  TT.clear();
-  Threads.clear();
-  Tablebases::init(Options["SyzygyPath"]); // Free mapped files
+  engine.time.availableNodes = 0;
+  engine.tt.clear();
+  engine.threads.clear();
+  Tablebases::init(Options["SyzygyPath"]); // No-op unless the path changed
+}
+
+
+/// Search::stats() returns the eval cache hits and, if compiled in, the counters
+/// of the search decisions summed over all the threads of an engine since they
+/// were created.
+
+std::string Search::stats(const Engine& engine) {
+
+  std::stringstream ss;
+  uint64_t probes = 0, hits = 0;
+
+  for (Thread* th : engine.threads)
+      probes += th->evalCache.probes, hits += th->evalCache.hits;
+
+  ss << std::fixed << std::setprecision(2)
+     << "Eval cache hits     : " << hits << " of " << probes << " probes ("
+     << (probes ? 100.0 * hits / probes : 0.0) << "%)\n";
+
+#ifdef SEARCH_STATS
+  Stats total = {};
+
+  for (Thread* th : engine.threads)
+      total.add(th->searchStats);
+
+  const uint64_t* c = total.counters;
+  auto pct = [](uint64_t n, uint64_t d) { return d ? 100.0 * n / d : 0.0; };
+
+  ss << "Eval calls          : " << c[Stats::EVAL_CALL]
+     << "\nTT cutoffs          : " << c[Stats::TT_CUTOFF] << ", in qsearch " << c[Stats::QS_TT_CUTOFF]
+     << "\nRazoring            : " << c[Stats::RAZORING]
+     << "\nFutility cutoffs    : " << c[Stats::FUTILITY_CUTOFF]
+     << "\nNull move cutoffs   : " << c[Stats::NULL_MOVE_CUTOFF] << " of " << c[Stats::NULL_MOVE]
+     << " (" << pct(c[Stats::NULL_MOVE_CUTOFF], c[Stats::NULL_MOVE]) << "%)"
+     << "\nProbCut cutoffs     : " << c[Stats::PROBCUT_CUTOFF]
+     << "\nShallow pruning     : " << c[Stats::SHALLOW_TRIED] - c[Stats::SHALLOW_SURVIVED]
+     << " of " << c[Stats::SHALLOW_TRIED] << " moves ("
+     << pct(c[Stats::SHALLOW_TRIED] - c[Stats::SHALLOW_SURVIVED], c[Stats::SHALLOW_TRIED]) << "%)"
+     << "\nLMR re-searches     : " << c[Stats::LMR_RESEARCH] << " of " << c[Stats::LMR_SEARCH]
+     << " (" << pct(c[Stats::LMR_RESEARCH], c[Stats::LMR_SEARCH]) << "%)"
+     << "\nQsearch stand pats  : " << c[Stats::QS_STAND_PAT];
+
+  ss << "\nLMR reductions      :";
+  for (int i = 0; i < Stats::HistSize; ++i)
+      ss << " " << i << (i == Stats::HistSize - 1 ? "+: " : ": ") << total.reduction[i];
+
+  ss << "\nQsearch depth       :";
+  for (int i = 0; i < Stats::HistSize; ++i)
+      ss << " " << i << (i == Stats::HistSize - 1 ? "+: " : ": ") << total.qsearchDepth[i];
+#else
+  ss << "Search counters not compiled in, build with searchstats=yes";
+#endif
+
+  return ss.str();
 }
 
 
@@ -216,79 +386,145 @@ void Search::clear() {
 
 void MainThread::search() {
 
-  if (Limits.perft)
+  if (engine.limits.perft)
   {
-      nodes = perft<true>(rootPos, Limits.perft);
-      sync_cout << "\nNodes searched: " << nodes << "\n" << sync_endl;
+      nodes = perft_root(this, engine.limits.perft);
       return;
   }
 
   Color us = rootPos.side_to_move();
-  Time.init(Limits, us, rootPos.game_ply());
-  TT.new_search();
+  engine.time.init(engine.limits, us, rootPos.game_ply(), engine.config);
+  engine.tt.new_search();
 
 //SmFiNPS Begin
 
-  if (Options["Search_Nodes"])
-      Limits.nodes = int(Options["Search_Nodes"]);
+  if (engine.config.searchNodes)
+      engine.limits.nodes = engine.config.searchNodes;
 
-  if (Options["Search_Depth"])
-      Limits.depth = int(Options["Search_Depth"]);
+  if (engine.config.searchDepth)
+      engine.limits.depth = engine.config.searchDepth;
 
 //SmFiNPS End
 
   if (rootMoves.empty())
   {
       rootMoves.emplace_back(MOVE_NONE);
-      sync_cout << "info depth 0 score "
-                << UCI::value(rootPos.checkers() ? -VALUE_MATE : VALUE_DRAW)
-                << sync_endl;
+
+      if (!engine.silent)
+          sync_cout << "info depth 0 score "
+                    << UCI::value(rootPos.checkers() ? -VALUE_MATE : VALUE_DRAW)
+                    << sync_endl;
   }
   else
   {
-      Threads.start_searching(); // start non-main threads
+      if (engine.config.useNNUE)
+          nnue.verify();
+
+      // Node limits need the node count of every thread, so they are still
+      // checked in the search by check_time().
+      useTimer =   engine.config.timerThread
+                && !engine.limits.nodes
+                && !engine.limits.npmsec
+                && (engine.limits.use_time_management() || engine.limits.movetime);
+
+      if (useTimer)
+      {
+          std::lock_guard<std::mutex> lk(timerMutex);
+          if (!timer.joinable())
+              timer = std::thread(&MainThread::timer_loop, this);
+          timerArmed = true;
+          timerCv.notify_all();
+      }
+
+      engine.threads.start_searching(); // start non-main threads
       Thread::search();          // main thread start searching
+
+      if (useTimer)
+      {
+          // Disarm the timer through its own flag, so that it is woken up now
+          // and not at its next deadline, then wait until it is idle again. The
+          // stop flag is left alone: a ponder or infinite search still has to
+          // wait below for "stop" or "ponderhit".
+          std::unique_lock<std::mutex> lk(timerMutex);
+          timerDisarm = true;
+          timerCv.notify_all();
+          timerCv.wait(lk, [&]{ return !timerArmed; });
+          timerDisarm = false;
+          useTimer = false;
+      }
   }
 
   // When we reach the maximum depth, we can arrive here without a raise of
-  // Threads.stop. However, if we are pondering or in an infinite search,
+  // engine.threads.stop. However, if we are pondering or in an infinite search,
   // the UCI protocol states that we shouldn't print the best move before the
   // GUI sends a "stop" or "ponderhit" command. We therefore simply wait here
   // until the GUI sends one of those commands.
 
-  while (!Threads.stop && (ponder || Limits.infinite))
+  // In MultiPV split mode the helpers search to the depth limit on their own
+  if (engine.threads.pvGroups > 1 && engine.limits.depth)
+      engine.threads.wait_for_search_finished();
+
+  while (!engine.threads.stop && (ponder || engine.limits.infinite))
   {} // Busy wait for a stop or a ponder reset
 
   // Stop the threads if not already stopped (also raise the stop if
-  // "ponderhit" just reset Threads.ponder).
-  Threads.stop = true;
+  // "ponderhit" just reset engine.threads.ponder).
+  engine.threads.stop = true;
 
   // Wait until all threads have finished
-  Threads.wait_for_search_finished();
+  engine.threads.wait_for_search_finished();
 
   // When playing in 'nodes as time' mode, subtract the searched nodes from
   // the available ones before exiting.
-  if (Limits.npmsec)
-      Time.availableNodes += Limits.inc[us] - Threads.nodes_searched();
+  if (engine.limits.npmsec)
+      engine.time.availableNodes += engine.limits.inc[us] - engine.threads.nodes_searched();
 
   Thread* bestThread = this;
+  Depth linesDepth = 0;
+  RootMoves lines;
 
-  if (   int(Options["MultiPV"]) == 1
-      && !Limits.depth
-      && !(Skill(Options["Skill Level"]).enabled() || int(Options["UCI_LimitStrength"]))
+  if (engine.threads.pvGroups > 1)
+      lines = engine.threads.merged_lines(linesDepth);
+
+  else if (   engine.config.multiPV == 1
+      && !engine.limits.depth
+      && !(Skill(engine.config.skillLevel).enabled() || engine.config.limitStrength)
       && rootMoves[0].pv[0] != MOVE_NONE)
-      bestThread = Threads.get_best_thread();
+      bestThread = engine.threads.get_best_thread();
+
+  // Without a line from each group, which happens only if stopped at once,
+  // fall back to the moves of the main thread.
+  RootMove& best = lines.empty() ? bestThread->rootMoves[0] : lines[0];
+
+#ifdef USE_CLUSTER
+  if (!engine.silent && engine.threads.pvGroups == 1)
+  {
+      Cluster::send("stop");
+      Cluster::vote(rootPos, best, bestThread->completedDepth);
+  }
+#endif
+
+  bestPreviousScore = best.score;
 
-  bestPreviousScore = bestThread->rootMoves[0].score;
+  // A silent engine hands over the result in the root moves of the main thread
+  if (engine.silent)
+  {
+      if (bestThread != this)
+          rootMoves = bestThread->rootMoves, completedDepth = bestThread->completedDepth;
+      return;
+  }
 
-  // Send again PV info if we have a new best thread
-  if (bestThread != this)
+  // Send again PV info if we have a new best thread, or the merged lines
+  if (!lines.empty())
+      sync_cout << UCI::pv(rootPos, lines, lines.size(), linesDepth, -VALUE_INFINITE, VALUE_INFINITE) << sync_endl;
+
+  else if (bestThread != this)
       sync_cout << UCI::pv(bestThread->rootPos, bestThread->completedDepth, -VALUE_INFINITE, VALUE_INFINITE) << sync_endl;
 
-  sync_cout << "bestmove " << UCI::move(bestThread->rootMoves[0].pv[0], rootPos.is_chess960());
+  sync_cout << "bestmove " << UCI::move(best.pv[0], rootPos.is_chess960());
 
-  if (bestThread->rootMoves[0].pv.size() > 1 || bestThread->rootMoves[0].extract_ponder_from_tt(rootPos))
-      std::cout << " ponder " << UCI::move(bestThread->rootMoves[0].pv[1], rootPos.is_chess960());
+  if (best.pv.size() > 1 || best.extract_ponder_from_tt(rootPos))
+      std::cout << " ponder " << UCI::move(best.pv[1], rootPos.is_chess960());
 
   std::cout << sync_endl;
 }
@@ -309,7 +545,7 @@ void Thread::search() {
   Value bestValue, alpha, beta, delta;
   Move  lastBestMove = MOVE_NONE;
   Depth lastBestMoveDepth = 0;
-  MainThread* mainThread = (this == Threads.main() ? Threads.main() : nullptr);
+  MainThread* mainThread = (this == engine.threads.main() ? engine.threads.main() : nullptr);
   double timeReduction = 1, totBestMoveChanges = 0;
   Color us = rootPos.side_to_move();
   int iterIdx = 0;
@@ -336,7 +572,7 @@ void Thread::search() {
   std::copy(&lowPlyHistory[2][0], &lowPlyHistory.back().back() + 1, &lowPlyHistory[0][0]);
   std::fill(&lowPlyHistory[MAX_LPH - 2][0], &lowPlyHistory.back().back() + 1, 0);
 
-  size_t multiPV = size_t(Options["MultiPV"]);
+  size_t multiPV = size_t(engine.config.multiPV);
 
   // Pick integer skill levels, but non-deterministically round up or down
   // such that the average integer skill corresponds to the input floating point one.
@@ -344,9 +580,9 @@ void Thread::search() {
   // to CCRL Elo (goldfish 1.13 = 2000) and a fit through Ordo derived Elo
   // for match (TC 60+0.6) results spanning a wide range of k values.
   PRNG rng(now());
-  double floatLevel = Options["UCI_LimitStrength"] ?
-                      Utility::clamp(std::pow((Options["UCI_Elo"] - 1346.6) / 143.4, 1 / 0.806), 0.0, 20.0) :
-                        double(Options["Skill Level"]);
+  double floatLevel = engine.config.limitStrength ?
+                      Utility::clamp(std::pow((engine.config.elo - 1346.6) / 143.4, 1 / 0.806), 0.0, 20.0) :
+                        double(engine.config.skillLevel);
   int intLevel = int(floatLevel) +
                  ((floatLevel - int(floatLevel)) * 1024 > rng.rand<unsigned>() % 1024  ? 1 : 0);
   Skill skill(intLevel);
@@ -359,26 +595,33 @@ void Thread::search() {
   multiPV = std::min(multiPV, rootMoves.size());
   ttHitAverage = TtHitAverageWindow * TtHitAverageResolution / 2;
 
-  int ct = int(Options["Contempt"]) * PawnValueEg / 100; // From centipawns
+  int ct = engine.config.contempt * PawnValueEg / 100; // From centipawns
 
   // In analysis mode, adjust contempt in accordance with user preference
-  if (Limits.infinite || Options["UCI_AnalyseMode"])
-      ct =  Options["Analysis Contempt"] == "Off"  ? 0
-          : Options["Analysis Contempt"] == "Both" ? ct
-          : Options["Analysis Contempt"] == "White" && us == BLACK ? -ct
-          : Options["Analysis Contempt"] == "Black" && us == WHITE ? -ct
+  if (engine.limits.infinite || engine.config.analyseMode)
+      ct =  engine.config.analysisContempt == "Off"  ? 0
+          : engine.config.analysisContempt == "Both" ? ct
+          : engine.config.analysisContempt == "White" && us == BLACK ? -ct
+          : engine.config.analysisContempt == "Black" && us == WHITE ? -ct
           : ct;
 
   // Evaluation score is from the white point of view
   contempt = (us == WHITE ?  make_score(ct, ct / 2)
                           : -make_score(ct, ct / 2));
 
+#ifndef NNUE_ONLY
+  // Evaluator of the whole search, see the instantiations of search<>() below
+  const bool useNNUE = engine.config.useNNUE;
+#endif
+
   int searchAgainCounter = 0;
 
   // Iterative deepening loop until requested to stop or the target depth is reached
   while (   ++rootDepth < MAX_PLY
-         && !Threads.stop
-         && !(Limits.depth && mainThread && rootDepth > Limits.depth))
+         && !engine.threads.stop
+         && !(   engine.limits.depth
+              && (mainThread || engine.threads.pvGroups > 1)
+              && rootDepth > engine.limits.depth))
   {
       // Age out PV variability metric
       if (mainThread)
@@ -392,11 +635,11 @@ void Thread::search() {
       size_t pvFirst = 0;
       pvLast = 0;
 
-      if (!Threads.increaseDepth)
+      if (!engine.threads.increaseDepth)
          searchAgainCounter++;
 
       // MultiPV loop. We perform a full root search for each PV line
-      for (pvIdx = 0; pvIdx < multiPV && !Threads.stop; ++pvIdx)
+      for (pvIdx = 0; pvIdx < multiPV && !engine.threads.stop; ++pvIdx)
       {
           if (pvIdx == pvLast)
           {
@@ -431,7 +674,12 @@ void Thread::search() {
           while (true)
           {
               Depth adjustedDepth = std::max(1, rootDepth - failedHighCnt - searchAgainCounter);
-              bestValue = ::search<PV>(rootPos, ss, alpha, beta, adjustedDepth, false);
+#ifdef NNUE_ONLY
+              bestValue = ::search<PV, Eval::NNUE>(rootPos, ss, alpha, beta, adjustedDepth, false);
+#else
+              bestValue = useNNUE ? ::search<PV, Eval::NNUE>(rootPos, ss, alpha, beta, adjustedDepth, false)
+                                  : ::search<PV, Eval::CLASSICAL>(rootPos, ss, alpha, beta, adjustedDepth, false);
+#endif
 
               // Bring the best move to the front. It is critical that sorting
               // is done with a stable algorithm because all the values but the
@@ -444,15 +692,17 @@ void Thread::search() {
               // If search has been stopped, we break immediately. Sorting is
               // safe because RootMoves is still valid, although it refers to
               // the previous iteration.
-              if (Threads.stop)
+              if (engine.threads.stop)
                   break;
 
               // When failing high/low give some update (without cluttering
               // the UI) before a re-search.
               if (   mainThread
+                  && !engine.silent
                   && multiPV == 1
+                  && engine.threads.pvGroups == 1
                   && (bestValue <= alpha || bestValue >= beta)
-                  && Time.elapsed() > 3000)
+                  && engine.time.elapsed() > 3000)
                   sync_cout << UCI::pv(rootPos, rootDepth, alpha, beta) << sync_endl;
 
               // In case of failing low/high increase aspiration window and
@@ -486,34 +736,54 @@ void Thread::search() {
           std::stable_sort(rootMoves.begin() + pvFirst, rootMoves.begin() + pvIdx + 1);
 
           if (    mainThread
-              && (Threads.stop || pvIdx + 1 == multiPV || Time.elapsed() > 3000))
+              && !engine.silent
+              && engine.threads.pvGroups == 1
+              && (engine.threads.stop || pvIdx + 1 == multiPV || engine.time.elapsed() > 3000))
               sync_cout << UCI::pv(rootPos, rootDepth, alpha, beta) << sync_endl;
       }
 
-      if (!Threads.stop)
+      if (!engine.threads.stop)
           completedDepth = rootDepth;
 
+      // In MultiPV split mode publish the lines of the group, then the main
+      // thread shows the best lines of all the groups.
+      if (engine.threads.pvGroups > 1 && !engine.threads.stop)
+      {
+          {
+              std::lock_guard<std::mutex> lk(pvMutex);
+              pvSnapshot.assign(rootMoves.begin(), rootMoves.begin() + multiPV);
+              snapshotDepth = completedDepth;
+          }
+
+          Depth d;
+          RootMoves lines;
+          if (   mainThread
+              && !engine.silent
+              && !(lines = engine.threads.merged_lines(d)).empty())
+              sync_cout << UCI::pv(rootPos, lines, lines.size(), d, -VALUE_INFINITE, VALUE_INFINITE) << sync_endl;
+      }
+
       if (rootMoves[0].pv[0] != lastBestMove) {
          lastBestMove = rootMoves[0].pv[0];
          lastBestMoveDepth = rootDepth;
       }
 
       // Have we found a "mate in x"?
-      if (   Limits.mate
+      if (   engine.limits.mate
           && bestValue >= VALUE_MATE_IN_MAX_PLY
-          && VALUE_MATE - bestValue <= 2 * Limits.mate)
-          Threads.stop = true;
+          && VALUE_MATE - bestValue <= 2 * engine.limits.mate)
+          engine.threads.stop = true;
 
       if (!mainThread)
           continue;
 
       // If skill level is enabled and time is up, pick a sub-optimal best move
       if (skill.enabled() && skill.time_to_pick(rootDepth))
-          skill.pick_best(multiPV);
+          skill.pick_best(rootMoves, multiPV);
 
       // Do we have time for the next iteration? Can we stop searching now?
-      if (    Limits.use_time_management()
-          && !Threads.stop
+      if (    engine.limits.use_time_management()
+          && !engine.threads.stop
           && !mainThread->stopOnPonderhit)
       {
           double fallingEval = (296 + 6 * (mainThread->bestPreviousScore - bestValue)
@@ -525,32 +795,35 @@ void Thread::search() {
           double reduction = (1.47 + mainThread->previousTimeReduction) / (2.22 * timeReduction);
 
           // Use part of the gained time from a previous stable move for the current move
-          for (Thread* th : Threads)
+          // The counters are written only by their thread, so take the changes
+          // since the last iteration instead of resetting them.
+          for (Thread* th : engine.threads)
           {
-              totBestMoveChanges += th->bestMoveChanges;
-              th->bestMoveChanges = 0;
+              uint64_t changes = th->bestMoveChanges.load(std::memory_order_relaxed);
+              totBestMoveChanges += changes - th->bestMoveChangesSeen;
+              th->bestMoveChangesSeen = changes;
           }
-          double bestMoveInstability = 1 + totBestMoveChanges / Threads.size();
+          double bestMoveInstability = 1 + totBestMoveChanges / engine.threads.size();
 
           double totalTime = rootMoves.size() == 1 ? 0 :
-                             Time.optimum() * fallingEval * reduction * bestMoveInstability;
+                             engine.time.optimum() * fallingEval * reduction * bestMoveInstability;
 
           // Stop the search if we have exceeded the totalTime, at least 1ms search
-          if (Time.elapsed() > totalTime)
+          if (engine.time.elapsed() > totalTime)
           {
               // If we are allowed to ponder do not stop the search now but
               // keep pondering until the GUI sends "ponderhit" or "stop".
               if (mainThread->ponder)
                   mainThread->stopOnPonderhit = true;
               else
-                  Threads.stop = true;
+                  engine.threads.stop = true;
           }
-          else if (   Threads.increaseDepth
+          else if (   engine.threads.increaseDepth
                    && !mainThread->ponder
-                   && Time.elapsed() > totalTime * 0.56)
-                   Threads.increaseDepth = false;
+                   && engine.time.elapsed() > totalTime * 0.56)
+                   engine.threads.increaseDepth = false;
           else
-                   Threads.increaseDepth = true;
+                   engine.threads.increaseDepth = true;
       }
 
       mainThread->iterValue[iterIdx] = bestValue;
@@ -565,7 +838,7 @@ void Thread::search() {
   // If skill level is enabled, swap best PV line with the sub-optimal one
   if (skill.enabled())
       std::swap(rootMoves[0], *std::find(rootMoves.begin(), rootMoves.end(),
-                skill.best ? skill.best : skill.pick_best(multiPV)));
+                skill.best ? skill.best : skill.pick_best(rootMoves, multiPV)));
 }
 
 
@@ -573,7 +846,7 @@ namespace {
 
   // search<>() is the main search function for both PV and non-PV nodes
 
-  template <NodeType NT>
+  template <NodeType NT, Eval::EvalMode EM>
   Value search(Position& pos, Stack* ss, Value alpha, Value beta, Depth depth, bool cutNode) {
 
     constexpr bool PvNode = NT == PV;
@@ -593,7 +866,7 @@ namespace {
 
     // Dive into quiescence search when the depth reaches zero
     if (depth <= 0)
-        return qsearch<NT>(pos, ss, alpha, beta);
+        return qsearch<NT, EM>(pos, ss, alpha, beta);
 
     assert(-VALUE_INFINITE <= alpha && alpha < beta && beta <= VALUE_INFINITE);
     assert(PvNode || (alpha == beta - 1));
@@ -603,6 +876,7 @@ namespace {
     Move pv[MAX_PLY+1], capturesSearched[32], quietsSearched[64];
     StateInfo st;
     TTEntry* tte;
+    TTData ttData;
     Key posKey;
     Move ttMove, move, excludedMove, bestMove;
     Depth extension, newDepth;
@@ -615,6 +889,7 @@ namespace {
 
     // Step 1. Initialize node
     Thread* thisThread = pos.this_thread();
+    Engine& engine = thisThread->engine;
     ss->inCheck = pos.checkers();
     priorCapture = pos.captured_piece();
     Color us = pos.side_to_move();
@@ -622,8 +897,8 @@ namespace {
     bestValue = -VALUE_INFINITE;
     maxValue = VALUE_INFINITE;
 
-    // Check for the available remaining time
-    if (thisThread == Threads.main())
+    // Check for the available remaining time, unless the timer thread does
+    if (thisThread == engine.threads.main() && !static_cast<MainThread*>(thisThread)->useTimer)
         static_cast<MainThread*>(thisThread)->check_time();
 
     // Used to send selDepth info to GUI (selDepth counts from 1, ply from 0)
@@ -633,10 +908,10 @@ namespace {
     if (!rootNode)
     {
         // Step 2. Check for aborted search and immediate draw
-        if (   Threads.stop.load(std::memory_order_relaxed)
+        if (   engine.threads.stop.load(std::memory_order_relaxed)
             || pos.is_draw(ss->ply)
             || ss->ply >= MAX_PLY)
-            return (ss->ply >= MAX_PLY && !ss->inCheck) ? evaluate(pos)
+            return (ss->ply >= MAX_PLY && !ss->inCheck) ? Eval::evaluate<EM>(pos)
                                                         : value_draw(pos.this_thread());
 
         // Step 3. Mate distance pruning. Even if we mate at the next move our score
@@ -673,11 +948,17 @@ namespace {
     // position key in case of an excluded move.
     excludedMove = ss->excludedMove;
     posKey = excludedMove == MOVE_NONE ? pos.key() : pos.key() ^ make_key(excludedMove);
-    tte = TT.probe(posKey, ttHit);
-    ttValue = ttHit ? value_from_tt(tte->value(), ss->ply, pos.rule50_count()) : VALUE_NONE;
+    tte = engine.tt.probe(posKey, ttHit, ttData);
+    ttValue = ttHit ? value_from_tt(ttData.value, ss->ply, pos.rule50_count()) : VALUE_NONE;
     ttMove =  rootNode ? thisThread->rootMoves[thisThread->pvIdx].pv[0]
-            : ttHit    ? tte->move() : MOVE_NONE;
-    ttPv = PvNode || (ttHit && tte->is_pv());
+            : ttHit    ? ttData.move : MOVE_NONE;
+
+#ifdef TT_STATS
+    // A legit entry has a pseudo legal move, or none: count the key16 collisions
+    if (ttHit && ttData.move && !pos.pseudo_legal(ttData.move))
+        ++thisThread->ttStats.collisions;
+#endif
+    ttPv = PvNode || (ttHit && ttData.isPv);
     formerPv = ttPv && !PvNode;
 
     if (   ttPv
@@ -694,10 +975,10 @@ namespace {
     // At non-PV nodes we check for an early TT cutoff
     if (  !PvNode
         && ttHit
-        && tte->depth() >= depth
+        && ttData.depth >= depth
         && ttValue != VALUE_NONE // Possible in case of TT access race
-        && (ttValue >= beta ? (tte->bound() & BOUND_LOWER)
-                            : (tte->bound() & BOUND_UPPER)))
+        && (ttValue >= beta ? (ttData.bound & BOUND_LOWER)
+                            : (ttData.bound & BOUND_UPPER)))
     {
         // If ttMove is quiet, update move sorting heuristics on TT hit
         if (ttMove)
@@ -721,16 +1002,19 @@ namespace {
         }
 
         if (pos.rule50_count() < 90)
+        {
+            STAT_INC(TT_CUTOFF);
             return ttValue;
+        }
     }
 
     // Step 5. Tablebases probe
-    if (!rootNode && TB::Cardinality)
+    if (!rootNode && engine.tb.cardinality)
     {
         int piecesCount = pos.count<ALL_PIECES>();
 
-        if (    piecesCount <= TB::Cardinality
-            && (piecesCount <  TB::Cardinality || depth >= TB::ProbeDepth)
+        if (    piecesCount <= engine.tb.cardinality
+            && (piecesCount <  engine.tb.cardinality || depth >= engine.tb.probeDepth)
             &&  pos.rule50_count() == 0
             && !pos.can_castle(ANY_CASTLING))
         {
@@ -738,14 +1022,14 @@ namespace {
             TB::WDLScore wdl = Tablebases::probe_wdl(pos, &err);
 
             // Force check of time on the next occasion
-            if (thisThread == Threads.main())
+            if (thisThread == engine.threads.main())
                 static_cast<MainThread*>(thisThread)->callsCnt = 0;
 
             if (err != TB::ProbeState::FAIL)
             {
-                thisThread->tbHits.fetch_add(1, std::memory_order_relaxed);
+                relaxed_increment(thisThread->tbHits);
 
-                int drawScore = TB::UseRule50 ? 1 : 0;
+                int drawScore = engine.tb.useRule50 ? 1 : 0;
 
                 // use the range VALUE_MATE_IN_MAX_PLY to VALUE_TB_WIN_IN_MAX_PLY to score
                 value =  wdl < -drawScore ? VALUE_MATED_IN_MAX_PLY + ss->ply + 1
@@ -760,7 +1044,7 @@ namespace {
                 {
                     tte->save(posKey, value_to_tt(value, ss->ply), ttPv, b,
                               std::min(MAX_PLY - 1, depth + 6),
-                              MOVE_NONE, VALUE_NONE);
+                              MOVE_NONE, VALUE_NONE, engine.tt.generation());
 
                     return value;
                 }
@@ -789,16 +1073,16 @@ namespace {
     else if (ttHit)
     {
         // Never assume anything about values stored in TT
-        ss->staticEval = eval = tte->eval();
+        ss->staticEval = eval = ttData.eval;
         if (eval == VALUE_NONE)
-            ss->staticEval = eval = evaluate(pos);
+            ss->staticEval = eval = Eval::evaluate<EM>(pos);
 
         if (eval == VALUE_DRAW)
             eval = value_draw(thisThread);
 
         // Can ttValue be used as a better position evaluation?
         if (    ttValue != VALUE_NONE
-            && (tte->bound() & (ttValue > eval ? BOUND_LOWER : BOUND_UPPER)))
+            && (ttData.bound & (ttValue > eval ? BOUND_LOWER : BOUND_UPPER)))
             eval = ttValue;
     }
     else
@@ -807,19 +1091,22 @@ namespace {
         {
             int bonus = -(ss-1)->statScore / 512;
 
-            ss->staticEval = eval = evaluate(pos) + bonus;
+            ss->staticEval = eval = Eval::evaluate<EM>(pos) + bonus;
         }
         else
             ss->staticEval = eval = -(ss-1)->staticEval + 2 * Tempo;
 
-        tte->save(posKey, VALUE_NONE, ttPv, BOUND_NONE, DEPTH_NONE, MOVE_NONE, eval);
+        tte->save(posKey, VALUE_NONE, ttPv, BOUND_NONE, DEPTH_NONE, MOVE_NONE, eval, engine.tt.generation());
     }
 
     // Step 7. Razoring (~1 Elo)
     if (   !rootNode // The required rootNode PV handling is not available in qsearch
         &&  depth == 1
         &&  eval <= alpha - RazorMargin)
-        return qsearch<NT>(pos, ss, alpha, beta);
+    {
+        STAT_INC(RAZORING);
+        return qsearch<NT, EM>(pos, ss, alpha, beta);
+    }
 
     improving =  (ss-2)->staticEval == VALUE_NONE ? (ss->staticEval > (ss-4)->staticEval
               || (ss-4)->staticEval == VALUE_NONE) : ss->staticEval > (ss-2)->staticEval;
@@ -829,7 +1116,10 @@ namespace {
         &&  depth < 8
         &&  eval - futility_margin(depth, improving) >= beta
         &&  eval < VALUE_KNOWN_WIN) // Do not return unproven wins
+    {
+        STAT_INC(FUTILITY_CUTOFF);
         return eval;
+    }
 
     // Step 9. Null move search with verification search (~40 Elo)
     if (   !PvNode
@@ -851,13 +1141,16 @@ namespace {
         ss->continuationHistory = &thisThread->continuationHistory[0][0][NO_PIECE][0];
 
         pos.do_null_move(st);
+        STAT_INC(NULL_MOVE);
 
-        Value nullValue = -search<NonPV>(pos, ss+1, -beta, -beta+1, depth-R, !cutNode);
+        Value nullValue = -search<NonPV, EM>(pos, ss+1, -beta, -beta+1, depth-R, !cutNode);
 
         pos.undo_null_move();
 
         if (nullValue >= beta)
         {
+            STAT_INC(NULL_MOVE_CUTOFF);
+
             // Do not return unproven mate or TB scores
             if (nullValue >= VALUE_TB_WIN_IN_MAX_PLY)
                 nullValue = beta;
@@ -872,7 +1165,7 @@ namespace {
             thisThread->nmpMinPly = ss->ply + 3 * (depth-R) / 4;
             thisThread->nmpColor = us;
 
-            Value v = search<NonPV>(pos, ss, beta-1, beta, depth-R, false);
+            Value v = search<NonPV, EM>(pos, ss, beta-1, beta, depth-R, false);
 
             thisThread->nmpMinPly = 0;
 
@@ -890,12 +1183,12 @@ namespace {
         &&  depth > 4
         &&  abs(beta) < VALUE_TB_WIN_IN_MAX_PLY
         && !(   ttHit
-             && tte->depth() >= depth - 3
+             && ttData.depth >= depth - 3
              && ttValue != VALUE_NONE
              && ttValue < probcutBeta))
     {
         if (   ttHit
-            && tte->depth() >= depth - 3
+            && ttData.depth >= depth - 3
             && ttValue != VALUE_NONE
             && ttValue >= probcutBeta
             && ttMove
@@ -925,22 +1218,24 @@ namespace {
                 pos.do_move(move, st);
 
                 // Perform a preliminary qsearch to verify that the move holds
-                value = -qsearch<NonPV>(pos, ss+1, -probcutBeta, -probcutBeta+1);
+                value = -qsearch<NonPV, EM>(pos, ss+1, -probcutBeta, -probcutBeta+1);
 
                 // If the qsearch held, perform the regular search
                 if (value >= probcutBeta)
-                    value = -search<NonPV>(pos, ss+1, -probcutBeta, -probcutBeta+1, depth - 4, !cutNode);
+                    value = -search<NonPV, EM>(pos, ss+1, -probcutBeta, -probcutBeta+1, depth - 4, !cutNode);
 
                 pos.undo_move(move);
 
                 if (value >= probcutBeta)
                 {
+                    STAT_INC(PROBCUT_CUTOFF);
+
                     if ( !(ttHit
-                       && tte->depth() >= depth - 3
+                       && ttData.depth >= depth - 3
                        && ttValue != VALUE_NONE))
                         tte->save(posKey, value_to_tt(value, ss->ply), ttPv,
                             BOUND_LOWER,
-                            depth - 3, move, ss->staticEval);
+                            depth - 3, move, ss->staticEval, engine.tt.generation());
                     return value;
                 }
             }
@@ -949,11 +1244,11 @@ namespace {
     // Step 11. Internal iterative deepening (~1 Elo)
     if (depth >= 7 && !ttMove)
     {
-        search<NT>(pos, ss, alpha, beta, depth - 7, cutNode);
+        search<NT, EM>(pos, ss, alpha, beta, depth - 7, cutNode);
 
-        tte = TT.probe(posKey, ttHit);
-        ttValue = ttHit ? value_from_tt(tte->value(), ss->ply, pos.rule50_count()) : VALUE_NONE;
-        ttMove = ttHit ? tte->move() : MOVE_NONE;
+        tte = engine.tt.probe(posKey, ttHit, ttData);
+        ttValue = ttHit ? value_from_tt(ttData.value, ss->ply, pos.rule50_count()) : VALUE_NONE;
+        ttMove = ttHit ? ttData.move : MOVE_NONE;
     }
 
 moves_loop: // When in check, search starts from here
@@ -981,7 +1276,16 @@ moves_loop: // When in check, search starts from here
 
     // Step 12. Loop through all pseudo-legal moves until no moves remain
     // or a beta cutoff occurs.
-    while ((move = mp.next_move(moveCountPruning)) != MOVE_NONE)
+    // In ABDADA mode, coordinate with the other threads at the nodes marked by
+    // breadcrumbs: a move whose subtree is being searched by another thread is
+    // deferred and searched after the other moves, when the TT is likely to
+    // hold its result. Deferred moves are never deferred again.
+    const bool abdada = engine.config.abdada && !rootNode && depth >= 4 && engine.threads.size() > 1;
+    Move deferredMoves[MaxDeferredMoves];
+    int deferredCount = 0, deferredIdx = 0;
+
+    while (   (move = mp.next_move(moveCountPruning)) != MOVE_NONE
+           || (deferredIdx < deferredCount && (move = deferredMoves[deferredIdx++]) != MOVE_NONE))
     {
       assert(is_ok(move));
 
@@ -996,9 +1300,23 @@ moves_loop: // When in check, search starts from here
                                   thisThread->rootMoves.begin() + thisThread->pvLast, move))
           continue;
 
+      if (   abdada
+          && !deferredIdx
+          && moveCount
+          && move != ttMove
+          && deferredCount < MaxDeferredMoves
+          && busy_elsewhere(thisThread, pos.key_after(move), ss->ply + 1))
+      {
+          deferredMoves[deferredCount++] = move;
+          continue;
+      }
+
       ss->moveCount = ++moveCount;
 
-      if (rootNode && thisThread == Threads.main() && Time.elapsed() > 3000)
+      if (   rootNode
+          && thisThread == engine.threads.main()
+          && !engine.silent
+          && engine.time.elapsed() > 3000)
           sync_cout << "info depth " << depth
                     << " currmove " << UCI::move(move, pos.is_chess960())
                     << " currmovenumber " << moveCount + thisThread->pvIdx << sync_endl;
@@ -1018,11 +1336,13 @@ moves_loop: // When in check, search starts from here
           && pos.non_pawn_material(us)
           && bestValue > VALUE_TB_LOSS_IN_MAX_PLY)
       {
+          STAT_INC(SHALLOW_TRIED); // The ones not SHALLOW_SURVIVED are pruned
+
           // Skip quiet moves if movecount exceeds our FutilityMoveCount threshold
           moveCountPruning = moveCount >= futility_move_count(improving, depth);
 
           // Reduced depth of the next LMR search
-          int lmrDepth = std::max(newDepth - reduction(improving, depth, moveCount), 0);
+          int lmrDepth = std::max(newDepth - reduction(engine.reductions, improving, depth, moveCount), 0);
 
           if (   !captureOrPromotion
               && !givesCheck)
@@ -1069,6 +1389,8 @@ moves_loop: // When in check, search starts from here
               if (!pos.see_ge(move, Value(-202) * depth)) // (~25 Elo)
                   continue;
           }
+
+          STAT_INC(SHALLOW_SURVIVED);
       }
 
       // Step 14. Extensions (~75 Elo)
@@ -1084,14 +1406,14 @@ moves_loop: // When in check, search starts from here
           && !excludedMove // Avoid recursive singular search
        /* &&  ttValue != VALUE_NONE Already implicit in the next condition */
           &&  abs(ttValue) < VALUE_KNOWN_WIN
-          && (tte->bound() & BOUND_LOWER)
-          &&  tte->depth() >= depth - 3
+          && (ttData.bound & BOUND_LOWER)
+          &&  ttData.depth >= depth - 3
           &&  pos.legal(move))
       {
           Value singularBeta = ttValue - ((formerPv + 4) * depth) / 2;
           Depth singularDepth = (depth - 1 + 3 * formerPv) / 2;
           ss->excludedMove = move;
-          value = search<NonPV>(pos, ss, singularBeta - 1, singularBeta, singularDepth, cutNode);
+          value = search<NonPV, EM>(pos, ss, singularBeta - 1, singularBeta, singularDepth, cutNode);
           ss->excludedMove = MOVE_NONE;
 
           if (value < singularBeta)
@@ -1113,7 +1435,7 @@ moves_loop: // When in check, search starts from here
           else if (ttValue >= beta)
           {
               ss->excludedMove = move;
-              value = search<NonPV>(pos, ss, beta - 1, beta, (depth + 3) / 2, cutNode);
+              value = search<NonPV, EM>(pos, ss, beta - 1, beta, (depth + 3) / 2, cutNode);
               ss->excludedMove = MOVE_NONE;
 
               if (value >= beta)
@@ -1145,7 +1467,7 @@ moves_loop: // When in check, search starts from here
       newDepth += extension;
 
       // Speculative prefetch as early as possible
-      prefetch(TT.first_entry(pos.key_after(move)));
+      prefetch(engine.tt.first_entry(pos.key_after(move)));
 
       // Check for legality just before making the move
       if (!rootNode && !pos.legal(move))
@@ -1175,7 +1497,7 @@ moves_loop: // When in check, search starts from here
               || cutNode
               || thisThread->ttHitAverage < 415 * TtHitAverageResolution * TtHitAverageWindow / 1024))
       {
-          Depth r = reduction(improving, depth, moveCount);
+          Depth r = reduction(engine.reductions, improving, depth, moveCount);
 
           // Decrease reduction at non-check cut nodes for second move at low depths
           if (   cutNode
@@ -1254,10 +1576,16 @@ moves_loop: // When in check, search starts from here
 
           Depth d = Utility::clamp(newDepth - r, 1, newDepth);
 
-          value = -search<NonPV>(pos, ss+1, -(alpha+1), -alpha, d, true);
+          STAT_INC(LMR_SEARCH);
+          STAT_HIST(reduction, std::max(newDepth - d, 0));
+
+          value = -search<NonPV, EM>(pos, ss+1, -(alpha+1), -alpha, d, true);
 
           doFullDepthSearch = value > alpha && d != newDepth;
 
+          if (doFullDepthSearch)
+              STAT_INC(LMR_RESEARCH);
+
           didLMR = true;
       }
       else
@@ -1270,7 +1598,7 @@ moves_loop: // When in check, search starts from here
       // Step 17. Full depth search when LMR is skipped or fails high
       if (doFullDepthSearch)
       {
-          value = -search<NonPV>(pos, ss+1, -(alpha+1), -alpha, newDepth, !cutNode);
+          value = -search<NonPV, EM>(pos, ss+1, -(alpha+1), -alpha, newDepth, !cutNode);
 
           if (didLMR && !captureOrPromotion)
           {
@@ -1292,7 +1620,7 @@ moves_loop: // When in check, search starts from here
           (ss+1)->pv = pv;
           (ss+1)->pv[0] = MOVE_NONE;
 
-          value = -search<PV>(pos, ss+1, -beta, -alpha, newDepth, false);
+          value = -search<PV, EM>(pos, ss+1, -beta, -alpha, newDepth, false);
       }
 
       // Step 18. Undo move
@@ -1304,7 +1632,7 @@ moves_loop: // When in check, search starts from here
       // Finished searching the move. If a stop occurred, the return value of
       // the search cannot be trusted, and we return immediately without
       // updating best move, PV and TT.
-      if (Threads.stop.load(std::memory_order_relaxed))
+      if (engine.threads.stop.load(std::memory_order_relaxed))
           return VALUE_ZERO;
 
       if (rootNode)
@@ -1328,7 +1656,7 @@ moves_loop: // When in check, search starts from here
               // iteration. This information is used for time management: when
               // the best move changes frequently, we allocate some more time.
               if (moveCount > 1)
-                  ++thisThread->bestMoveChanges;
+                  relaxed_increment(thisThread->bestMoveChanges);
           }
           else
               // All other moves but the PV are set to the lowest value: this
@@ -1373,7 +1701,7 @@ moves_loop: // When in check, search starts from here
     // completed. But in this case bestValue is valid because we have fully
     // searched our subtree, and we can anyhow save the result in TT.
     /*
-       if (Threads.stop)
+       if (engine.threads.stop)
         return VALUE_DRAW;
     */
 
@@ -1401,10 +1729,19 @@ moves_loop: // When in check, search starts from here
         bestValue = std::min(bestValue, maxValue);
 
     if (!excludedMove && !(rootNode && thisThread->pvIdx))
-        tte->save(posKey, value_to_tt(bestValue, ss->ply), ttPv,
-                  bestValue >= beta ? BOUND_LOWER :
-                  PvNode && bestMove ? BOUND_EXACT : BOUND_UPPER,
-                  depth, bestMove, ss->staticEval);
+    {
+        Bound b =  bestValue >= beta ? BOUND_LOWER
+                 : PvNode && bestMove ? BOUND_EXACT : BOUND_UPPER;
+
+        tte->save(posKey, value_to_tt(bestValue, ss->ply), ttPv, b,
+                  depth, bestMove, ss->staticEval, engine.tt.generation());
+
+#ifdef USE_CLUSTER
+        if (depth >= Cluster::ShareDepth && !engine.silent)
+            Cluster::share(posKey, value_to_tt(bestValue, ss->ply), ttPv, b,
+                           depth, bestMove, ss->staticEval);
+#endif
+    }
 
     assert(bestValue > -VALUE_INFINITE && bestValue < VALUE_INFINITE);
 
@@ -1414,7 +1751,7 @@ moves_loop: // When in check, search starts from here
 
   // qsearch() is the quiescence search function, which is called by the main search
   // function with zero depth, or recursively with further decreasing depth per call.
-  template <NodeType NT>
+  template <NodeType NT, Eval::EvalMode EM>
   Value qsearch(Position& pos, Stack* ss, Value alpha, Value beta, Depth depth) {
 
     constexpr bool PvNode = NT == PV;
@@ -1426,6 +1763,7 @@ moves_loop: // When in check, search starts from here
     Move pv[MAX_PLY+1];
     StateInfo st;
     TTEntry* tte;
+    TTData ttData;
     Key posKey;
     Move ttMove, move, bestMove;
     Depth ttDepth;
@@ -1441,15 +1779,17 @@ moves_loop: // When in check, search starts from here
     }
 
     Thread* thisThread = pos.this_thread();
+    Engine& engine = thisThread->engine;
     (ss+1)->ply = ss->ply + 1;
     bestMove = MOVE_NONE;
     ss->inCheck = pos.checkers();
     moveCount = 0;
+    STAT_HIST(qsearchDepth, -depth);
 
     // Check for an immediate draw or maximum ply reached
     if (   pos.is_draw(ss->ply)
         || ss->ply >= MAX_PLY)
-        return (ss->ply >= MAX_PLY && !ss->inCheck) ? evaluate(pos) : VALUE_DRAW;
+        return (ss->ply >= MAX_PLY && !ss->inCheck) ? Eval::evaluate<EM>(pos) : VALUE_DRAW;
 
     assert(0 <= ss->ply && ss->ply < MAX_PLY);
 
@@ -1460,18 +1800,26 @@ moves_loop: // When in check, search starts from here
                                                   : DEPTH_QS_NO_CHECKS;
     // Transposition table lookup
     posKey = pos.key();
-    tte = TT.probe(posKey, ttHit);
-    ttValue = ttHit ? value_from_tt(tte->value(), ss->ply, pos.rule50_count()) : VALUE_NONE;
-    ttMove = ttHit ? tte->move() : MOVE_NONE;
-    pvHit = ttHit && tte->is_pv();
+    tte = engine.tt.probe(posKey, ttHit, ttData);
+    ttValue = ttHit ? value_from_tt(ttData.value, ss->ply, pos.rule50_count()) : VALUE_NONE;
+    ttMove = ttHit ? ttData.move : MOVE_NONE;
+    pvHit = ttHit && ttData.isPv;
+
+#ifdef TT_STATS
+    if (ttHit && ttData.move && !pos.pseudo_legal(ttData.move))
+        ++thisThread->ttStats.collisions;
+#endif
 
     if (  !PvNode
         && ttHit
-        && tte->depth() >= ttDepth
+        && ttData.depth >= ttDepth
         && ttValue != VALUE_NONE // Only in case of TT access race
-        && (ttValue >= beta ? (tte->bound() & BOUND_LOWER)
-                            : (tte->bound() & BOUND_UPPER)))
+        && (ttValue >= beta ? (ttData.bound & BOUND_LOWER)
+                            : (ttData.bound & BOUND_UPPER)))
+    {
+        STAT_INC(QS_TT_CUTOFF);
         return ttValue;
+    }
 
     // Evaluate the position statically
     if (ss->inCheck)
@@ -1484,17 +1832,17 @@ moves_loop: // When in check, search starts from here
         if (ttHit)
         {
             // Never assume anything about values stored in TT
-            if ((ss->staticEval = bestValue = tte->eval()) == VALUE_NONE)
-                ss->staticEval = bestValue = evaluate(pos);
+            if ((ss->staticEval = bestValue = ttData.eval) == VALUE_NONE)
+                ss->staticEval = bestValue = Eval::evaluate<EM>(pos);
 
             // Can ttValue be used as a better position evaluation?
             if (    ttValue != VALUE_NONE
-                && (tte->bound() & (ttValue > bestValue ? BOUND_LOWER : BOUND_UPPER)))
+                && (ttData.bound & (ttValue > bestValue ? BOUND_LOWER : BOUND_UPPER)))
                 bestValue = ttValue;
         }
         else
             ss->staticEval = bestValue =
-            (ss-1)->currentMove != MOVE_NULL ? evaluate(pos)
+            (ss-1)->currentMove != MOVE_NULL ? Eval::evaluate<EM>(pos)
                                              : -(ss-1)->staticEval + 2 * Tempo;
 
         // Stand pat. Return immediately if static value is at least beta
@@ -1502,8 +1850,9 @@ moves_loop: // When in check, search starts from here
         {
             if (!ttHit)
                 tte->save(posKey, value_to_tt(bestValue, ss->ply), false, BOUND_LOWER,
-                          DEPTH_NONE, MOVE_NONE, ss->staticEval);
+                          DEPTH_NONE, MOVE_NONE, ss->staticEval, engine.tt.generation());
 
+            STAT_INC(QS_STAND_PAT);
             return bestValue;
         }
 
@@ -1564,7 +1913,7 @@ moves_loop: // When in check, search starts from here
           continue;
 
       // Speculative prefetch as early as possible
-      prefetch(TT.first_entry(pos.key_after(move)));
+      prefetch(engine.tt.first_entry(pos.key_after(move)));
 
       // Check for legality just before making the move
       if (!pos.legal(move))
@@ -1581,7 +1930,7 @@ moves_loop: // When in check, search starts from here
 
       // Make and search the move
       pos.do_move(move, st, givesCheck);
-      value = -qsearch<NT>(pos, ss+1, -beta, -alpha, depth - 1);
+      value = -qsearch<NT, EM>(pos, ss+1, -beta, -alpha, depth - 1);
       pos.undo_move(move);
 
       assert(value > -VALUE_INFINITE && value < VALUE_INFINITE);
@@ -1614,7 +1963,7 @@ moves_loop: // When in check, search starts from here
     tte->save(posKey, value_to_tt(bestValue, ss->ply), pvHit,
               bestValue >= beta ? BOUND_LOWER :
               PvNode && bestValue > oldAlpha  ? BOUND_EXACT : BOUND_UPPER,
-              ttDepth, bestMove, ss->staticEval);
+              ttDepth, bestMove, ss->staticEval, engine.tt.generation());
 
     assert(bestValue > -VALUE_INFINITE && bestValue < VALUE_INFINITE);
 
@@ -1767,10 +2116,11 @@ moves_loop: // When in check, search starts from here
   // When playing with strength handicap, choose best move among a set of RootMoves
   // using a statistical rule dependent on 'level'. Idea by Heinz van Saanen.
 
-  Move Skill::pick_best(size_t multiPV) {
+  Move Skill::pick_best(const RootMoves& rootMoves, size_t multiPV) {
 
-    const RootMoves& rootMoves = Threads.main()->rootMoves;
-    static PRNG rng(now()); // PRNG sequence should be non-deterministic
+    // PRNG sequence should be non-deterministic, one per thread as the engines
+    // of 'analyze' may pick their moves at the same time
+    static thread_local PRNG rng(now());
 
     // RootMoves are already sorted by score in descending order
     Value topScore = rootMoves[0].score;
@@ -1809,27 +2159,81 @@ void MainThread::check_time() {
       return;
 
   // When using nodes, ensure checking rate is not lower than 0.1% of nodes
-  callsCnt = Limits.nodes ? std::min(1024, int(Limits.nodes / 1024)) : 1024;
+  callsCnt = engine.limits.nodes ? std::min(1024, int(engine.limits.nodes / 1024)) : 1024;
 
-  static TimePoint lastInfoTime = now();
+#ifdef USE_CLUSTER
+  if (!engine.silent)
+      Cluster::apply(engine.tt);
+#endif
 
-  TimePoint elapsed = Time.elapsed();
-  TimePoint tick = Limits.startTime + elapsed;
-
-  if (tick - lastInfoTime >= 1000)
-  {
-      lastInfoTime = tick;
-      dbg_print();
-  }
+  TimePoint elapsed = engine.time.elapsed();
 
   // We should not stop pondering until told so by the GUI
   if (ponder)
       return;
 
-  if (   (Limits.use_time_management() && (elapsed > Time.maximum() - 10 || stopOnPonderhit))
-      || (Limits.movetime && elapsed >= Limits.movetime)
-      || (Limits.nodes && Threads.nodes_searched() >= (uint64_t)Limits.nodes))
-      Threads.stop = true;
+  if (   (engine.limits.use_time_management() && (elapsed > engine.time.maximum() - 10 || stopOnPonderhit))
+      || (engine.limits.movetime && elapsed >= engine.limits.movetime)
+      || (engine.limits.nodes && engine.threads.nodes_searched() >= (uint64_t)engine.limits.nodes))
+      engine.threads.stop = true;
+}
+
+
+/// MainThread::timer_loop() runs in a thread of its own, started by the first
+/// search with the "Timer Thread" option set. It waits on timerCv until a
+/// search arms it, then sleeps until the deadline that check_time() would test
+/// and raises the stop flag there, so that the search only reads the flag.
+/// While pondering it polls every millisecond for a ponderhit, after which the
+/// same deadline applies. Once the search is stopped, or MainThread::search()
+/// asks for it with timerDisarm, it disarms and waits for the next search,
+/// until the main thread is destroyed.
+
+void MainThread::timer_loop() {
+
+  std::unique_lock<std::mutex> lk(timerMutex);
+
+  while (true)
+  {
+      timerCv.wait(lk, [&]{ return timerArmed || timerExit; });
+
+      if (timerExit)
+          return;
+
+      TimePoint deadline = std::numeric_limits<TimePoint>::max();
+
+      if (engine.limits.use_time_management())
+          deadline = engine.time.maximum() - 9;
+
+      if (engine.limits.movetime)
+          deadline = std::min(deadline, engine.limits.movetime);
+
+      while (!engine.threads.stop && !timerDisarm)
+      {
+#ifdef USE_CLUSTER
+          if (!engine.silent)
+              Cluster::apply(engine.tt);
+#endif
+
+          TimePoint elapsed = engine.time.elapsed();
+
+          // We should not stop pondering until told so by the GUI
+          if (!ponder)
+          {
+              if (   elapsed >= deadline
+                  || (engine.limits.use_time_management() && stopOnPonderhit))
+              {
+                  engine.threads.stop = true;
+                  break;
+              }
+          }
+
+          TimePoint wait = ponder ? 1 : std::min(deadline - elapsed, TimePoint(1000));
+          timerCv.wait_for(lk, std::chrono::milliseconds(std::max(wait, TimePoint(1))));
+      }
+
+      timerArmed = false;
+      timerCv.notify_all(); // Wake up MainThread::search(), waiting for the disarm
+  }
 }
 
 
@@ -1838,13 +2242,22 @@ void MainThread::check_time() {
 
 string UCI::pv(const Position& pos, Depth depth, Value alpha, Value beta) {
 
+  return pv(pos, pos.this_thread()->rootMoves, pos.this_thread()->pvIdx, depth, alpha, beta);
+}
+
+
+/// This overload formats the given lines, line pvIdx being bounded by alpha
+/// and beta. MultiPV split mode uses it for the lines merged from the groups.
+
+string UCI::pv(const Position& pos, const RootMoves& rootMoves,
+               size_t pvIdx, Depth depth, Value alpha, Value beta) {
+
   std::stringstream ss;
-  TimePoint elapsed = Time.elapsed() + 1;
-  const RootMoves& rootMoves = pos.this_thread()->rootMoves;
-  size_t pvIdx = pos.this_thread()->pvIdx;
-  size_t multiPV = std::min((size_t)Options["MultiPV"], rootMoves.size());
-  uint64_t nodesSearched = Threads.nodes_searched();
-  uint64_t tbHits = Threads.tb_hits() + (TB::RootInTB ? rootMoves.size() : 0);
+  const Engine& engine = pos.this_thread()->engine;
+  TimePoint elapsed = engine.time.elapsed() + 1;
+  size_t multiPV = std::min(size_t(engine.config.multiPV), rootMoves.size());
+  uint64_t nodesSearched = engine.threads.nodes_searched();
+  uint64_t tbHits = engine.threads.tb_hits() + (engine.tb.rootInTB ? rootMoves.size() : 0);
 
   for (size_t i = 0; i < multiPV; ++i)
   {
@@ -1856,7 +2269,7 @@ string UCI::pv(const Position& pos, Depth depth, Value alpha, Value beta) {
       Depth d = updated ? depth : depth - 1;
       Value v = updated ? rootMoves[i].score : rootMoves[i].previousScore;
 
-      bool tb = TB::RootInTB && abs(v) < VALUE_MATE_IN_MAX_PLY;
+      bool tb = engine.tb.rootInTB && abs(v) < VALUE_MATE_IN_MAX_PLY;
       v = tb ? rootMoves[i].tbScore : v;
 
       if (ss.rdbuf()->in_avail()) // Not at first line
@@ -1868,7 +2281,7 @@ string UCI::pv(const Position& pos, Depth depth, Value alpha, Value beta) {
          << " multipv "  << i + 1
          << " score "    << UCI::value(v);
 
-      if (Options["UCI_ShowWDL"])
+      if (engine.config.showWDL)
           ss << UCI::wdl(v, pos.game_ply());
 
       if (!tb && i == pvIdx)
@@ -1878,7 +2291,7 @@ string UCI::pv(const Position& pos, Depth depth, Value alpha, Value beta) {
          << " nps "      << nodesSearched * 1000 / elapsed;
 
       if (elapsed > 1000) // Earlier makes little sense
-          ss << " hashfull " << TT.hashfull();
+          ss << " hashfull " << engine.tt.hashfull();
 
       ss << " tbhits "   << tbHits
          << " time "     << elapsed
@@ -1908,49 +2321,42 @@ bool RootMove::extract_ponder_from_tt(Position& pos) {
         return false;
 
     pos.do_move(pv[0], st);
-    TTEntry* tte = TT.probe(pos.key(), ttHit);
+    TTData ttData;
+    pos.this_thread()->engine.tt.probe(pos.key(), ttHit, ttData);
 
-    if (ttHit)
-    {
-        Move m = tte->move(); // Local copy to be SMP safe
-        if (MoveList<LEGAL>(pos).contains(m))
-            pv.push_back(m);
-    }
+    if (ttHit && MoveList<LEGAL>(pos).contains(ttData.move))
+        pv.push_back(ttData.move);
 
     pos.undo_move(pv[0]);
     return pv.size() > 1;
 }
 
-void Tablebases::rank_root_moves(Position& pos, Search::RootMoves& rootMoves) {
+void Tablebases::rank_root_moves(Position& pos, Search::RootMoves& rootMoves, Probing& tb) {
 
-    RootInTB = false;
-    UseRule50 = bool(Options["Syzygy50MoveRule"]);
-    ProbeDepth = int(Options["SyzygyProbeDepth"]);
-    Cardinality = int(Options["SyzygyProbeLimit"]);
     bool dtz_available = true;
 
     // Tables with fewer pieces than SyzygyProbeLimit are searched with
     // ProbeDepth == DEPTH_ZERO
-    if (Cardinality > MaxCardinality)
+    if (tb.cardinality > MaxCardinality)
     {
-        Cardinality = MaxCardinality;
-        ProbeDepth = 0;
+        tb.cardinality = MaxCardinality;
+        tb.probeDepth = 0;
     }
 
-    if (Cardinality >= popcount(pos.pieces()) && !pos.can_castle(ANY_CASTLING))
+    if (tb.cardinality >= popcount(pos.pieces()) && !pos.can_castle(ANY_CASTLING))
     {
         // Rank moves using DTZ tables
-        RootInTB = root_probe(pos, rootMoves);
+        tb.rootInTB = root_probe(pos, rootMoves, tb.useRule50);
 
-        if (!RootInTB)
+        if (!tb.rootInTB)
         {
             // DTZ tables are missing; try to rank moves using WDL tables
             dtz_available = false;
-            RootInTB = root_probe_wdl(pos, rootMoves);
+            tb.rootInTB = root_probe_wdl(pos, rootMoves, tb.useRule50);
         }
     }
 
-    if (RootInTB)
+    if (tb.rootInTB)
     {
         // Sort moves according to TB rank
         std::sort(rootMoves.begin(), rootMoves.end(),
@@ -1958,7 +2364,7 @@ void Tablebases::rank_root_moves(Position& pos, Search::RootMoves& rootMoves) {
 
         // Probe during search only if DTZ is not available and we are winning
         if (dtz_available || rootMoves[0].tbScore <= VALUE_DRAW)
-            Cardinality = 0;
+            tb.cardinality = 0;
     }
     else
     {
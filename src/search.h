@@ -21,6 +21,7 @@
 #ifndef SEARCH_H_INCLUDED
 #define SEARCH_H_INCLUDED
 
+#include <atomic>
 #include <vector>
 
 #include "misc.h"
@@ -28,6 +29,7 @@
 #include "types.h"
 
 class Position;
+struct Engine;
 
 namespace Search {
 
@@ -79,6 +81,24 @@ struct RootMove {
 typedef std::vector<RootMove> RootMoves;
 
 
+/// PerftTable is the perft hash of an Engine. It is allocated for the duration
+/// of a 'go perft' and comes on top of the TT, so it takes at most a quarter of
+/// the TT size, and MaxMB. The key is stored XORed with the count, so that an
+/// entry torn by two threads writing at once reads as a miss instead of a count.
+
+struct PerftTable {
+
+  static constexpr size_t MaxMB = 256;
+
+  struct Entry {
+    std::atomic<uint64_t> check, count;
+  };
+
+  Entry* entries = nullptr;
+  size_t mask = 0;
+};
+
+
 /// LimitsType struct stores information sent by GUI about available time to
 /// search the current move, maximum depth/time, or if we are in analysis mode.
 
@@ -100,10 +120,40 @@ struct LimitsType {
   int64_t nodes;
 };
 
-extern LimitsType Limits;
+#ifdef SEARCH_STATS
+
+/// Stats holds the hot path counters of one thread, compiled in with
+/// searchstats=yes (SEARCH_STATS) and summed over the pool by the 'stats'
+/// command. Each thread writes only its own, with plain increments, and they
+/// start a cache line of their own in Thread.
+
+struct Stats {
+
+  enum Counter {
+    TT_CUTOFF, RAZORING, FUTILITY_CUTOFF, NULL_MOVE, NULL_MOVE_CUTOFF, PROBCUT_CUTOFF,
+    SHALLOW_TRIED, SHALLOW_SURVIVED, LMR_SEARCH, LMR_RESEARCH,
+    QS_TT_CUTOFF, QS_STAND_PAT, EVAL_CALL, COUNTER_NB
+  };
+
+  static constexpr int HistSize = 16; // The last bucket counts the larger values
+
+  void add(const Stats& s) {
+    for (int i = 0; i < COUNTER_NB; ++i)
+        counters[i] += s.counters[i];
+    for (int i = 0; i < HistSize; ++i)
+        reduction[i] += s.reduction[i], qsearchDepth[i] += s.qsearchDepth[i];
+  }
+
+  uint64_t counters[COUNTER_NB];
+  uint64_t reduction[HistSize];    // LMR reductions, in plies
+  uint64_t qsearchDepth[HistSize]; // Plies below the horizon of the qsearch nodes
+};
+
+#endif
 
-void init();
-void clear();
+void init(Engine& engine);
+void clear(Engine& engine);
+std::string stats(const Engine& engine);
 
 } // namespace Search
 
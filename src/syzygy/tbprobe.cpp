@@ -26,8 +26,10 @@
 #include <iostream>
 #include <list>
 #include <sstream>
+#include <thread>
 #include <type_traits>
 #include <mutex>
+#include <vector>
 
 #include "../bitboard.h"
 #include "../movegen.h"
@@ -283,6 +285,32 @@ public:
         return data + 4; // Skip Magics's header
     }
 
+    // Fault in all the pages of a mapped file, and optionally lock them in
+    // memory, so that the probes never wait for the storage. Return the size
+    // in bytes of the mapping, and set 'locked' on success of the locking.
+    static size_t prefault(void* baseAddress, uint64_t mapping, bool lock, bool& locked) {
+
+#ifndef _WIN32
+        size_t size = mapping;
+        madvise(baseAddress, size, MADV_WILLNEED); // Start the read-ahead
+#else
+        MEMORY_BASIC_INFORMATION mbi;
+        VirtualQuery(baseAddress, &mbi, sizeof(mbi));
+        size_t size = mbi.RegionSize;
+#endif
+        const volatile uint8_t* data = (const volatile uint8_t*)baseAddress;
+
+        for (size_t i = 0; i < size; i += 4096)
+            (void)data[i];
+
+#ifndef _WIN32
+        locked = lock && !mlock(baseAddress, size);
+#else
+        locked = lock && VirtualLock(baseAddress, size);
+#endif
+        return size;
+    }
+
     static void unmap(void* baseAddress, uint64_t mapping) {
 
 #ifndef _WIN32
@@ -422,6 +450,7 @@ class TBTables {
 
     std::deque<TBTable<WDL>> wdlTable;
     std::deque<TBTable<DTZ>> dtzTable;
+    std::vector<std::string> codes; // File name of each wdlTable entry, like "KRvK"
 
     void insert(Key key, TBTable<WDL>* wdl, TBTable<DTZ>* dtz) {
         uint32_t homeBucket = (uint32_t)key & (Size - 1);
@@ -461,33 +490,96 @@ public:
         memset(hashTable, 0, sizeof(hashTable));
         wdlTable.clear();
         dtzTable.clear();
+        codes.clear();
     }
     size_t size() const { return wdlTable.size(); }
+    static std::string code(const std::vector<PieceType>& pieces);
+    static bool exists(const std::vector<PieceType>& pieces);
     void add(const std::vector<PieceType>& pieces);
+    void preload(int pieceLimit, bool lock);
 };
 
 TBTables TBTables;
 
-// If the corresponding file exists two new objects TBTable<WDL> and TBTable<DTZ>
-// are created and added to the lists and hash table. Called at init time.
-void TBTables::add(const std::vector<PieceType>& pieces) {
+// class ResultCache remembers the results of probe_wdl() and probe_dtz(), so
+// that the positions the search probes again and again are not decompressed
+// from the tables at every probe. Each entry is a single atomic word, read and
+// written without locks by all the threads: a racing write just replaces the
+// entry. Entries are verified with the upper 32 bits of the position key.
+class ResultCache {
+
+    static constexpr size_t Size = 1 << 17; // 1 MB, indexed by key's 17 lsb
+
+    std::atomic<uint64_t> table[Size];
+
+    template<TBType Type>
+    static Key salted(Key key) { return Type == WDL ? key : key ^ 0x9E3779B97F4A7C15ULL; }
+
+public:
+    template<TBType Type>
+    bool probe(Key key, int& value, ProbeState* result) const {
+
+        key = salted<Type>(key);
+        uint64_t e = table[key & (Size - 1)].load(std::memory_order_relaxed);
+
+        if ((e >> 56) == 0 || uint32_t(e) != uint32_t(key >> 32))
+            return false;
+
+        value = int16_t(e >> 32);
+        *result = ProbeState(int((e >> 56) & 0xFF) - 2);
+        return true;
+    }
+
+    template<TBType Type>
+    void save(Key key, int value, ProbeState result) {
+
+        if (result == FAIL)
+            return;
+
+        key = salted<Type>(key);
+        table[key & (Size - 1)].store(  uint64_t(uint32_t(key >> 32))
+                                      | uint64_t(uint16_t(value)) << 32
+                                      | uint64_t(result + 2) << 56, std::memory_order_relaxed);
+    }
+
+    void clear() {
+        for (auto& e : table)
+            e.store(0, std::memory_order_relaxed);
+    }
+};
+
+ResultCache ResultCache;
+
+// Return the file name of the table with the given pieces, like KRK -> KRvK
+std::string TBTables::code(const std::vector<PieceType>& pieces) {
 
     std::string code;
 
     for (PieceType pt : pieces)
         code += PieceToChar[pt];
 
-    TBFile file(code.insert(code.find('K', 1), "v") + ".rtbw"); // KRK -> KRvK
+    return code.insert(code.find('K', 1), "v");
+}
 
-    if (!file.is_open()) // Only WDL file is checked
-        return;
+// Check whether the WDL file of the given table exists, the DTZ one is not
+// checked. Called at init time, concurrently.
+bool TBTables::exists(const std::vector<PieceType>& pieces) {
 
-    file.close();
+    return TBFile(code(pieces) + ".rtbw").is_open();
+}
+
+// Two new objects TBTable<WDL> and TBTable<DTZ> are created for an existing
+// file and added to the lists and hash table. Their files are only mapped at
+// first probe. Called at init time.
+void TBTables::add(const std::vector<PieceType>& pieces) {
+
+    std::string code = TBTables::code(pieces);
 
     MaxCardinality = std::max((int)pieces.size(), MaxCardinality);
 
     wdlTable.emplace_back(code);
     dtzTable.emplace_back(wdlTable.back());
+    codes.push_back(code);
 
     // Insert into the hash keys for both colors: KRvK with KR white and black
     insert(wdlTable.back().key , &wdlTable.back(), &dtzTable.back());
@@ -1131,7 +1223,7 @@ void set(T& e, uint8_t* data) {
 // at every probe, memory map and init only at first access. Function is thread
 // safe and can be called concurrently.
 template<TBType Type>
-void* mapped(TBTable<Type>& e, const Position& pos) {
+void* mapped(TBTable<Type>& e, const std::string& code) {
 
     static std::mutex mutex;
 
@@ -1145,23 +1237,68 @@ void* mapped(TBTable<Type>& e, const Position& pos) {
     if (e.ready.load(std::memory_order_relaxed)) // Recheck under lock
         return e.baseAddress;
 
+    std::string fname = code + (Type == WDL ? ".rtbw" : ".rtbz");
+
+    uint8_t* data = TBFile(fname).map(&e.baseAddress, &e.mapping, Type);
+
+    if (data)
+        set(e, data);
+
+    e.ready.store(true, std::memory_order_release);
+    return e.baseAddress;
+}
+
+template<TBType Type>
+void* mapped(TBTable<Type>& e, const Position& pos) {
+
+    if (e.ready.load(std::memory_order_acquire))
+        return e.baseAddress;
+
     // Pieces strings in decreasing order for each color, like ("KPP","KR")
-    std::string fname, w, b;
+    std::string w, b;
     for (PieceType pt = KING; pt >= PAWN; --pt) {
         w += std::string(popcount(pos.pieces(WHITE, pt)), PieceToChar[pt]);
         b += std::string(popcount(pos.pieces(BLACK, pt)), PieceToChar[pt]);
     }
 
-    fname =  (e.key == pos.material_key() ? w + 'v' + b : b + 'v' + w)
-           + (Type == WDL ? ".rtbw" : ".rtbz");
+    return mapped(e, e.key == pos.material_key() ? w + 'v' + b : b + 'v' + w);
+}
 
-    uint8_t* data = TBFile(fname).map(&e.baseAddress, &e.mapping, Type);
+// Map at init time the WDL and DTZ files of the tables with up to pieceLimit
+// pieces, and fault in or lock their pages, so that the first probes of a game
+// do not stall on page faults, typically from network storage.
+void TBTables::preload(int pieceLimit, bool lock) {
 
-    if (data)
-        set(e, data);
+    size_t files = 0, bytes = 0, lockedBytes = 0;
 
-    e.ready.store(true, std::memory_order_release);
-    return e.baseAddress;
+    for (size_t i = 0; i < wdlTable.size(); ++i)
+    {
+        if (wdlTable[i].pieceCount > pieceLimit)
+            continue;
+
+        for (void* base : { mapped(wdlTable[i], codes[i]), mapped(dtzTable[i], codes[i]) })
+        {
+            if (!base)
+                continue;
+
+            const uint64_t mapping = base == wdlTable[i].baseAddress ? wdlTable[i].mapping
+                                                                    : dtzTable[i].mapping;
+            bool locked;
+            size_t size = TBFile::prefault(base, mapping, lock, locked);
+
+            files++;
+            bytes += size;
+            lockedBytes += locked ? size : 0;
+        }
+    }
+
+    sync_cout << "info string Preloaded " << files << " tablebase files, "
+              << (bytes >> 20) << " MB";
+
+    if (lock)
+        std::cout << ", " << (lockedBytes >> 20) << " MB locked in memory";
+
+    std::cout << sync_endl;
 }
 
 template<TBType Type, typename Ret = typename TBTable<Type>::Ret>
@@ -1257,11 +1394,17 @@ WDLScore search(Position& pos, ProbeState* result) {
 
 
 /// Tablebases::init() is called at startup and after every change to
-/// "SyzygyPath" UCI option to (re)create the various tables. It is not thread
-/// safe, nor it needs to be.
+/// "SyzygyPath" UCI option to (re)create the various tables. Setting the same
+/// paths again keeps the tables, with their mapped files and decoding data, so
+/// the new games don't pay again for the scan and the first probes. It is not
+/// thread safe, nor it needs to be.
 void Tablebases::init(const std::string& paths) {
 
+    if (paths == TBFile::Paths)
+        return;
+
     TBTables.clear();
+    ResultCache.clear();
     MaxCardinality = 0;
     TBFile::Paths = paths;
 
@@ -1362,45 +1505,78 @@ void Tablebases::init(const std::string& paths) {
             LeadPawnsSize[leadPawnsCnt][f] = idx;
         }
 
-    // Add entries in TB tables if the corresponding ".rtbw" file exists
+    // List all the possible tables, then add entries in TB tables for the ones
+    // whose ".rtbw" file exists
+    std::vector<std::vector<PieceType>> candidates;
+
     for (PieceType p1 = PAWN; p1 < KING; ++p1) {
-        TBTables.add({KING, p1, KING});
+        candidates.push_back({KING, p1, KING});
 
         for (PieceType p2 = PAWN; p2 <= p1; ++p2) {
-            TBTables.add({KING, p1, p2, KING});
-            TBTables.add({KING, p1, KING, p2});
+            candidates.push_back({KING, p1, p2, KING});
+            candidates.push_back({KING, p1, KING, p2});
 
             for (PieceType p3 = PAWN; p3 < KING; ++p3)
-                TBTables.add({KING, p1, p2, KING, p3});
+                candidates.push_back({KING, p1, p2, KING, p3});
 
             for (PieceType p3 = PAWN; p3 <= p2; ++p3) {
-                TBTables.add({KING, p1, p2, p3, KING});
+                candidates.push_back({KING, p1, p2, p3, KING});
 
                 for (PieceType p4 = PAWN; p4 <= p3; ++p4) {
-                    TBTables.add({KING, p1, p2, p3, p4, KING});
+                    candidates.push_back({KING, p1, p2, p3, p4, KING});
 
                     for (PieceType p5 = PAWN; p5 <= p4; ++p5)
-                        TBTables.add({KING, p1, p2, p3, p4, p5, KING});
+                        candidates.push_back({KING, p1, p2, p3, p4, p5, KING});
 
                     for (PieceType p5 = PAWN; p5 < KING; ++p5)
-                        TBTables.add({KING, p1, p2, p3, p4, KING, p5});
+                        candidates.push_back({KING, p1, p2, p3, p4, KING, p5});
                 }
 
                 for (PieceType p4 = PAWN; p4 < KING; ++p4) {
-                    TBTables.add({KING, p1, p2, p3, KING, p4});
+                    candidates.push_back({KING, p1, p2, p3, KING, p4});
 
                     for (PieceType p5 = PAWN; p5 <= p4; ++p5)
-                        TBTables.add({KING, p1, p2, p3, KING, p4, p5});
+                        candidates.push_back({KING, p1, p2, p3, KING, p4, p5});
                 }
             }
 
             for (PieceType p3 = PAWN; p3 <= p1; ++p3)
                 for (PieceType p4 = PAWN; p4 <= (p1 == p3 ? p2 : p3); ++p4)
-                    TBTables.add({KING, p1, p2, KING, p3, p4});
+                    candidates.push_back({KING, p1, p2, KING, p3, p4});
         }
     }
 
+    // Look for the files in parallel, on network storage the directory scan
+    // dominates the init time. The tables are still added in the list order.
+    std::vector<char> found(candidates.size());
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> scanners;
+
+    for (unsigned i = 0; i < std::max(1U, std::min(std::thread::hardware_concurrency(), 16U)); ++i)
+        scanners.emplace_back([&]() {
+            for (size_t c; (c = next++) < candidates.size(); )
+                found[c] = TBTables::exists(candidates[c]);
+        });
+
+    for (std::thread& th : scanners)
+        th.join();
+
+    for (size_t c = 0; c < candidates.size(); ++c)
+        if (found[c])
+            TBTables.add(candidates[c]);
+
     sync_cout << "info string Found " << TBTables.size() << " tablebases" << sync_endl;
+
+    preload();
+}
+
+
+/// Tablebases::preload() maps and faults in, or locks, the tables selected by
+/// the "SyzygyPreload" and "SyzygyPreloadLimit" UCI options, if any.
+void Tablebases::preload() {
+
+    if (!(Options["SyzygyPreload"] == "off") && TBTables.size())
+        TBTables.preload(int(Options["SyzygyPreloadLimit"]), Options["SyzygyPreload"] == "lock");
 }
 
 // Probe the WDL table for a particular position.
@@ -1413,8 +1589,16 @@ void Tablebases::init(const std::string& paths) {
 //  2 : win
 WDLScore Tablebases::probe_wdl(Position& pos, ProbeState* result) {
 
+    int v;
+
+    if (ResultCache.probe<WDL>(pos.key(), v, result))
+        return WDLScore(v);
+
     *result = OK;
-    return search<false>(pos, result);
+    WDLScore wdl = search<false>(pos, result);
+
+    ResultCache.save<WDL>(pos.key(), wdl, *result);
+    return wdl;
 }
 
 // Probe the DTZ table for a particular position.
@@ -1443,7 +1627,7 @@ WDLScore Tablebases::probe_wdl(Position& pos, ProbeState* result) {
 //
 // In short, if a move is available resulting in dtz + 50-move-counter <= 99,
 // then do not accept moves leading to dtz + 50-move-counter == 100.
-int Tablebases::probe_dtz(Position& pos, ProbeState* result) {
+static int probe_dtz_tables(Position& pos, ProbeState* result) {
 
     *result = OK;
     WDLScore wdl = search<true>(pos, result);
@@ -1505,11 +1689,25 @@ int Tablebases::probe_dtz(Position& pos, ProbeState* result) {
     return minDTZ == 0xFFFF ? -1 : minDTZ;
 }
 
+// Tablebases::probe_dtz() is probe_dtz_tables() behind the result cache
+int Tablebases::probe_dtz(Position& pos, ProbeState* result) {
+
+    int dtz;
+
+    if (ResultCache.probe<DTZ>(pos.key(), dtz, result))
+        return dtz;
+
+    dtz = probe_dtz_tables(pos, result);
+
+    ResultCache.save<DTZ>(pos.key(), dtz, *result);
+    return dtz;
+}
+
 
 // Use the DTZ tables to rank root moves.
 //
 // A return value false indicates that not all probes were successful.
-bool Tablebases::root_probe(Position& pos, Search::RootMoves& rootMoves) {
+bool Tablebases::root_probe(Position& pos, Search::RootMoves& rootMoves, bool rule50) {
 
     ProbeState result;
     StateInfo st;
@@ -1520,7 +1718,7 @@ bool Tablebases::root_probe(Position& pos, Search::RootMoves& rootMoves) {
     // Check whether a position was repeated since the last zeroing move.
     bool rep = pos.has_repeated();
 
-    int dtz, bound = Options["Syzygy50MoveRule"] ? 900 : 1;
+    int dtz, bound = rule50 ? 900 : 1;
 
     // Probe and rank each move
     for (auto& m : rootMoves)
@@ -1578,15 +1776,13 @@ bool Tablebases::root_probe(Position& pos, Search::RootMoves& rootMoves) {
 // This is a fallback for the case that some or all DTZ tables are missing.
 //
 // A return value false indicates that not all probes were successful.
-bool Tablebases::root_probe_wdl(Position& pos, Search::RootMoves& rootMoves) {
+bool Tablebases::root_probe_wdl(Position& pos, Search::RootMoves& rootMoves, bool rule50) {
 
     static const int WDL_to_rank[] = { -1000, -899, 0, 899, 1000 };
 
     ProbeState result;
     StateInfo st;
 
-    bool rule50 = Options["Syzygy50MoveRule"];
-
     // Probe and rank each move
     for (auto& m : rootMoves)
     {
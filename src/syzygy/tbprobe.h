@@ -44,14 +44,25 @@ enum ProbeState {
     ZEROING_BEST_MOVE =  2  // Best move zeroes DTZ (capture or pawn move)
 };
 
+// Probing holds the tablebase parameters of a search. They are read from the
+// settings by ThreadPool::start_thinking() and adjusted for the root position
+// by rank_root_moves(), each engine has its own.
+struct Probing {
+    int cardinality;
+    bool rootInTB;
+    bool useRule50;
+    Depth probeDepth;
+};
+
 extern int MaxCardinality;
 
 void init(const std::string& paths);
+void preload();
 WDLScore probe_wdl(Position& pos, ProbeState* result);
 int probe_dtz(Position& pos, ProbeState* result);
-bool root_probe(Position& pos, Search::RootMoves& rootMoves);
-bool root_probe_wdl(Position& pos, Search::RootMoves& rootMoves);
-void rank_root_moves(Position& pos, Search::RootMoves& rootMoves);
+bool root_probe(Position& pos, Search::RootMoves& rootMoves, bool rule50);
+bool root_probe_wdl(Position& pos, Search::RootMoves& rootMoves, bool rule50);
+void rank_root_moves(Position& pos, Search::RootMoves& rootMoves, Probing& tb);
 
 inline std::ostream& operator<<(std::ostream& os, const WDLScore v) {
 
@@ -21,6 +21,9 @@
 #include <cassert>
 
 #include <algorithm> // For std::count
+#include <iostream>
+#include <new>
+#include "engine.h"
 #include "movegen.h"
 #include "search.h"
 #include "thread.h"
@@ -28,13 +31,37 @@
 #include "syzygy/tbprobe.h"
 #include "tt.h"
 
-ThreadPool Threads; // Global object
+Engine MainEngine; // Global object
+ThreadPool& Threads = MainEngine.threads;
+
+
+/// alloc_histories() reserves the history tables of a thread. The memory is
+/// not touched here, on the UCI thread, but in Thread::idle_loop().
+
+static HistoryTables* alloc_histories() {
+
+  void* mem = aligned_large_pages_alloc(sizeof(HistoryTables));
+  if (!mem)
+  {
+      std::cerr << "Failed to allocate " << sizeof(HistoryTables)
+                << " bytes for the history tables." << std::endl;
+      std::exit(EXIT_FAILURE);
+  }
+
+  return new (mem) HistoryTables; // Default-initialized, i.e. left untouched
+}
 
 
 /// Thread constructor launches the thread and waits until it goes to sleep
 /// in idle_loop(). Note that 'searching' and 'exit' should be already set.
 
-Thread::Thread(size_t n) : idx(n), stdThread(&Thread::idle_loop, this) {
+Thread::Thread(Engine& e, size_t n) : idx(n), histories(alloc_histories()), engine(e),
+                           counterMoves(histories->counterMoves),
+                           mainHistory(histories->mainHistory),
+                           lowPlyHistory(histories->lowPlyHistory),
+                           captureHistory(histories->captureHistory),
+                           continuationHistory(histories->continuationHistory),
+                           stdThread(&Thread::idle_loop, this) {
 
   wait_for_search_finished();
 }
@@ -50,6 +77,36 @@ Thread::~Thread() {
   exit = true;
   start_searching();
   stdThread.join();
+  aligned_large_pages_free(histories);
+}
+
+
+/// MainThread destructor ends the timer thread, if a search started it
+
+MainThread::~MainThread() {
+
+  if (timer.joinable())
+  {
+      { std::lock_guard<std::mutex> lk(timerMutex); timerExit = true; }
+      timerCv.notify_all();
+      timer.join();
+  }
+}
+
+
+/// Thread::operator new() allocates the thread objects, which are dominated by
+/// the history tables, on (transparent) huge pages where available.
+
+void* Thread::operator new(size_t size) {
+
+  void* mem = aligned_large_pages_alloc(size);
+  if (!mem)
+  {
+      std::cerr << "Failed to allocate " << size << " bytes for thread data." << std::endl;
+      std::exit(EXIT_FAILURE);
+  }
+
+  return mem;
 }
 
 
@@ -68,6 +125,7 @@ int Thread::best_move_count(Move move) const {
 
 void Thread::clear() {
 
+  evalCache.clear();
   counterMoves.fill(MOVE_NONE);
   mainHistory.fill(0);
   lowPlyHistory.fill(0);
@@ -90,7 +148,19 @@ void Thread::start_searching() {
 
   std::lock_guard<std::mutex> lk(mutex);
   searching = true;
-  cv.notify_one(); // Wake up the thread in idle_loop()
+  if (parked)
+      cv.notify_one(); // Wake up the thread in idle_loop()
+}
+
+
+/// Thread::wake_up() wakes up the thread if it is parked in idle_loop() after
+/// 'searching' has been raised, see ThreadPool::start_searching().
+
+void Thread::wake_up() {
+
+  std::lock_guard<std::mutex> lk(mutex);
+  if (parked)
+      cv.notify_one();
 }
 
 
@@ -104,32 +174,115 @@ void Thread::wait_for_search_finished() {
 }
 
 
-/// Thread::idle_loop() is where the thread is parked, blocked on the
-/// condition variable, when it has no work to do.
+/// Thread::run_custom_job() makes the thread run f() instead of a search and
+/// returns immediately. Jobs are used for work that UCI commands should not
+/// block on, like clearing the transposition table.
+
+void Thread::run_custom_job(std::function<void()> f) {
+
+  {
+      std::unique_lock<std::mutex> lk(mutex);
+      cv.wait(lk, [&]{ return !searching; });
+      jobFunc = std::move(f);
+      searching = true;
+      if (parked)
+          cv.notify_one();
+  }
+}
+
+
+/// Thread::wait_for_job_finished() blocks until a job started by
+/// run_custom_job(), if any, is done. Unlike wait_for_search_finished()
+/// it does not wait for a running search.
+
+void Thread::wait_for_job_finished() {
+
+  std::unique_lock<std::mutex> lk(mutex);
+  cv.wait(lk, [&]{ return !jobFunc; });
+}
+
+
+/// Thread::idle_loop() is where the thread waits when it has no work to do.
+/// With the "Idle Spin" option it first polls 'searching' for up to that many
+/// ms, yielding the CPU now and then, so that a 'go' soon after the previous
+/// one starts it without the wake up latency of the OS. Then it is parked,
+/// blocked on the condition variable. The spin adapts to the idle times: it is
+/// halved after each one longer than Idle Spin, when spinning only wasted CPU,
+/// and restored in full after a shorter one.
 
 void Thread::idle_loop() {
 
-  // If OS already scheduled us on a different group than 0 then don't overwrite
-  // the choice, eventually we are one of many one-threaded processes running on
-  // some Windows NUMA hardware, for instance in fishtest. To make it simple,
-  // just check if running threads are below a threshold, in this case all this
-  // NUMA machinery is not needed.
-  if (Options["Threads"] > 8)
-      WinProcGroup::bindThisThread(idx);
+  // With the "auto" binding, if OS already scheduled us on a different group
+  // than 0 then don't overwrite the choice, eventually we are one of many
+  // one-threaded processes running on some NUMA hardware, for instance in
+  // fishtest. To make it simple, just check if running threads are below a
+  // threshold, in this case all this NUMA machinery is not needed. Above it
+  // the threads are kept on their node but not pinned to a CPU, as every
+  // engine on the host would pick the same ones. Per-CPU pinning is opt-in.
+  const std::string binding = Options["Thread Binding"];
+
+  ThreadBinding::bind_this_thread(engine.threads.bindingBase + idx,
+                      binding == "spread"  ? ThreadBinding::SPREAD
+                    : binding == "compact" ? ThreadBinding::COMPACT
+                    : binding == "auto" && Options["Threads"] > 8 ? ThreadBinding::NODE
+                                                                  : ThreadBinding::NONE);
+
+  // Now that we run on our node, place there the thread object and the history
+  // tables, then first touch the tables and the eval cache, so that they are
+  // mapped locally and on huge pages. The constructor waits for this.
+  numa_bind_to_this_node(this, sizeof(*this));
+  numa_bind_to_this_node(histories, sizeof(HistoryTables));
+  evalCache.resize(size_t(Options["EvalCache"]));
+  clear();
+
+#ifdef TT_STATS
+  TTStats::current = &ttStats;
+#endif
 
   while (true)
   {
       std::unique_lock<std::mutex> lk(mutex);
       searching = false;
+      jobFunc = nullptr;
       cv.notify_one(); // Wake up anyone waiting for search finished
-      cv.wait(lk, [&]{ return searching; });
+
+      const int maxSpin = engine.threads.idleSpin.load(std::memory_order_relaxed);
+      const TimePoint idleStart = maxSpin ? now() : 0;
+
+      if (maxSpin >> spinShift)
+      {
+          lk.unlock();
+
+          TimePoint spinEnd = idleStart + (maxSpin >> spinShift);
+          for (int i = 1; !searching.load(std::memory_order_relaxed); ++i)
+              if (!(i & 1023))
+              {
+                  if (now() >= spinEnd)
+                      break;
+                  std::this_thread::yield();
+              }
+
+          lk.lock();
+      }
+
+      parked = true;
+      cv.wait(lk, [&]{ return bool(searching); });
+      parked = false;
+
+      if (maxSpin)
+          spinShift = now() - idleStart <= maxSpin ? 0 : std::min(spinShift + 1, 16);
 
       if (exit)
           return;
 
+      std::function<void()> job = jobFunc;
+
       lk.unlock();
 
-      search();
+      if (job)
+          job();
+      else
+          search();
   }
 }
 
@@ -141,23 +294,25 @@ void ThreadPool::set(size_t requested) {
 
   if (size() > 0) { // destroy any existing thread(s)
       main()->wait_for_search_finished();
+      wait_for_jobs_finished();
 
       while (size() > 0)
           delete back(), pop_back();
   }
 
   if (requested > 0) { // create new thread(s)
-      push_back(new MainThread(0));
+      push_back(new MainThread(engine, 0));
 
+      // The new threads clear their tables themselves, see idle_loop()
       while (size() < requested)
-          push_back(new Thread(size()));
-      clear();
+          push_back(new Thread(engine, size()));
 
-      // Reallocate the hash with the new threadpool size
-      TT.resize(size_t(Options["Hash"]));
+      // Clear the hash again, the new threads do it in the background and
+      // first touch their part on their own node
+      engine.tt.clear();
 
       // Init thread number dependent search params.
-      Search::init();
+      Search::init(engine);
   }
 }
 
@@ -170,6 +325,7 @@ void ThreadPool::clear() {
       th->clear();
 
   main()->callsCnt = 0;
+  main()->useTimer = false;
   main()->bestPreviousScore = VALUE_INFINITE;
   main()->previousTimeReduction = 1.0;
 }
@@ -182,11 +338,13 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
                                 const Search::LimitsType& limits, bool ponderMode) {
 
   main()->wait_for_search_finished();
+  wait_for_jobs_finished(); // The helpers may still be clearing the hash
 
   main()->stopOnPonderhit = stop = false;
   increaseDepth = true;
+  idleSpin = engine.config.idleSpin;
   main()->ponder = ponderMode;
-  Search::Limits = limits;
+  engine.limits = limits;
   Search::RootMoves rootMoves;
 
   for (const auto& m : MoveList<LEGAL>(pos))
@@ -194,8 +352,11 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
           || std::count(limits.searchmoves.begin(), limits.searchmoves.end(), m))
           rootMoves.emplace_back(m);
 
+  engine.tb = { engine.config.syzygyProbeLimit, false,
+                engine.config.syzygy50MoveRule, engine.config.syzygyProbeDepth };
+
   if (!rootMoves.empty())
-      Tablebases::rank_root_moves(pos, rootMoves);
+      Tablebases::rank_root_moves(pos, rootMoves, engine.tb);
 
   // After ownership transfer 'states' becomes empty, so if we stop the search
   // and call 'go' again without setting a new position states.get() == NULL.
@@ -204,22 +365,42 @@ void ThreadPool::start_thinking(Position& pos, StateListPtr& states,
   if (states.get())
       setupStates = std::move(states); // Ownership transfer, states is now empty
 
-  // We use Position::set() to set root position across threads. But there are
-  // some StateInfo fields (previous, pliesFromNull, capturedPiece) that cannot
-  // be deduced from a fen string, so set() clears them and to not lose the info
-  // we need to backup and later restore setupStates->back(). Note that setupStates
-  // is shared by threads but is accessed in read-only mode.
-  StateInfo tmp = setupStates->back();
-
-  for (Thread* th : *this)
-  {
+  // Each thread gets a copy of the root position, sharing its StateInfo, which
+  // is setupStates->back(), in read-only mode: the fields that could not be
+  // deduced from a FEN (previous, pliesFromNull, capturedPiece) are kept. The
+  // helpers copy it, and the root moves, on their own and in parallel, to
+  // write them on their node. The NNUE accumulators live in each rootPos.
+  pos.update_accumulator();
+
+  // In MultiPV split mode the root moves are dealt out to groups of threads,
+  // which find the best lines of their share. The union of these lines holds
+  // the best lines overall, see merged_lines(). Time management and skill
+  // levels need the root moves of the main thread to be all of them.
+  pvGroups =   engine.config.multiPVSplit
+            && engine.config.multiPV > 1
+            && !limits.use_time_management()
+            && !(engine.config.skillLevel < 20 || engine.config.limitStrength)
+            && rootMoves.size() > 1 ? std::min(size(), rootMoves.size()) : 1;
+
+  auto setup = [&](Thread* th, size_t group) {
       th->nodes = th->tbHits = th->nmpMinPly = th->bestMoveChanges = 0;
-      th->rootDepth = th->completedDepth = 0;
-      th->rootMoves = rootMoves;
-      th->rootPos.set(pos.fen(), pos.is_chess960(), &setupStates->back(), th);
+      th->bestMoveChangesSeen = 0;
+      th->rootDepth = th->completedDepth = th->snapshotDepth = 0;
+      th->pvSnapshot.clear();
+      th->rootMoves.clear();
+      for (size_t i = group; i < rootMoves.size(); i += pvGroups)
+          th->rootMoves.push_back(rootMoves[i]);
+      th->rootPos.set(pos, th);
+  };
+
+  for (size_t i = 1; i < size(); ++i)
+  {
+      Thread* th = (*this)[i];
+      th->run_custom_job([&setup, th, i, this]() { setup(th, i % pvGroups); });
   }
 
-  setupStates->back() = tmp;
+  setup(front(), 0);
+  wait_for_jobs_finished();
 
   main()->start_searching();
 }
@@ -256,13 +437,55 @@ Thread* ThreadPool::get_best_thread() const {
 }
 
 
-/// Start non-main threads
+/// ThreadPool::merged_lines() returns, in MultiPV split mode, the lines of the
+/// thread that went deepest in each group, sorted by score, and in 'depth' the
+/// lowest of their depths. The result is empty until every group has one.
+
+Search::RootMoves ThreadPool::merged_lines(Depth& depth) const {
+
+  Search::RootMoves lines;
+  depth = MAX_PLY;
+
+  for (size_t group = 0; group < pvGroups; ++group)
+  {
+      Thread* best = nullptr;
+      Depth bestDepth = 0;
+
+      for (size_t i = group; i < size(); i += pvGroups)
+      {
+          Thread* th = (*this)[i];
+          std::lock_guard<std::mutex> lk(th->pvMutex);
+          if (th->snapshotDepth > bestDepth)
+              best = th, bestDepth = th->snapshotDepth;
+      }
+
+      if (!best)
+          return Search::RootMoves();
+
+      std::lock_guard<std::mutex> lk(best->pvMutex);
+      lines.insert(lines.end(), best->pvSnapshot.begin(), best->pvSnapshot.end());
+      depth = std::min(depth, best->snapshotDepth);
+  }
+
+  std::stable_sort(lines.begin(), lines.end());
+  return lines;
+}
+
+
+/// Start non-main threads. The flags are raised first in one pass, which
+/// starts all the spinning helpers at once, then the parked ones are woken up.
+/// Taking the mutex of each helper after its flag is raised ensures that a
+/// helper about to park either sees the flag or is notified.
 
 void ThreadPool::start_searching() {
 
     for (Thread* th : *this)
         if (th != front())
-            th->start_searching();
+            th->raise_searching();
+
+    for (Thread* th : *this)
+        if (th != front())
+            th->wake_up();
 }
 
 
@@ -274,3 +497,12 @@ void ThreadPool::wait_for_search_finished() const {
         if (th != front())
             th->wait_for_search_finished();
 }
+
+
+/// Wait for the jobs of all threads, see Thread::run_custom_job()
+
+void ThreadPool::wait_for_jobs_finished() const {
+
+    for (Thread* th : *this)
+        th->wait_for_job_finished();
+}
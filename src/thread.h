@@ -23,76 +23,141 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <vector>
 
+#include "evaluate.h"
 #include "material.h"
+#include "misc.h"
 #include "movepick.h"
 #include "pawns.h"
 #include "position.h"
 #include "search.h"
 #include "thread_win32_osx.h"
+#include "tt.h"
+
+struct Engine;
+
+
+/// HistoryTables keeps together the history tables of a thread, which are
+/// several MB. Each thread allocates them apart from the Thread object, on
+/// huge pages where available, and first touches them itself once bound to
+/// its NUMA node, see Thread::idle_loop().
+
+struct HistoryTables {
+  CounterMoveHistory counterMoves;
+  ButterflyHistory mainHistory;
+  LowPlyHistory lowPlyHistory;
+  CapturePieceToHistory captureHistory;
+  ContinuationHistory continuationHistory[2][2];
+};
 
 
 /// Thread class keeps together all the thread-related stuff. We use
 /// per-thread pawn and material hash tables so that once we get a
 /// pointer to an entry its life time is unlimited and we don't have
-/// to care about someone changing the entry under our feet.
+/// to care about someone changing the entry under our feet. Each thread
+/// belongs to the thread pool of one Engine, which holds the shared search
+/// state: the hash, the limits and the settings.
 
 class Thread {
 
   std::mutex mutex;
   std::condition_variable cv;
   size_t idx;
-  bool exit = false, searching = true; // Set before starting std::thread
-  NativeThread stdThread;
+  bool exit = false, parked = false;
+  int spinShift = 0; // The spin of idle_loop() is Idle Spin >> spinShift
+  std::atomic_bool searching { true }; // Set before starting std::thread
+  std::function<void()> jobFunc;
+  HistoryTables* const histories; // Before the references to its tables
 
 public:
-  explicit Thread(size_t);
+  Thread(Engine&, size_t);
   virtual ~Thread();
+  static void* operator new(size_t size);
+  static void operator delete(void* mem) { aligned_large_pages_free(mem); }
   virtual void search();
   void clear();
   void idle_loop();
   void start_searching();
+  void raise_searching() { searching = true; } // Then wake_up(), see ThreadPool::start_searching()
+  void wake_up();
   void wait_for_search_finished();
+  void run_custom_job(std::function<void()> f);
+  void wait_for_job_finished();
   int best_move_count(Move move) const;
 
+  Engine& engine;
   Pawns::Table pawnsTable;
   Material::Table materialTable;
+  Eval::Cache evalCache;
+#ifdef TT_STATS
+  TTStats ttStats {};
+#endif
+#ifdef SEARCH_STATS
+  alignas(64) Search::Stats searchStats {};
+#endif
   size_t pvIdx, pvLast;
   uint64_t ttHitAverage;
   int selDepth, nmpMinPly;
   Color nmpColor;
-  std::atomic<uint64_t> nodes, tbHits, bestMoveChanges;
+  uint64_t bestMoveChangesSeen; // Written by the main thread, see the time management in Thread::search()
+
+  // The counters read by the other threads get a cache line of their own, so
+  // that the owner's updates don't invalidate the line of the neighbouring
+  // fields. Only the owner writes them, with relaxed_increment().
+  alignas(64) std::atomic<uint64_t> nodes, tbHits, bestMoveChanges;
 
-  Position rootPos;
+  alignas(64) Position rootPos;
   Search::RootMoves rootMoves;
   Depth rootDepth, completedDepth;
-  CounterMoveHistory counterMoves;
-  ButterflyHistory mainHistory;
-  LowPlyHistory lowPlyHistory;
-  CapturePieceToHistory captureHistory;
-  ContinuationHistory continuationHistory[2][2];
+  std::mutex pvMutex;           // Guards the two below, see ThreadPool::merged_lines()
+  Search::RootMoves pvSnapshot; // The lines of the last completed iteration
+  Depth snapshotDepth;
+  CounterMoveHistory& counterMoves;
+  ButterflyHistory& mainHistory;
+  LowPlyHistory& lowPlyHistory;
+  CapturePieceToHistory& captureHistory;
+  ContinuationHistory (&continuationHistory)[2][2];
   Score contempt;
+
+private:
+  NativeThread stdThread; // Last, idle_loop() may use all the members above
 };
 
 
+/// relaxed_increment() increments a counter written by the calling thread only.
+/// A relaxed load and store compile to a plain add, without the locked
+/// read-modify-write of fetch_add(), and the readers still see whole values.
+
+inline void relaxed_increment(std::atomic<uint64_t>& counter) {
+  counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+
 /// MainThread is a derived class specific for main thread
 
 struct MainThread : public Thread {
 
   using Thread::Thread;
+ ~MainThread() override;
 
   void search() override;
   void check_time();
+  void timer_loop();
 
-  double previousTimeReduction;
-  Value bestPreviousScore;
+  double previousTimeReduction = 1.0;
+  Value bestPreviousScore = VALUE_INFINITE;
   Value iterValue[4];
-  int callsCnt;
-  bool stopOnPonderhit;
-  std::atomic_bool ponder;
+  int callsCnt = 0;
+  bool useTimer = false; // The timer thread, not check_time(), stops the search
+  std::atomic_bool stopOnPonderhit, ponder;
+  std::mutex timerMutex;
+  std::condition_variable timerCv;
+  bool timerArmed = false, timerDisarm = false, timerExit = false; // Guarded by timerMutex, see timer_loop()
+  std::thread timer;                                                // Started by the first search that uses it
 };
 
 
@@ -102,6 +167,8 @@ struct MainThread : public Thread {
 
 struct ThreadPool : public std::vector<Thread*> {
 
+  explicit ThreadPool(Engine& e) : engine(e) {}
+
   void start_thinking(Position&, StateListPtr&, const Search::LimitsType&, bool = false);
   void clear();
   void set(size_t);
@@ -110,9 +177,15 @@ struct ThreadPool : public std::vector<Thread*> {
   uint64_t nodes_searched() const { return accumulate(&Thread::nodes); }
   uint64_t tb_hits()        const { return accumulate(&Thread::tbHits); }
   Thread* get_best_thread() const;
+  Search::RootMoves merged_lines(Depth& depth) const;
   void start_searching();
   void wait_for_search_finished() const;
+  void wait_for_jobs_finished() const;
 
+  Engine& engine;
+  size_t bindingBase = 0; // Binding index of the first thread, see Thread::idle_loop()
+  size_t pvGroups = 1;    // Thread i searches the root moves j with i = j modulo pvGroups
+  std::atomic<int> idleSpin { 0 }; // config.idleSpin as of the last 'go', read by idle threads
   std::atomic_bool stop, increaseDepth;
 
 private:
@@ -127,6 +200,6 @@ private:
   }
 };
 
-extern ThreadPool Threads;
+extern ThreadPool& Threads; // The pool of MainEngine
 
 #endif // #ifndef THREAD_H_INCLUDED
@@ -26,19 +26,17 @@
 #include "timeman.h"
 #include "uci.h"
 
-TimeManagement Time; // Our global time management object
-
 
 /// TimeManagement::init() is called at the beginning of the search and calculates
 /// the bounds of time allowed for the current game ply. We currently support:
 //      1) x basetime (+ z increment)
 //      2) x moves in y seconds (+ z increment)
 
-void TimeManagement::init(Search::LimitsType& limits, Color us, int ply) {
+void TimeManagement::init(Search::LimitsType& limits, Color us, int ply, const UCI::Settings& config) {
 
-  TimePoint moveOverhead    = TimePoint(Options["Move Overhead"]);
-  TimePoint slowMover       = TimePoint(Options["Slow Mover"]);
-  TimePoint npmsec          = TimePoint(Options["nodestime"]);
+  TimePoint moveOverhead    = TimePoint(config.moveOverhead);
+  TimePoint slowMover       = TimePoint(config.slowMover);
+  TimePoint npmsec          = TimePoint(config.nodestime);
 
   // opt_scale is a percentage of available time to use for the current move.
   // max_scale is a multiplier applied to optimumTime.
@@ -59,6 +57,7 @@ void TimeManagement::init(Search::LimitsType& limits, Color us, int ply) {
       limits.npmsec = npmsec;
   }
 
+  nodesAsTime = limits.npmsec;
   startTime = limits.startTime;
 
   // Maximum move horizon of 50 moves
@@ -94,6 +93,6 @@ void TimeManagement::init(Search::LimitsType& limits, Color us, int ply) {
   optimumTime = TimePoint(opt_scale * timeLeft);
   maximumTime = TimePoint(std::min(0.8 * limits.time[us] - moveOverhead, max_scale * optimumTime));
 
-  if (Options["Ponder"])
+  if (config.ponder)
       optimumTime += optimumTime / 4;
 }
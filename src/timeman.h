@@ -24,26 +24,29 @@
 #include "misc.h"
 #include "search.h"
 #include "thread.h"
+#include "uci.h"
 
 /// The TimeManagement class computes the optimal time to think depending on
 /// the maximum available time, the game move number and other parameters.
+/// In 'nodes as time' mode the elapsed time is the node count of its pool.
 
 class TimeManagement {
 public:
-  void init(Search::LimitsType& limits, Color us, int ply);
+  explicit TimeManagement(const ThreadPool& tp) : availableNodes(0), threads(tp), nodesAsTime(false) {}
+  void init(Search::LimitsType& limits, Color us, int ply, const UCI::Settings& config);
   TimePoint optimum() const { return optimumTime; }
   TimePoint maximum() const { return maximumTime; }
-  TimePoint elapsed() const { return Search::Limits.npmsec ?
-                                     TimePoint(Threads.nodes_searched()) : now() - startTime; }
+  TimePoint elapsed() const { return nodesAsTime ?
+                                     TimePoint(threads.nodes_searched()) : now() - startTime; }
 
   int64_t availableNodes; // When in 'nodes as time' mode
 
 private:
+  const ThreadPool& threads;
+  bool nodesAsTime;
   TimePoint startTime;
   TimePoint optimumTime;
   TimePoint maximumTime;
 };
 
-extern TimeManagement Time;
-
 #endif // #ifndef TIMEMAN_H_INCLUDED
@@ -18,22 +18,48 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm> // For std::min
 #include <cstring>   // For std::memset
+#include <fstream>
+#include <iomanip>
 #include <iostream>
-#include <thread>
+#include <sstream>
 
 #include "bitboard.h"
+#include "engine.h"
 #include "misc.h"
 #include "thread.h"
 #include "tt.h"
-#include "uci.h"
 
-TranspositionTable TT; // Our global transposition table
+TranspositionTable& TT = MainEngine.tt;
+
+#ifdef TT_STATS
+thread_local TTStats* TTStats::current;
+#endif
+
+namespace {
+
+  // Header of the files written by TranspositionTable::save(). A file can be
+  // loaded only by a binary with the same entry and cluster layout.
+  constexpr uint32_t HashFileMagic = 0x48544653; // "SFTH"
+
+  struct HashFileHeader {
+    uint32_t magic;
+    uint32_t entryBytes;
+    uint32_t clusterBytes;
+    uint32_t generation;
+    uint64_t clusterCount;
+  };
+
+} // namespace
+
+#ifndef TT_LOCKLESS
 
 /// TTEntry::save() populates the TTEntry with a new node's data, possibly
-/// overwriting an old position. Update is not atomic and can be racy.
+/// overwriting an old position. Update is not atomic and can be racy. The
+/// generation is the one of the table, see TranspositionTable::generation().
 
-void TTEntry::save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev) {
+void TTEntry::save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev, uint8_t generation8) {
 
   // Preserve any existing move for the same position
   if (m || (uint16_t)k != key16)
@@ -49,75 +75,138 @@ void TTEntry::save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev)
       key16     = (uint16_t)k;
       value16   = (int16_t)v;
       eval16    = (int16_t)ev;
-      genBound8 = (uint8_t)(TT.generation8 | uint8_t(pv) << 2 | b);
+      genBound8 = (uint8_t)(generation8 | uint8_t(pv) << 2 | b);
       depth8    = (uint8_t)(d - DEPTH_OFFSET);
   }
 }
 
+#else
+
+/// TTEntry::save() for the lockless format. The entry is read once into a
+/// local copy and always written back as a whole, together with its matching
+/// key check, so a concurrent writer can only make the entry unverifiable.
+
+void TTEntry::save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev, uint8_t generation8) {
+
+  const uint64_t old = data;
+  const bool samePos = (keyXorData ^ old) == k;
+
+  // Preserve any existing move for the same position
+  const uint16_t move16 = m || !samePos ? (uint16_t)m : uint16_t(old);
+
+  // Overwrite less valuable entries
+  if (  !samePos
+      || d - DEPTH_OFFSET > uint8_t(old >> 56) - 4
+      || b == BOUND_EXACT)
+  {
+      assert(d >= DEPTH_OFFSET);
+
+      store(k,  uint64_t(move16)
+              | uint64_t(uint16_t(v))  << 16
+              | uint64_t(uint16_t(ev)) << 32
+              | uint64_t(uint8_t(generation8 | uint8_t(pv) << 2 | b)) << 48
+              | uint64_t(uint8_t(d - DEPTH_OFFSET)) << 56);
+  }
+  else if (move16 != uint16_t(old))
+      store(k, (old & ~uint64_t(0xFFFF)) | move16);
+}
+
+#endif
+
+
+/// TranspositionTable::gen_bound8() and depth8() read the raw generation/bound
+/// and depth bytes of an entry, whatever its storage format.
+
+#ifndef TT_LOCKLESS
+uint8_t TranspositionTable::gen_bound8(const TTEntry* tte) { return tte->genBound8; }
+uint8_t TranspositionTable::depth8(const TTEntry* tte)     { return tte->depth8; }
+#else
+uint8_t TranspositionTable::gen_bound8(const TTEntry* tte) { return uint8_t(tte->data >> 48); }
+uint8_t TranspositionTable::depth8(const TTEntry* tte)     { return uint8_t(tte->data >> 56); }
+#endif
+
 
 /// TranspositionTable::resize() sets the size of the transposition table,
 /// measured in megabytes. Transposition table consists of a power of 2 number
 /// of clusters and each cluster consists of ClusterSize number of TTEntry.
+/// The current allocation is kept when the new table fits in it and uses at
+/// least half of it, so that shrinking or keeping the size needs no new
+/// allocation and only the background clear. Only the resizes asked for with
+/// the Hash option report the kind of pages obtained: the first one happens
+/// before 'uci' is received, when info strings confuse some GUIs, and the
+/// hash of the other engines is none of the GUI's business.
 
-void TranspositionTable::resize(size_t mbSize) {
+void TranspositionTable::resize(size_t mbSize, bool report) {
 
-  Threads.main()->wait_for_search_finished();
-
-  aligned_ttmem_free(mem);
+  threads.main()->wait_for_search_finished();
+  threads.wait_for_jobs_finished();
 
   clusterCount = mbSize * 1024 * 1024 / sizeof(Cluster);
-  table = static_cast<Cluster*>(aligned_ttmem_alloc(clusterCount * sizeof(Cluster), mem));
-  if (!mem)
+
+  if (   !mem
+      || clusterCount > allocatedClusters
+      || 2 * clusterCount < allocatedClusters)
   {
-      std::cerr << "Failed to allocate " << mbSize
-                << "MB for transposition table." << std::endl;
-      exit(EXIT_FAILURE);
+      aligned_ttmem_free(mem);
+
+      allocatedClusters = clusterCount;
+      table = static_cast<Cluster*>(aligned_ttmem_alloc(clusterCount * sizeof(Cluster), mem, report));
+      if (!mem)
+      {
+          std::cerr << "Failed to allocate " << mbSize
+                    << "MB for transposition table." << std::endl;
+          exit(EXIT_FAILURE);
+      }
   }
 
   clear();
 }
 
 
-/// TranspositionTable::clear() initializes the entire transposition table to zero,
-//  in a multi-threaded way.
+/// TranspositionTable::clear() initializes the entire transposition table to
+/// zero. The work is split among the threads of the pool, which run it in the
+/// background: the command returns at once and the next search, 'isready' or
+/// resize waits for the clear to be finished.
 
 void TranspositionTable::clear() {
 
-  std::vector<std::thread> threads;
+  if (!table) // Not sized yet, see ThreadPool::set()
+      return;
 
-  for (size_t idx = 0; idx < Options["Threads"]; ++idx)
-  {
-      threads.emplace_back([this, idx]() {
+  const size_t threadCount = threads.size();
 
-          // Thread binding gives faster search on systems with a first-touch policy
-          if (Options["Threads"] > 8)
-              WinProcGroup::bindThisThread(idx);
+  for (size_t idx = 0; idx < threadCount; ++idx)
+  {
+      // The pool threads are already bound, which gives faster search on
+      // systems with a first-touch policy.
+      threads[idx]->run_custom_job([this, idx, threadCount]() {
 
           // Each thread will zero its part of the hash table
-          const size_t stride = size_t(clusterCount / Options["Threads"]),
-                       start  = size_t(stride * idx),
-                       len    = idx != Options["Threads"] - 1 ?
+          const size_t stride = clusterCount / threadCount,
+                       start  = stride * idx,
+                       len    = idx != threadCount - 1 ?
                                 stride : clusterCount - start;
 
           std::memset(&table[start], 0, len * sizeof(Cluster));
       });
   }
-
-  for (std::thread& th : threads)
-      th.join();
 }
 
 
 /// TranspositionTable::probe() looks up the current position in the transposition
-/// table. It returns true and a pointer to the TTEntry if the position is found.
-/// Otherwise, it returns false and a pointer to an empty or least valuable TTEntry
-/// to be replaced later. The replace value of an entry is calculated as its depth
+/// table. It returns true and a pointer to the TTEntry if the position is found,
+/// with a copy of its content in ttData. Otherwise, it returns false, an empty
+/// ttData and a pointer to an empty or least valuable TTEntry to be replaced
+/// later. The pointer is only meant for TTEntry::save(). The replace value of an entry is calculated as its depth
 /// minus 8 times its relative age. TTEntry t1 is considered more valuable than
 /// TTEntry t2 if its replace value is greater than that of t2.
 
-TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
+TTEntry* TranspositionTable::probe(const Key key, bool& found, TTData& ttData) const {
 
   TTEntry* const tte = first_entry(key);
+  ttData = { MOVE_NONE, VALUE_NONE, VALUE_NONE, DEPTH_NONE, BOUND_NONE, false };
+
+#ifndef TT_LOCKLESS
   const uint16_t key16 = (uint16_t)key;  // Use the low 16 bits as key inside the cluster
 
   for (int i = 0; i < ClusterSize; ++i)
@@ -125,8 +214,42 @@ TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
       {
           tte[i].genBound8 = uint8_t(generation8 | (tte[i].genBound8 & 0x7)); // Refresh
 
+#ifdef TT_STATS
+          if (TTStats::current)
+              ++(tte[i].key16 ? TTStats::current->hits : TTStats::current->empty);
+#endif
+          if (tte[i].key16)
+              ttData = tte[i].read();
+
           return found = (bool)tte[i].key16, &tte[i];
       }
+#else
+  for (int i = 0; i < ClusterSize; ++i)
+  {
+      const uint64_t data = tte[i].data; // Verify and refresh the same copy
+
+      if ((tte[i].keyXorData ^ data) == key)
+      {
+          tte[i].store(key, (data & ~(uint64_t(0xF8) << 48)) | uint64_t(generation8) << 48); // Refresh
+
+#ifdef TT_STATS
+          if (TTStats::current)
+              ++TTStats::current->hits;
+#endif
+          ttData = TTEntry::read(data);
+          return found = true, &tte[i];
+      }
+
+      if (!data)
+      {
+#ifdef TT_STATS
+          if (TTStats::current)
+              ++TTStats::current->empty;
+#endif
+          return found = false, &tte[i];
+      }
+  }
+#endif
 
   // Find an entry to be replaced according to the replacement strategy
   TTEntry* replace = tte;
@@ -135,23 +258,144 @@ TTEntry* TranspositionTable::probe(const Key key, bool& found) const {
       // nature we add 263 (256 is the modulus plus 7 to keep the unrelated
       // lowest three bits from affecting the result) to calculate the entry
       // age correctly even after generation8 overflows into the next cycle.
-      if (  replace->depth8 - ((263 + generation8 - replace->genBound8) & 0xF8)
-          >   tte[i].depth8 - ((263 + generation8 -   tte[i].genBound8) & 0xF8))
+      if (  depth8(replace) - ((263 + generation8 - gen_bound8(replace)) & 0xF8)
+          >   depth8(&tte[i]) - ((263 + generation8 - gen_bound8(&tte[i])) & 0xF8))
           replace = &tte[i];
 
+#ifdef TT_STATS
+  if (TTStats::current)
+  {
+      const int age   = ((263 + generation8 - gen_bound8(replace)) & 0xF8) >> 3;
+      const int depth = depth8(replace) + DEPTH_OFFSET;
+
+      ++TTStats::current->replaced;
+      ++TTStats::current->replacedAge[age < 2 ? age : age < 4 ? 2 : 3];
+      ++TTStats::current->replacedDepth[depth < 1 ? 0 : depth < 6 ? 1 : depth < 12 ? 2 : 3];
+  }
+#endif
   return found = false, replace;
 }
 
 
 /// TranspositionTable::hashfull() returns an approximation of the hashtable
 /// occupation during a search. The hash is x permill full, as per UCI protocol.
+/// By default only the first 1000 clusters are sampled.
 
-int TranspositionTable::hashfull() const {
+int TranspositionTable::hashfull(size_t clusters) const {
 
-  int cnt = 0;
-  for (int i = 0; i < 1000; ++i)
+  clusters = std::min(clusters, clusterCount);
+
+  size_t cnt = 0;
+  for (size_t i = 0; i < clusters; ++i)
       for (int j = 0; j < ClusterSize; ++j)
-          cnt += (table[i].entry[j].genBound8 & 0xF8) == generation8;
+          cnt += (gen_bound8(&table[i].entry[j]) & 0xF8) == generation8;
+
+  return int(cnt * 1000 / (clusters * ClusterSize));
+}
+
+
+/// TranspositionTable::save() writes the whole table to a file, so that a warm
+/// hash can be restored by load() after a restart. Saving does not stop a
+/// running search: entries being written meanwhile may be saved torn, which is
+/// harmless as moves read from the TT are always validated before use.
+
+bool TranspositionTable::save(const std::string& filename) const {
+
+  threads.wait_for_jobs_finished();
+
+  std::ofstream file(filename, std::ios::binary);
+  HashFileHeader header = { HashFileMagic, uint32_t(sizeof(TTEntry)), uint32_t(sizeof(Cluster)),
+                            generation8, uint64_t(clusterCount) };
+
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(table), std::streamsize(clusterCount * sizeof(Cluster)));
+
+  return bool(file);
+}
+
+
+/// TranspositionTable::load() reads back a table written by save(). If the file
+/// was saved with a different hash size the table is resized to match, and it
+/// is up to the caller to bring the Hash option in line. A file that does not
+/// hold exactly one whole table is refused before anything is changed; on a
+/// read error the table is left cleared.
+
+bool TranspositionTable::load(const std::string& filename) {
+
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  const std::streamoff fileSize = file ? std::streamoff(file.tellg()) : 0;
+  HashFileHeader header;
+
+  if (   !file.seekg(0)
+      || !file.read(reinterpret_cast<char*>(&header), sizeof(header))
+      || header.magic != HashFileMagic
+      || header.entryBytes != sizeof(TTEntry)
+      || header.clusterBytes != sizeof(Cluster))
+      return false;
+
+  // The table must fill the rest of the file and be a size resize() can
+  // recreate, that is a whole number of MB.
+  const uint64_t tableBytes = uint64_t(fileSize) - sizeof(header);
+  const size_t mbSize = size_t(tableBytes / (1024 * 1024));
+
+  if (   tableBytes % sizeof(Cluster)
+      || header.clusterCount != tableBytes / sizeof(Cluster)
+      || mbSize == 0
+      || mbSize * 1024 * 1024 / sizeof(Cluster) != header.clusterCount)
+      return false;
+
+  if (header.clusterCount != clusterCount)
+      resize(mbSize);
+
+  threads.main()->wait_for_search_finished();
+  threads.wait_for_jobs_finished();
+
+  if (!file.read(reinterpret_cast<char*>(table), std::streamsize(clusterCount * sizeof(Cluster))))
+  {
+      clear();
+      return false;
+  }
+
+  generation8 = uint8_t(header.generation);
+  return true;
+}
+
+
+/// TranspositionTable::stats() returns the occupation of the whole table and,
+/// if compiled in, the probe counters summed over all the threads.
+
+std::string TranspositionTable::stats() const {
+
+  std::stringstream ss;
+
+  threads.wait_for_jobs_finished();
+
+  ss << "Hash table: " << clusterCount * sizeof(Cluster) / (1024 * 1024) << " MB, "
+     << clusterCount * ClusterSize << " entries, " << hashfull(clusterCount)
+     << " permill used in the current search";
+
+#ifdef TT_STATS
+  TTStats total = {};
+
+  for (Thread* th : threads)
+      total.add(th->ttStats);
+
+  const uint64_t probes = total.hits + total.empty + total.replaced;
+  auto pct = [&](uint64_t n) { return probes ? 100.0 * n / probes : 0.0; };
+
+  ss << std::fixed << std::setprecision(2)
+     << "\nProbes              : " << probes
+     << "\nHits                : " << total.hits << " (" << pct(total.hits) << "%)"
+     << "\nMisses, empty slot  : " << total.empty << " (" << pct(total.empty) << "%)"
+     << "\nMisses, replacement : " << total.replaced << " (" << pct(total.replaced) << "%)"
+     << "\nCollisions          : " << total.collisions << " (" << pct(total.collisions) << "%)"
+     << "\nReplaced by age     : 0: "  << total.replacedAge[0] << " 1: " << total.replacedAge[1]
+     << " 2-3: " << total.replacedAge[2] << " 4+: " << total.replacedAge[3]
+     << "\nReplaced by depth   : <1: " << total.replacedDepth[0] << " 1-5: " << total.replacedDepth[1]
+     << " 6-11: " << total.replacedDepth[2] << " 12+: " << total.replacedDepth[3];
+#else
+  ss << "\nProbe counters not compiled in, build with ttstats=yes";
+#endif
 
-  return cnt / ClusterSize;
+  return ss.str();
 }
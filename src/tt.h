@@ -21,9 +21,27 @@
 #ifndef TT_H_INCLUDED
 #define TT_H_INCLUDED
 
+#include <string>
+
 #include "misc.h"
 #include "types.h"
 
+struct ThreadPool;
+
+/// TTData is the copy of a TTEntry handed out by TranspositionTable::probe().
+/// The search reads only this copy, never the entry itself, which other threads
+/// may overwrite at any time.
+
+struct TTData {
+  Move  move;
+  Value value, eval;
+  Depth depth;
+  Bound bound;
+  bool  isPv;
+};
+
+#ifndef TT_LOCKLESS
+
 /// TTEntry struct is the 10 bytes transposition table entry, defined as below:
 ///
 /// key        16 bit
@@ -37,17 +55,16 @@
 
 struct TTEntry {
 
-  Move  move()  const { return (Move )move16; }
-  Value value() const { return (Value)value16; }
-  Value eval()  const { return (Value)eval16; }
-  Depth depth() const { return (Depth)depth8 + DEPTH_OFFSET; }
-  bool is_pv()  const { return (bool)(genBound8 & 0x4); }
-  Bound bound() const { return (Bound)(genBound8 & 0x3); }
-  void save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev);
+  void save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev, uint8_t generation8);
 
 private:
   friend class TranspositionTable;
 
+  TTData read() const {
+    return { (Move)move16, (Value)value16, (Value)eval16, (Depth)depth8 + DEPTH_OFFSET,
+             (Bound)(genBound8 & 0x3), (bool)(genBound8 & 0x4) };
+  }
+
   uint16_t key16;
   uint16_t move16;
   int16_t  value16;
@@ -56,45 +73,131 @@ private:
   uint8_t  depth8;
 };
 
+#else
+
+/// With TT_LOCKLESS (ttlockless=yes) TTEntry is 16 bytes: the same fields as
+/// above, minus the key, are packed in a single 64-bit data word
+///
+/// move       bits  0-15
+/// value      bits 16-31
+/// eval value bits 32-47
+/// gen/bound  bits 48-55
+/// depth      bits 56-63
+///
+/// and the full 64-bit position key is stored XORed with that word. Writers
+/// store both words, readers accept an entry only if key ^ data gives back the
+/// position key, so an entry torn by two concurrent writers reads as a miss
+/// instead of handing out the data of another position. probe() loads the data
+/// word once, verifies it and decodes that same copy into the TTData it returns,
+/// so a later overwrite of the entry can't reach the search. No locks are needed.
+
+struct TTEntry {
+
+  void save(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev, uint8_t generation8);
+
+private:
+  friend class TranspositionTable;
+
+  static TTData read(uint64_t d) {
+    return { (Move)uint16_t(d), (Value)int16_t(d >> 16), (Value)int16_t(d >> 32),
+             (Depth)uint8_t(d >> 56) + DEPTH_OFFSET,
+             (Bound)(uint8_t(d >> 48) & 0x3), (bool)(uint8_t(d >> 48) & 0x4) };
+  }
+
+  void store(Key k, uint64_t d) { data = d; keyXorData = k ^ d; }
+
+  uint64_t keyXorData;
+  uint64_t data;
+};
+
+#endif
+
+
+#ifdef TT_STATS
+
+/// TTStats holds the TT counters of one thread, compiled in with ttstats=yes
+/// (TT_STATS) and summed over the pool by the 'stats' command. The misses are
+/// split into the ones landing on an empty slot and the ones replacing an
+/// entry, the latter also counted by age (in searches) and depth of the
+/// replaced entry. Collisions are hits whose move is not even pseudo legal.
+
+struct TTStats {
+
+  static constexpr int Buckets = 4;
+
+  void add(const TTStats& s) {
+    hits += s.hits; empty += s.empty; replaced += s.replaced; collisions += s.collisions;
+    for (int i = 0; i < Buckets; ++i)
+        replacedAge[i] += s.replacedAge[i], replacedDepth[i] += s.replacedDepth[i];
+  }
+
+  uint64_t hits, empty, replaced, collisions;
+  uint64_t replacedAge[Buckets];   // 0, 1, 2-3, 4+ searches old
+  uint64_t replacedDepth[Buckets]; // < 1, 1-5, 6-11, 12+ plies
+
+  static thread_local TTStats* current; // Set for the pool threads in Thread::idle_loop()
+};
+
+#endif
+
 
 /// A TranspositionTable is an array of Cluster, of size clusterCount. Each
 /// cluster consists of ClusterSize number of TTEntry. Each non-empty TTEntry
 /// contains information on exactly one position. The size of a Cluster should
 /// divide the size of a cache line for best performance, as the cacheline is
-/// prefetched when possible.
+/// prefetched when possible. By default a cluster is 32 bytes with 3 entries;
+/// building with ttcluster=64 (TT_CLUSTER_BYTES=64) makes it a whole cache
+/// line with 6 entries, so that a probe touches one line and the replacement
+/// scan has twice as many candidates. With the 16 bytes lockless entries a
+/// cluster holds 2 or 4 entries respectively.
+
+#ifndef TT_CLUSTER_BYTES
+#define TT_CLUSTER_BYTES 32
+#endif
+
+static_assert(TT_CLUSTER_BYTES == 32 || TT_CLUSTER_BYTES == 64, "TT_CLUSTER_BYTES must be 32 or 64");
 
 class TranspositionTable {
 
-  static constexpr int ClusterSize = 3;
+  static constexpr int ClusterSize = TT_CLUSTER_BYTES / sizeof(TTEntry);
 
-  struct Cluster {
+  struct alignas(TT_CLUSTER_BYTES) Cluster { // Padded to TT_CLUSTER_BYTES
     TTEntry entry[ClusterSize];
-    char padding[2]; // Pad to 32 bytes
   };
 
-  static_assert(sizeof(Cluster) == 32, "Unexpected Cluster size");
+  static_assert(sizeof(Cluster) == TT_CLUSTER_BYTES, "Unexpected Cluster size");
 
 public:
+  explicit TranspositionTable(ThreadPool& tp) : threads(tp), clusterCount(0), allocatedClusters(0),
+                                                table(nullptr), mem(nullptr), generation8(0) {}
  ~TranspositionTable() { aligned_ttmem_free(mem); }
   void new_search() { generation8 += 8; } // Lower 3 bits are used by PV flag and Bound
-  TTEntry* probe(const Key key, bool& found) const;
-  int hashfull() const;
-  void resize(size_t mbSize);
+  uint8_t generation() const { return generation8; }
+  size_t size() const { return clusterCount * sizeof(Cluster); } // In bytes
+  TTEntry* probe(const Key key, bool& found, TTData& ttData) const;
+  int hashfull(size_t clusters = 1000) const;
+  void resize(size_t mbSize, bool report = false);
   void clear();
+  bool save(const std::string& filename) const;
+  bool load(const std::string& filename);
+  std::string stats() const;
 
   TTEntry* first_entry(const Key key) const {
     return &table[mul_hi64(key, clusterCount)].entry[0];
   }
 
 private:
-  friend struct TTEntry;
+  static uint8_t gen_bound8(const TTEntry* tte);
+  static uint8_t depth8(const TTEntry* tte);
 
+  ThreadPool& threads; // Clears the table, see clear()
   size_t clusterCount;
+  size_t allocatedClusters;
   Cluster* table;
   void* mem;
   uint8_t generation8; // Size must be not bigger than TTEntry::genBound8
 };
 
-extern TranspositionTable TT;
+extern TranspositionTable& TT; // The hash of MainEngine
 
 #endif // #ifndef TT_H_INCLUDED
@@ -37,6 +37,9 @@
 ///
 /// -DUSE_PEXT    | Add runtime support for use of pext asm-instruction. Works
 ///               | only in 64-bit mode and requires hardware with pext support.
+///
+/// -DUSE_DISPATCH | Use popcnt, pext and the AVX2 or AVX-512 NNUE kernels when
+///               | the CPU has them, tested at startup. x86-64 gcc/clang only.
 
 #include <algorithm>
 #include <cassert>
@@ -76,10 +79,31 @@
 #if defined(USE_PEXT)
 #  include <immintrin.h> // Header for _pext_u64() intrinsic
 #  define pext(b, m) _pext_u64(b, m)
+#elif defined(USE_DISPATCH)
+#  define pext(b, m) pext_asm(b, m)
 #else
 #  define pext(b, m) 0
 #endif
 
+#if defined(USE_DISPATCH)
+
+/// With dispatch=yes the build targets the baseline x86-64 and the variants of
+/// the hot kernels are picked at startup for the CPU, see cpu_init() in misc.cpp.
+/// popcount() and Magic::index() test HasPopCnt and HasPext, which are then
+/// always the same branch, and emit the instruction with inline assembly, so
+/// that the rest of the program is not built for it.
+enum SimdLevel { SIMD_SSE2, SIMD_AVX2, SIMD_AVX512 };
+
+extern bool HasPopCnt, HasPext;
+extern SimdLevel CpuSimd;
+
+inline uint64_t pext_asm(uint64_t b, uint64_t m) {
+  __asm__ ("pextq %2, %1, %0" : "=r" (b) : "r" (b), "rm" (m));
+  return b;
+}
+
+#else
+
 #ifdef USE_POPCNT
 constexpr bool HasPopCnt = true;
 #else
@@ -92,6 +116,8 @@ constexpr bool HasPext = true;
 constexpr bool HasPext = false;
 #endif
 
+#endif
+
 #ifdef IS_64BIT
 constexpr bool Is64Bit = true;
 #else
@@ -24,6 +24,8 @@
 #include <sstream>
 #include <string>
 
+#include "cluster.h"
+#include "engine.h"
 #include "evaluate.h"
 #include "movegen.h"
 #include "position.h"
@@ -37,6 +39,10 @@
 using namespace std;
 
 extern vector<string> setup_bench(const Position&, istream&);
+extern void microbench(istream&);
+extern void analyze(istream&);
+extern void evalstream(istream&);
+extern void packfens(istream&);
 
 namespace {
 
@@ -139,6 +145,19 @@ namespace {
         else if (token == "infinite")  limits.infinite = 1;
         else if (token == "ponder")    ponderMode = true;
 
+#ifdef USE_CLUSTER
+    // The workers search until the master stops them, see MainThread::search()
+    if (!limits.perft)
+    {
+        string cmd = "go infinite";
+        if (!limits.searchmoves.empty())
+            cmd += " searchmoves";
+        for (Move m : limits.searchmoves)
+            cmd += " " + UCI::move(m, pos.is_chess960());
+        Cluster::send(cmd);
+    }
+#endif
+
     Threads.start_thinking(pos, states, limits, ponderMode);
   }
 
@@ -176,13 +195,11 @@ namespace {
         }
         else if (token == "setoption")  setoption(is);
         else if (token == "position")   position(pos, is, states);
-        else if (token == "ucinewgame") { Search::clear(); elapsed = now(); } // Search::clear() may take some while
+        else if (token == "ucinewgame") { Search::clear(MainEngine); elapsed = now(); } // Search::clear() may take some while
     }
 
     elapsed = now() - elapsed + 1; // Ensure positivity to avoid a 'divide by zero'
 
-    dbg_print(); // Just before exiting
-
     // GCC PGO fix
     #ifdef __GNUC__
       #ifndef __clang__
@@ -190,10 +207,19 @@ namespace {
       #endif
     #endif
 
+    uint64_t probes = 0, hits = 0;
+    for (Thread* th : Threads)
+        probes += th->evalCache.probes, hits += th->evalCache.hits;
+
     cerr << "\n==========================="
          << "\nTotal time (ms) : " << elapsed
          << "\nNodes searched  : " << nodes
-         << "\nNodes/second    : " << 1000 * nodes / elapsed << endl;
+         << "\nNodes/second    : " << 1000 * nodes / elapsed;
+
+    if (probes)
+        cerr << "\nEval cache hits : " << hits << " of " << probes << " probes";
+
+    cerr << endl;
   }
 
   // The win rate model returns the probability (per mille) of winning given an eval
@@ -247,6 +273,16 @@ void UCI::loop(int argc, char* argv[]) {
       token.clear(); // Avoid a stale if getline() returns empty or blank line
       is >> skipws >> token;
 
+#ifdef USE_CLUSTER
+      // Mirror the commands that set up a search on the worker nodes, and on a
+      // worker run only those of the master
+      if (Cluster::mirrored(cmd))
+          Cluster::send(cmd);
+
+      if (!Cluster::accepted(cmd))
+          continue;
+#endif
+
       if (    token == "quit"
           ||  token == "stop")
           Threads.stop = true;
@@ -266,16 +302,74 @@ void UCI::loop(int argc, char* argv[]) {
       else if (token == "setoption")  setoption(is);
       else if (token == "go")         go(pos, is, states);
       else if (token == "position")   position(pos, is, states);
-      else if (token == "ucinewgame") Search::clear();
-      else if (token == "isready")    sync_cout << "readyok" << sync_endl;
+      else if (token == "ucinewgame") Search::clear(MainEngine);
+      else if (token == "isready")
+      {
+          Threads.wait_for_jobs_finished(); // E.g. the hash clear of 'ucinewgame'
+          sync_cout << "readyok" << sync_endl;
+      }
 
       // Additional custom non-UCI commands, mainly for debugging.
       // Do not use these commands during a search!
       else if (token == "flip")     pos.flip();
       else if (token == "bench")    bench(pos, is, states);
+      else if (token == "analyze")  analyze(is);
+      else if (token == "evalstream") evalstream(is);
+      else if (token == "packfens") packfens(is);
+      else if (token == "microbench")
+      {
+          microbench(is);
+
+          // GCC PGO fix, as for bench
+          #ifdef __GNUC__
+            #ifndef __clang__
+                __gcov_dump();
+            #endif
+          #endif
+      }
+#ifdef USE_CLUSTER
+      else if (token == "ttbatch")  Cluster::receive(is);
+      else if (token == "worker")
+      {
+          if (Cluster::serve(is))
+              loop(1, argv); // Until the master disconnects
+      }
+#endif
       else if (token == "d")        sync_cout << pos << sync_endl;
       else if (token == "eval")     sync_cout << Eval::trace(pos) << sync_endl;
       else if (token == "compiler") sync_cout << compiler_info() << sync_endl;
+      else if (token == "stats")    sync_cout << TT.stats() << "\n" << Search::stats(MainEngine) << sync_endl;
+      else if (token == "export_net")
+      {
+          string filename = "exported.net", format;
+          is >> filename >> format;
+          bool ok = nnue.save(filename, format == "int8" ? NET_INT8 : NET_INT16);
+          sync_cout << (ok ? "Network saved to " : "Failed to save network to ")
+                    << filename << sync_endl;
+      }
+      else if (token == "save_hash" || token == "load_hash")
+      {
+          string filename = "hash.bin";
+          is >> filename;
+
+          // Not inside the sync_cout statement: a load may resize the table,
+          // which prints its own info strings and would block on the IO mutex.
+          if (token == "save_hash")
+          {
+              bool ok = TT.save(filename);
+              sync_cout << (ok ? "Hash saved to " : "Failed to save hash to ")
+                        << filename << sync_endl;
+          }
+          else
+          {
+              bool ok = TT.load(filename);
+              if (ok)
+                  Options["Hash"].set_quietly(std::to_string(TT.size() / (1024 * 1024)));
+
+              sync_cout << (ok ? "Hash loaded from " : "Failed to load hash from ")
+                        << filename << sync_endl;
+          }
+      }
       else
           sync_cout << "Unknown command: " << cmd << sync_endl;
 
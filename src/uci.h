@@ -23,11 +23,14 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include "types.h"
 
 class Position;
 
+namespace Search { struct RootMove; }
+
 namespace UCI {
 
 class Option;
@@ -53,6 +56,7 @@ public:
   Option(const char* v, const char* cur, OnChange = nullptr);
 
   Option& operator=(const std::string&);
+  void set_quietly(const std::string&);
   void operator<<(const Option&);
   operator double() const;
   operator std::string() const;
@@ -67,17 +71,32 @@ private:
   OnChange on_change;
 };
 
+/// Settings is a typed copy of the options read by the search, the evaluation
+/// and the time manager. It is refreshed by the options' on_change actions, so
+/// the hot paths read plain fields instead of looking up the options map.
+struct Settings {
+  bool useNNUE, ponder, analyseMode, limitStrength, showWDL, syzygy50MoveRule, abdada, timerThread, multiPVSplit;
+  int  waitMs, randomizeEval, searchNodes, searchDepth, idleSpin;
+  int  multiPV, skillLevel, elo, contempt;
+  int  moveOverhead, slowMover, nodestime;
+  int  syzygyProbeDepth, syzygyProbeLimit;
+  std::string analysisContempt;
+};
+
 void init(OptionsMap&);
 void loop(int argc, char* argv[]);
 std::string value(Value v);
 std::string square(Square s);
 std::string move(Move m, bool chess960);
 std::string pv(const Position& pos, Depth depth, Value alpha, Value beta);
+std::string pv(const Position& pos, const std::vector<Search::RootMove>& rootMoves,
+               size_t pvIdx, Depth depth, Value alpha, Value beta);
 std::string wdl(Value v, int ply);
 Move to_move(const Position& pos, std::string& str);
 
 } // namespace UCI
 
 extern UCI::OptionsMap Options;
+extern UCI::Settings& Config; // The settings of MainEngine
 
 #endif // #ifndef UCI_H_INCLUDED
@@ -23,6 +23,8 @@
 #include <ostream>
 #include <sstream>
 
+#include "cluster.h"
+#include "engine.h"
 #include "misc.h"
 #include "search.h"
 #include "thread.h"
@@ -33,16 +35,79 @@
 using std::string;
 
 UCI::OptionsMap Options; // Global object
+UCI::Settings& Config = MainEngine.config;
 
 namespace UCI {
 
+/// read_settings() copies the current value of the cached options into Config
+
+void read_settings(OptionsMap& o) {
+
+#ifdef NNUE_ONLY
+  Config.useNNUE          = true;
+#else
+  Config.useNNUE          = bool(o["UseNNUE"]);
+#endif
+  Config.ponder           = bool(o["Ponder"]);
+  Config.analyseMode      = bool(o["UCI_AnalyseMode"]);
+  Config.limitStrength    = bool(o["UCI_LimitStrength"]);
+  Config.showWDL          = bool(o["UCI_ShowWDL"]);
+  Config.syzygy50MoveRule = bool(o["Syzygy50MoveRule"]);
+  Config.abdada           = o["SMP Mode"] == "abdada";
+  Config.timerThread      = bool(o["Timer Thread"]);
+  Config.multiPVSplit     = bool(o["MultiPV Split"]);
+  Config.waitMs           = int(o["Wait ms"]);
+  Config.randomizeEval    = int(o["Randomize Eval"]);
+  Config.searchNodes      = int(o["Search_Nodes"]);
+  Config.searchDepth      = int(o["Search_Depth"]);
+  Config.idleSpin         = int(o["Idle Spin"]);
+  Config.multiPV          = int(o["MultiPV"]);
+  Config.skillLevel       = int(o["Skill Level"]);
+  Config.elo              = int(o["UCI_Elo"]);
+  Config.contempt         = int(o["Contempt"]);
+  Config.moveOverhead     = int(o["Move Overhead"]);
+  Config.slowMover        = int(o["Slow Mover"]);
+  Config.nodestime        = int(o["nodestime"]);
+  Config.syzygyProbeDepth = int(o["SyzygyProbeDepth"]);
+  Config.syzygyProbeLimit = int(o["SyzygyProbeLimit"]);
+  Config.analysisContempt = string(o["Analysis Contempt"]);
+}
+
+
 /// 'On change' actions, triggered by an option's value change
-void on_clear_hash(const Option&) { Search::clear(); }
-void on_hash_size(const Option& o) { TT.resize(size_t(o)); }
+void on_clear_hash(const Option&) { Search::clear(MainEngine); }
+void on_hash_size(const Option& o) { TT.resize(size_t(o), true); }
 void on_logger(const Option& o) { start_logger(o); }
 void on_threads(const Option& o) { Threads.set(size_t(o)); }
+void on_thread_binding(const Option&) { Threads.set(Threads.size()); } // Rebind by recreating
 void on_tb_path(const Option& o) { Tablebases::init(o); }
-void on_nnue_file(const Option& o) { nnue.init(o); }
+#ifdef USE_CLUSTER
+void on_cluster_nodes(const Option& o) { Cluster::init(o); }
+#endif
+void on_tb_preload(const Option&) { Tablebases::preload(); }
+void on_eval_cache(const Option& o) { // Each thread first touches its own cache
+  const size_t mbSize = size_t(o);
+  for (Thread* th : Threads) th->run_custom_job([th, mbSize]() { th->evalCache.resize(mbSize); });
+}
+
+void on_nnue_file(const Option& o) {
+  nnue.init(o, Options["NNUEShared"]);
+  for (Thread* th : Threads) th->run_custom_job([th]() { th->evalCache.clear(); });
+}
+
+void on_nnue_shared(const Option& o) {
+  nnue.init(Options["NNUEFile"], o);
+  for (Thread* th : Threads) th->run_custom_job([th]() { th->evalCache.clear(); });
+}
+void on_setting(const Option&) { read_settings(Options); }
+
+#ifndef NNUE_ONLY
+void on_use_nnue(const Option&) {
+  read_settings(Options);
+  if (!Config.useNNUE)
+      Threads.main()->run_custom_job(Bitbases::init); // Solve it before the search
+}
+#endif
 
 
 /// Our case insensitive less() function as required by UCI protocol
@@ -60,32 +125,48 @@ void init(OptionsMap& o) {
   constexpr int MaxHashMB = Is64Bit ? 33554432 : 2048;
 
   o["Debug Log File"]        << Option("", on_logger);
-  o["Contempt"]              << Option(24, -100, 100);
-  o["Analysis Contempt"]     << Option("Both var Off var White var Black var Both", "Both");
+  o["Contempt"]              << Option(24, -100, 100, on_setting);
+  o["Analysis Contempt"]     << Option("Both var Off var White var Black var Both", "Both", on_setting);
   o["Threads"]               << Option(1, 1, 512, on_threads);
-  o["Wait ms"]               << Option(0, 0, 100);
-  o["Randomize Eval"]        << Option(0, 0, 100);
-  o["Search_Nodes"]          << Option(0, 0, 100000);
-  o["Search_Depth"]          << Option(0, 0, 15);
+  o["SMP Mode"]              << Option("lazy var lazy var abdada", "lazy", on_setting);
+  o["Thread Binding"]        << Option("auto var auto var compact var spread var none", "auto", on_thread_binding);
+  o["Idle Spin"]             << Option(0, 0, 1000, on_setting);
+  o["Wait ms"]               << Option(0, 0, 100, on_setting);
+  o["Randomize Eval"]        << Option(0, 0, 100, on_setting);
+  o["Search_Nodes"]          << Option(0, 0, 100000, on_setting);
+  o["Search_Depth"]          << Option(0, 0, 15, on_setting);
   o["Hash"]                  << Option(16, 1, MaxHashMB, on_hash_size);
   o["Clear Hash"]            << Option(on_clear_hash);
-  o["Ponder"]                << Option(false);
-  o["MultiPV"]               << Option(1, 1, 500);
-  o["Skill Level"]           << Option(20, 0, 20);
-  o["Move Overhead"]         << Option(10, 0, 5000);
-  o["Slow Mover"]            << Option(100, 10, 1000);
-  o["nodestime"]             << Option(0, 0, 10000);
+  o["EvalCache"]             << Option(1, 0, 1024, on_eval_cache);
+  o["Ponder"]                << Option(false, on_setting);
+  o["MultiPV"]               << Option(1, 1, 500, on_setting);
+  o["MultiPV Split"]         << Option(false, on_setting);
+  o["Skill Level"]           << Option(20, 0, 20, on_setting);
+  o["Move Overhead"]         << Option(10, 0, 5000, on_setting);
+  o["Slow Mover"]            << Option(100, 10, 1000, on_setting);
+  o["nodestime"]             << Option(0, 0, 10000, on_setting);
+  o["Timer Thread"]          << Option(false, on_setting);
   o["UCI_Chess960"]          << Option(false);
-  o["UCI_AnalyseMode"]       << Option(false);
-  o["UCI_LimitStrength"]     << Option(false);
-  o["UCI_Elo"]               << Option(1350, 1350, 2850);
-  o["UCI_ShowWDL"]           << Option(false);
+  o["UCI_AnalyseMode"]       << Option(false, on_setting);
+  o["UCI_LimitStrength"]     << Option(false, on_setting);
+  o["UCI_Elo"]               << Option(1350, 1350, 2850, on_setting);
+  o["UCI_ShowWDL"]           << Option(false, on_setting);
   o["SyzygyPath"]            << Option("<empty>", on_tb_path);
-  o["SyzygyProbeDepth"]      << Option(1, 1, 100);
-  o["Syzygy50MoveRule"]      << Option(true);
-  o["SyzygyProbeLimit"]      << Option(7, 0, 7);
-  o["UseNNUE"]               << Option(true);
-  o["NNUEFile"]              << Option("default.net", on_nnue_file);
+  o["SyzygyProbeDepth"]      << Option(1, 1, 100, on_setting);
+  o["Syzygy50MoveRule"]      << Option(true, on_setting);
+  o["SyzygyProbeLimit"]      << Option(7, 0, 7, on_setting);
+  o["SyzygyPreload"]         << Option("off var off var prefault var lock", "off", on_tb_preload);
+  o["SyzygyPreloadLimit"]    << Option(5, 3, 7, on_tb_preload);
+#ifndef NNUE_ONLY
+  o["UseNNUE"]               << Option(true, on_use_nnue);
+#endif
+  o["NNUEFile"]              << Option(EvalFileDefaultName, on_nnue_file);
+  o["NNUEShared"]            << Option(false, on_nnue_shared);
+#ifdef USE_CLUSTER
+  o["Cluster Nodes"]         << Option("<empty>", on_cluster_nodes);
+#endif
+
+  read_settings(o);
 }
 
 
@@ -139,7 +220,7 @@ Option::operator double() const {
 }
 
 Option::operator std::string() const {
-  assert(type == "string");
+  assert(type == "string" || type == "combo");
   return currentValue;
 }
 
@@ -194,4 +275,16 @@ Option& Option::operator=(const string& v) {
   return *this;
 }
 
+
+/// Option::set_quietly() records a new value without calling the on_change
+/// action, for when the engine has already changed the state the option
+/// describes, e.g. the Hash size after 'load_hash'.
+
+void Option::set_quietly(const string& v) {
+
+  assert(!type.empty() && type != "button");
+
+  currentValue = v;
+}
+
 } // namespace UCI